@@ -1,33 +1,271 @@
-layout(std140, binding = 0) buffer DataSsboIn {
-  vec4 data[];
-};
+// The buffer is split across storage buffers, bound as an array since one may not be able to hold
+// all of it. Element i of binding b has address (b << BUFFER_BINDING_SHIFT) + i. Items never span
+// bindings, so the invocations of a dispatch all index the array with the same value.
+//
+// Each binding is viewed as floats and as vec4s. Items start on 16 element boundaries, so the vec4
+// view can be used wherever a run of elements starts at a multiple of 4.
+layout(std430, binding = 0) buffer DataSsbo {
+  float data[];
+} buffers[BUFFER_BINDINGS];
+
+layout(std430, binding = 0) buffer DataSsboVec4 {
+  vec4 data4[];
+} buffers4[BUFFER_BINDINGS];
+
+// A constant index doesn't need dynamic indexing of the array, which not every device supports
+#if BUFFER_BINDINGS == 1
+#define BUFFER_BINDING(pos) 0
+#else
+#define BUFFER_BINDING(pos) ((pos) >> BUFFER_BINDING_SHIFT)
+#endif
+
+const uint BufferOffsetMask = (1u << BUFFER_BINDING_SHIFT) - 1u;
 
 float readBuffer(uint pos) {
-  return data[pos / 4][pos % 4];
+  return buffers[BUFFER_BINDING(pos)].data[pos & BufferOffsetMask];
 }
 
 void writeBuffer(uint pos, float val) {
-  data[pos / 4][pos % 4] = val;
+  buffers[BUFFER_BINDING(pos)].data[pos & BufferOffsetMask] = val;
+}
+
+// pos must be a multiple of 4
+vec4 readBuffer4(uint pos) {
+  return buffers4[BUFFER_BINDING(pos)].data4[(pos & BufferOffsetMask) / 4];
+}
+
+shared float reductionScratch[gl_WorkGroupSize.x];
+
+// Returns the sum of x over the workgroup, whose size must be a power of two. Must be called from
+// uniform control flow.
+float workgroupSum(float x) {
+  uint lane = gl_LocalInvocationID.x;
+
+  reductionScratch[lane] = x;
+  memoryBarrierShared();
+  barrier();
+
+  for (uint n = gl_WorkGroupSize.x / 2; n > 0; n /= 2) {
+    if (lane < n) {
+      reductionScratch[lane] += reductionScratch[lane + n];
+    }
+    memoryBarrierShared();
+    barrier();
+  }
+
+  return reductionScratch[0];
+}
+
+// Returns the sum of x over each run of n consecutive lanes of the workgroup to the lanes of the
+// run, where n is a power of two. lane is the lane's index within its run. Must be called from
+// uniform control flow.
+float segmentedSum(float x, uint lane, uint n) {
+  uint local = gl_LocalInvocationID.x;
+
+  reductionScratch[local] = x;
+  memoryBarrierShared();
+  barrier();
+
+  for (uint m = n / 2; m > 0; m /= 2) {
+    if (lane < m) {
+      reductionScratch[local] += reductionScratch[local + m];
+    }
+    memoryBarrierShared();
+    barrier();
+  }
+
+  return reductionScratch[local - lane];
+}
+
+// The number of elements of the vector matVecMultiply stages in shared memory at once. The executor
+// may define it to a tuned value.
+#ifndef MATVEC_TILE_SIZE
+#define MATVEC_TILE_SIZE 2048
+#endif
+
+const uint MatVecTileSize = MATVEC_TILE_SIZE;
+
+shared float matVecTile[MatVecTileSize];
+shared float matVecRowSums[gl_WorkGroupSize.x];
+
+// Each workgroup computes rowsPerGroup consecutive elements of the result at a time, which is at
+// most the workgroup size, then moves on by the rows of the whole dispatch. The vector is staged
+// through shared memory a tile at a time, and each row is split across a group of lanes, which
+// read it in coalesced runs and then add their partial sums: a subgroup if subgroup arithmetic is
+// available, otherwise gl_WorkGroupSize.x / rowsPerGroup consecutive lanes, which must be a power
+// of two. Must be called from uniform control flow.
+void matVecMultiply(uint mOffset, uint mCols, uint mRows, uint vOffset, uint vSize, uint rOffset,
+  uint rowsPerGroup) {
+
+  uint local = gl_LocalInvocationID.x;
+
+#ifdef SUBGROUP_ARITHMETIC
+  uint rowGroup = gl_SubgroupID;
+  uint numRowGroups = gl_NumSubgroups;
+  uint lane = gl_SubgroupInvocationID;
+  uint lanesPerRow = gl_SubgroupSize;
+#else
+  uint lanesPerRow = gl_WorkGroupSize.x / rowsPerGroup;
+  uint rowGroup = local / lanesPerRow;
+  uint numRowGroups = rowsPerGroup;
+  uint lane = local % lanesPerRow;
+#endif
+
+  for (uint firstRow = gl_WorkGroupID.x * rowsPerGroup; firstRow < mRows;
+    firstRow += gl_NumWorkGroups.x * rowsPerGroup) {
+
+    if (local < rowsPerGroup) {
+      matVecRowSums[local] = 0;
+    }
+
+    for (uint tile = 0; tile < mCols; tile += MatVecTileSize) {
+      uint tileSize = min(MatVecTileSize, mCols - tile);
+
+      // Wait until the previous tile has been used
+      barrier();
+
+      for (uint i = local; i < tileSize; i += gl_WorkGroupSize.x) {
+        matVecTile[i] = readBuffer(vOffset + tile + i);
+      }
+
+      memoryBarrierShared();
+      barrier();
+
+      for (uint r = rowGroup; r < rowsPerGroup; r += numRowGroups) {
+        uint row = firstRow + r;
+        float sum = 0;
+
+        if (row < mRows) {
+          uint rowOffset = mOffset + row * mCols + tile;
+          uint i = 0;
+
+          if (rowOffset % 4 == 0) {
+            for (i = lane * 4; i + 4 <= tileSize; i += lanesPerRow * 4) {
+              vec4 v = vec4(matVecTile[i], matVecTile[i + 1], matVecTile[i + 2], matVecTile[i + 3]);
+              sum += dot(readBuffer4(rowOffset + i), v);
+            }
+            i = tileSize / 4 * 4 + lane;
+          }
+          else {
+            i = lane;
+          }
+
+          for (; i < tileSize; i += lanesPerRow) {
+            sum += readBuffer(rowOffset + i) * matVecTile[i];
+          }
+        }
+
+#ifdef SUBGROUP_ARITHMETIC
+        sum = subgroupAdd(sum);
+#else
+        sum = segmentedSum(sum, lane, lanesPerRow);
+#endif
+
+        if (lane == 0) {
+          matVecRowSums[r] += sum;
+        }
+      }
+    }
+
+    memoryBarrierShared();
+    barrier();
+
+    if (local < rowsPerGroup && firstRow + local < mRows) {
+      writeBuffer(rOffset + firstRow + local, matVecRowSums[local]);
+    }
+  }
+}
+
+// Reductions are split across the workgroups of the dispatch, each of which writes its partial
+// result to rOffset + its index. They read a vec4 at a time up to the last whole vec4 if their
+// inputs start at multiples of 4, then read the remaining elements one at a time.
+float sumPartial(uint vOffset, uint vSize) {
+  float sum = 0;
+  uint end = vOffset % 4 == 0 ? vSize / 4 * 4 : 0;
+  uint stride = gl_NumWorkGroups.x * gl_WorkGroupSize.x;
+
+  for (uint i = gl_GlobalInvocationID.x * 4; i < end; i += stride * 4) {
+    sum += dot(readBuffer4(vOffset + i), vec4(1.0));
+  }
+  for (uint i = end + gl_GlobalInvocationID.x; i < vSize; i += stride) {
+    sum += readBuffer(vOffset + i);
+  }
+
+  return workgroupSum(sum);
 }
 
-void matVecMultiply(uint mOffset, uint mCols, uint mRows, uint vOffset, uint vSize, uint rOffset) {
-  uint index = gl_GlobalInvocationID.x;
-  uint mRowOffset = index * mCols;
+float dotPartial(uint aOffset, uint bOffset, uint size) {
+  float sum = 0;
+  uint end = aOffset % 4 == 0 && bOffset % 4 == 0 ? size / 4 * 4 : 0;
+  uint stride = gl_NumWorkGroups.x * gl_WorkGroupSize.x;
 
+  for (uint i = gl_GlobalInvocationID.x * 4; i < end; i += stride * 4) {
+    sum += dot(readBuffer4(aOffset + i), readBuffer4(bOffset + i));
+  }
+  for (uint i = end + gl_GlobalInvocationID.x; i < size; i += stride) {
+    sum += readBuffer(aOffset + i) * readBuffer(bOffset + i);
+  }
+
+  return workgroupSum(sum);
+}
+
+float squareSumPartial(uint vOffset, uint vSize) {
   float sum = 0;
-  for (uint i = 0; i < mCols; ++i) {
-    sum += readBuffer(mOffset + mRowOffset + i) * readBuffer(vOffset + i);
+  uint end = vOffset % 4 == 0 ? vSize / 4 * 4 : 0;
+  uint stride = gl_NumWorkGroups.x * gl_WorkGroupSize.x;
+
+  for (uint i = gl_GlobalInvocationID.x * 4; i < end; i += stride * 4) {
+    vec4 x = readBuffer4(vOffset + i);
+    sum += dot(x, x);
   }
+  for (uint i = end + gl_GlobalInvocationID.x; i < vSize; i += stride) {
+    float x = readBuffer(vOffset + i);
+    sum += x * x;
+  }
+
+  return workgroupSum(sum);
+}
+
+void writePartial(uint rOffset, float x) {
+  if (gl_LocalInvocationID.x == 0) {
+    writeBuffer(rOffset + gl_WorkGroupID.x, x);
+  }
+}
+
+void vecSum(uint vOffset, uint vSize, uint rOffset) {
+  writePartial(rOffset, sumPartial(vOffset, vSize));
+}
+
+void vecDot(uint aOffset, uint bOffset, uint size, uint rOffset) {
+  writePartial(rOffset, dotPartial(aOffset, bOffset, size));
+}
+
+void vecSquareSum(uint vOffset, uint vSize, uint rOffset) {
+  writePartial(rOffset, squareSumPartial(vOffset, vSize));
+}
+
+// A norm's square root is taken once the squares have been summed, so these run in a single
+// workgroup
+void vecNorm(uint vOffset, uint vSize, uint rOffset) {
+  writePartial(rOffset, sqrt(squareSumPartial(vOffset, vSize)));
+}
 
-  writeBuffer(rOffset + index, sum);
+void vecSumRoot(uint vOffset, uint vSize, uint rOffset) {
+  writePartial(rOffset, sqrt(sumPartial(vOffset, vSize)));
 }
 
-void vecVecAdd(uint aOffset, uint bOffset, uint size, uint rOffset) {
-  uint index = gl_GlobalInvocationID.x;
-  writeBuffer(rOffset + index, readBuffer(aOffset + index) + readBuffer(bOffset + index));
+bool loopExited(uint flagOffset) {
+  return readBuffer(flagOffset) != 0.0;
 }
 
-void vecScalarMultiply(uint vOffset, uint vSize, float x, uint rOffset) {
-  uint index = gl_GlobalInvocationID.x;
-  writeBuffer(rOffset + index, readBuffer(vOffset + index) * x);
+void resetLoopFlag(uint flagOffset) {
+  if (gl_GlobalInvocationID.x == 0) {
+    writeBuffer(flagOffset, 0.0);
+  }
+}
+
+void exitLoopIfBelow(uint xOffset, float threshold, uint flagOffset) {
+  if (gl_GlobalInvocationID.x == 0 && readBuffer(xOffset) < threshold) {
+    writeBuffer(flagOffset, 1.0);
+  }
 }
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "types.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+// Branch-free element functions for use with transform(), computeTransform() and
+// transformInPlace(). They are written so that GCC/Clang can vectorize the evaluation loop without
+// -ffast-math; the exponential is a Cephes-style polynomial approximation with a relative error of
+// a few ulp over the clamped input range [-87, 88].
+
+inline netfloat_t fastExp(netfloat_t x) {
+  // Adding 1.5 * 2^23 rounds to the nearest integer, which then sits in the low mantissa bits
+  const float shift = 12582912.0f;
+  const int32_t shiftBits = 0x4b400000;
+
+  x = std::min(std::max(x, -87.0f), 88.0f);
+
+  float t = x * 1.44269504088896341f + shift;
+  float n = t - shift;
+
+  // Cody-Waite reduction: r = x - n * ln(2) in two parts for extra precision
+  float r = x - n * 0.693359375f;
+  r = r + n * 2.12194440e-4f;
+
+  float p = 1.9875691500e-4f;
+  p = p * r + 1.3981999507e-3f;
+  p = p * r + 8.3334519073e-3f;
+  p = p * r + 4.1665795894e-2f;
+  p = p * r + 1.6666665459e-1f;
+  p = p * r + 5.0000001201e-1f;
+  p = p * r * r + r + 1.0f;
+
+  int32_t bits = 0;
+  memcpy(&bits, &t, sizeof(bits));
+  int32_t scaleBits = (bits - shiftBits + 127) << 23;
+
+  float scale = 0;
+  memcpy(&scale, &scaleBits, sizeof(scale));
+
+  return p * scale;
+}
+
+struct Exp {
+  inline netfloat_t operator()(netfloat_t x) const {
+    return fastExp(x);
+  }
+};
+
+struct Relu {
+  inline netfloat_t operator()(netfloat_t x) const {
+    return std::max(x, netfloat_t(0));
+  }
+};
+
+struct Sigmoid {
+  inline netfloat_t operator()(netfloat_t x) const {
+    return 1.0f / (1.0f + fastExp(-x));
+  }
+};
+
+// Absolute error is around 1e-7; relative error grows for |x| < 1e-4.
+struct Tanh {
+  inline netfloat_t operator()(netfloat_t x) const {
+    return 1.0f - 2.0f / (fastExp(2.0f * x) + 1.0f);
+  }
+};
@@ -4,10 +4,21 @@
 
 void ComputationDesc::chain(const ComputationDesc& c) {
   steps.insert(steps.end(), c.steps.begin(), c.steps.end());
+  outputs.insert(outputs.end(), c.outputs.begin(), c.outputs.end());
 }
 
 Computation::~Computation() {}
 
+ComputationPtr Executor::compile(const Buffer& buffer, const ComputationDesc& desc) const {
+  return compile(buffer, parseComputation(desc));
+}
+
+void Executor::submit(Buffer& buffer, const Computation& computation) const {
+  execute(buffer, computation);
+}
+
+void Executor::wait() const {}
+
 std::vector<std::string> tokenizeCommand(const std::string& command) {
   std::stringstream ss(command);
   std::vector<std::string> tokens;
@@ -32,3 +43,277 @@ std::vector<std::string> tokenizeCommand(const std::string& command) {
 
   return tokens;
 }
+
+namespace {
+
+bool parsenetfloat_t(const std::string& strValue, netfloat_t& value) {
+  std::stringstream ss(strValue);
+  ss >> value;
+  return !ss.fail() && ss.eof();
+}
+
+// Parses "repeat N {" or "repeat N until s < x {", returning false if line isn't a loop header
+bool parseLoopHeader(const std::string& line, size_t& iterations, std::string& condition,
+  netfloat_t& threshold) {
+
+  std::stringstream ss(line);
+  std::vector<std::string> tokens;
+
+  std::string token;
+  while (ss >> token) {
+    tokens.push_back(token);
+  }
+
+  if (tokens.empty() || tokens[0] != "repeat") {
+    return false;
+  }
+
+  std::stringstream count(tokens.size() >= 2 ? tokens[1] : "");
+  count >> iterations;
+
+  bool valid = !count.fail() && count.eof() && tokens.back() == "{";
+
+  if (valid && tokens.size() == 7) {
+    valid = tokens[2] == "until" && tokens[4] == "<" && parsenetfloat_t(tokens[5], threshold);
+    condition = tokens[3];
+  }
+  else {
+    valid = valid && tokens.size() == 3;
+  }
+
+  ASSERT_MSG(valid && tokens[1][0] != '-', "Syntax error: " << line);
+
+  return true;
+}
+
+}
+
+Graph parseComputation(const ComputationDesc& desc) {
+  Graph graph;
+
+  // Condition item and threshold of each open loop; empty if unconditional
+  std::vector<std::pair<std::string, netfloat_t>> loops;
+
+  for (const std::string& command : desc.steps) {
+    std::string line = command;
+    trimLeft(line);
+    trimRight(line);
+
+    size_t iterations = 0;
+    std::string condition;
+    netfloat_t threshold = 0;
+
+    if (parseLoopHeader(line, iterations, condition, threshold)) {
+      graph.beginLoop(iterations);
+      loops.push_back({ condition, threshold });
+      continue;
+    }
+
+    if (line == "}") {
+      ASSERT_MSG(!loops.empty(), "Syntax error: unmatched '}'");
+
+      if (loops.back().first.empty()) {
+        graph.endLoop();
+      }
+      else {
+        graph.endLoop(graph.item(loops.back().first), loops.back().second);
+      }
+      loops.pop_back();
+      continue;
+    }
+
+    std::vector<std::string> tokens = tokenizeCommand(command);
+
+    ASSERT_MSG(tokens.size() >= 2, STR("Syntax error: " << command));
+    const std::string& functionName = tokens[1];
+
+    OpCode op;
+    if (!parseOpCode(functionName, op)) {
+      EXCEPTION("Function '" << functionName << "' not recognised");
+    }
+
+    std::vector<Value> args;
+    for (size_t i = 2; i < tokens.size(); ++i) {
+      netfloat_t value = 0;
+      if (parsenetfloat_t(tokens[i], value)) {
+        args.push_back(graph.constant(value));
+      }
+      else {
+        args.push_back(graph.item(tokens[i]));
+      }
+    }
+
+    graph.assign(graph.item(tokens[0]), graph.apply(op, args));
+  }
+
+  ASSERT_MSG(loops.empty(), "Syntax error: missing '}'");
+
+  for (const std::string& name : desc.outputs) {
+    graph.markOutput(graph.item(name));
+  }
+
+  return graph;
+}
+
+namespace {
+
+std::string describeType(const ValueType& type) {
+  switch (type.type) {
+    case MathObjectType::Array:
+      return STR("vector of size " << type.shape[0]);
+    case MathObjectType::Array2:
+      return STR(type.shape[1] << "x" << type.shape[0] << " matrix");
+    case MathObjectType::Array3:
+      return STR(type.shape[0] << "x" << type.shape[1] << "x" << type.shape[2] << " kernel");
+    case MathObjectType::Scalar:
+      return "scalar";
+  }
+  return "unknown";
+}
+
+bool operator==(const ValueType& a, const ValueType& b) {
+  return a.type == b.type && a.shape == b.shape;
+}
+
+bool isType(const ValueType* value, MathObjectType type) {
+  return value != nullptr && value->type == type;
+}
+
+// Constant arguments are null. Returns false if there's no function matching the argument types.
+bool inferResultType(OpCode op, const ValueType* a, const ValueType* b, ValueType& result,
+  std::string& error) {
+
+  const ValueType scalar{ MathObjectType::Scalar, { 1, 1, 1 } };
+
+  switch (op) {
+    case OpCode::Copy:
+      if (a != nullptr) {
+        result = *a;
+        return true;
+      }
+      break;
+    case OpCode::Add:
+      if (isType(a, MathObjectType::Array) && isType(b, MathObjectType::Array)) {
+        if (a->shape[0] != b->shape[0]) {
+          error = STR("Cannot add vectors of sizes " << a->shape[0] << " and " << b->shape[0]);
+          return false;
+        }
+        result = *a;
+        return true;
+      }
+      break;
+    case OpCode::Multiply:
+      if (isType(a, MathObjectType::Array) && b == nullptr) {
+        result = *a;
+        return true;
+      }
+      if (isType(a, MathObjectType::Array2) && isType(b, MathObjectType::Array)) {
+        if (a->shape[0] != b->shape[0]) {
+          error = STR("Cannot multiply a " << describeType(*a) << " with a " << describeType(*b));
+          return false;
+        }
+        result = ValueType{ MathObjectType::Array, { a->shape[1], 1, 1 } };
+        return true;
+      }
+      break;
+    case OpCode::Sum:
+      if (isType(a, MathObjectType::Array) || isType(a, MathObjectType::Array2)) {
+        result = scalar;
+        return true;
+      }
+      break;
+    case OpCode::Dot:
+      if (isType(a, MathObjectType::Array) && isType(b, MathObjectType::Array)) {
+        if (a->shape[0] != b->shape[0]) {
+          error = STR("Cannot dot vectors of sizes " << a->shape[0] << " and " << b->shape[0]);
+          return false;
+        }
+        result = scalar;
+        return true;
+      }
+      break;
+    case OpCode::Norm:
+      if (isType(a, MathObjectType::Array)) {
+        result = scalar;
+        return true;
+      }
+      break;
+    case OpCode::LoopBegin:
+    case OpCode::LoopEnd:
+      break;
+  }
+
+  error = STR("No function '" << opCodeName(op) << "' matching argument types");
+  return false;
+}
+
+}
+
+GraphTypes inferTypes(const Graph& graph, const std::vector<ValueType>& itemTypes) {
+  ASSERT(itemTypes.size() == graph.numItems());
+
+  GraphTypes types;
+  types.items = itemTypes;
+  types.temporaries.resize(graph.numTemporaries());
+
+  auto typeOf = [&types](Value value) -> const ValueType* {
+    switch (value.kind) {
+      case ValueKind::Item: return &types.items[value.index];
+      case ValueKind::Temporary: return &types.temporaries[value.index];
+      case ValueKind::Constant: return nullptr;
+    }
+    return nullptr;
+  };
+
+  const std::vector<Instruction>& instructions = graph.instructions();
+  std::vector<size_t> openLoops;
+
+  for (size_t i = 0; i < instructions.size(); ++i) {
+    const Instruction& instruction = instructions[i];
+
+    if (instruction.op == OpCode::LoopBegin) {
+      openLoops.push_back(i);
+      continue;
+    }
+
+    if (instruction.op == OpCode::LoopEnd) {
+      ASSERT_MSG(!openLoops.empty(), "Loop end without a matching loop");
+
+      const Instruction& begin = instructions[openLoops.back()];
+      const Loop& loop = graph.loop(begin);
+      openLoops.pop_back();
+
+      if (loop.conditional && !isType(typeOf(loop.condition), MathObjectType::Scalar)) {
+        EXCEPTION("In step '" << graph.describe(begin) << "': Loop condition must be a scalar");
+      }
+      continue;
+    }
+
+    size_t arity = opCodeArity(instruction.op);
+    const ValueType* a = arity > 0 ? typeOf(instruction.args[0]) : nullptr;
+    const ValueType* b = arity > 1 ? typeOf(instruction.args[1]) : nullptr;
+
+    ValueType type;
+    std::string error;
+    if (!inferResultType(instruction.op, a, b, type, error)) {
+      EXCEPTION("In step '" << graph.describe(instruction) << "': " << error);
+    }
+
+    if (instruction.result.kind == ValueKind::Item) {
+      const ValueType& dst = types.items[instruction.result.index];
+      if (!(dst == type)) {
+        EXCEPTION("In step '" << graph.describe(instruction) << "': Cannot assign a "
+          << describeType(type) << " to '" << graph.itemName(instruction.result) << "', a "
+          << describeType(dst));
+      }
+    }
+    else {
+      ASSERT(instruction.result.kind == ValueKind::Temporary);
+      types.temporaries[instruction.result.index] = type;
+    }
+  }
+
+  ASSERT_MSG(openLoops.empty(), "Loop has no end");
+
+  return types;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "math.hpp"
+#include "graph.hpp"
 #include <string>
 #include <memory>
 #include <vector>
@@ -10,14 +11,37 @@ class Buffer {
     virtual void insert(const std::string& name, Array& item) = 0;
     virtual void insert(const std::string& name, Array2& item) = 0;
     virtual void insert(const std::string& name, Array3& item) = 0;
+    virtual void insert(const std::string& name, Scalar& item) = 0;
+
+    // A constant item is one the host doesn't modify between executes, so executors may keep it
+    // resident rather than uploading it each time, or even keep it in device memory the host can
+    // map. Call markDirty() after modifying it anyway, which mustn't be done while submissions
+    // against the buffer are outstanding.
+    virtual void setConstant(const std::string& name, bool constant = true) = 0;
+    virtual void markDirty(const std::string& name) = 0;
 
     virtual ~Buffer() {}
 };
 
 using BufferPtr = std::unique_ptr<Buffer>;
 
+// Each step is a command such as "C = add A B", or a line of a loop:
+//
+//   repeat 10 {
+//   C = add C B
+//   }
+//
+// A loop header may also read "repeat 100 until r < 0.001 {", which exits early once the scalar
+// item r is below the threshold at the end of an iteration. The GPU executor records every
+// iteration up front, so it rejects computations whose loops expand to too many dispatches.
+//
+// outputs names the items the caller reads after executing. Executors that run on a device only
+// copy those back; if it's empty, every item is copied back. Other items the computation writes
+// are then only up to date on the device, which keeps them until they're marked dirty, and copies
+// them back when it lets go of the buffer.
 struct ComputationDesc {
   std::vector<std::string> steps;
+  std::vector<std::string> outputs;
 
   void chain(const ComputationDesc& c);
 };
@@ -31,8 +55,18 @@ using ComputationPtr = std::unique_ptr<Computation>;
 
 class Executor {
   public:
-    virtual ComputationPtr compile(const Buffer& buffer, const ComputationDesc& desc) const = 0;
+    // Lowers desc with parseComputation() and compiles the resulting graph
+    ComputationPtr compile(const Buffer& buffer, const ComputationDesc& desc) const;
+    virtual ComputationPtr compile(const Buffer& buffer, const Graph& graph) const = 0;
     virtual void execute(Buffer& buffer, const Computation& computation) const = 0;
+    // For streaming requests through a computation. submit() returns once the computation's inputs
+    // have been read from the buffer, so the caller can write the next request's while it runs, and
+    // wait() copies the outputs of the oldest submission not yet waited for back into its buffer.
+    // Executors may limit how many submissions can be outstanding. By default, submit() executes
+    // the computation there and then. A buffer must outlive its outstanding submissions, since
+    // wait() writes to it.
+    virtual void submit(Buffer& buffer, const Computation& computation) const;
+    virtual void wait() const;
 
     virtual ~Executor() {}
 };
@@ -40,3 +74,20 @@ class Executor {
 using ExecutorPtr = std::unique_ptr<Executor>;
 
 std::vector<std::string> tokenizeCommand(const std::string& command);
+Graph parseComputation(const ComputationDesc& desc);
+
+struct ValueType {
+  MathObjectType type;
+  Triple shape;
+};
+
+// The types of a graph's items and temporaries, indexed by Value::index
+struct GraphTypes {
+  std::vector<ValueType> items;
+  std::vector<ValueType> temporaries;
+};
+
+// Checks the argument and result types of every instruction against the types of the graph's items
+// and infers the type of each temporary, so executors can compile without validating anything.
+// Errors name the offending step.
+GraphTypes inferTypes(const Graph& graph, const std::vector<ValueType>& itemTypes);
@@ -4,11 +4,12 @@
 #include "utils.hpp"
 #include <variant>
 #include <map>
+#include <deque>
 #include <functional>
 
 namespace {
 
-using MathObjectPtr = std::variant<ArrayPtr, Array2Ptr, Array3Ptr>;
+using MathObjectPtr = std::variant<ArrayPtr, Array2Ptr, Array3Ptr, ScalarPtr>;
 
 class CpuBuffer : public Buffer {
   public:
@@ -20,6 +21,9 @@ class CpuBuffer : public Buffer {
     void insert(const std::string& name, Array& object) override;
     void insert(const std::string& name, Array2& object) override;
     void insert(const std::string& name, Array3& object) override;
+    void insert(const std::string& name, Scalar& object) override;
+    void setConstant(const std::string& name, bool constant) override;
+    void markDirty(const std::string& name) override;
 
     std::vector<MathObjectPtr> items;
     std::map<std::string, Entry> entries;
@@ -43,6 +47,21 @@ void CpuBuffer::insert(const std::string& name, Array3& item) {
   entries[name] = Entry{ index, MathObjectType::Array3 };
 }
 
+void CpuBuffer::insert(const std::string& name, Scalar& item) {
+  size_t index = items.size();
+  items.push_back(Scalar::createShallow(item.storage()));
+  entries[name] = Entry{ index, MathObjectType::Scalar };
+}
+
+// Items are used in place, so there's nothing to track
+void CpuBuffer::setConstant(const std::string& name, bool) {
+  ASSERT_MSG(entries.count(name) != 0, "Buffer has no item named '" << name << "'");
+}
+
+void CpuBuffer::markDirty(const std::string& name) {
+  ASSERT_MSG(entries.count(name) != 0, "Buffer has no item named '" << name << "'");
+}
+
 using CpuComputationStepFn = std::function<void()>;
 
 struct CpuComputationStep {
@@ -53,6 +72,8 @@ struct CpuComputationStep {
 class CpuComputation : public Computation {
   public:
     std::vector<CpuComputationStep> steps;
+    // Storage for the graph's temporaries. A deque, so steps can hold references into it.
+    std::deque<MathObjectPtr> temporaries;
 };
 
 using CpuComputationPtr = std::unique_ptr<CpuComputation>;
@@ -61,31 +82,37 @@ class CpuExecutor : public Executor {
   public:
     CpuExecutor(Logger& logger);
   
-    ComputationPtr compile(const Buffer& buffer, const ComputationDesc& desc) const override;
+    ComputationPtr compile(const Buffer& buffer, const Graph& graph) const override;
     void execute(Buffer& buffer, const Computation& computation) const override;
 
   private:
     Logger& m_logger;
 };
 
+MathObjectType objectType(const MathObjectPtr& object) {
+  return std::visit([](const auto& ptr) { return ptr->type(); }, object);
+}
+
 class Token {
   public:
     Token(netfloat_t value);
-    Token(const CpuBuffer::Entry& bufferEntry);
+    Token(const MathObjectPtr& object);
 
     bool isNumeric() const;
     netfloat_t floatValue() const;
-    const CpuBuffer::Entry& bufferEntry() const;
+    MathObjectType type() const;
+    template<class T>
+    T& object() const;
 
   private:
-    std::variant<netfloat_t, CpuBuffer::Entry> m_value;
+    std::variant<netfloat_t, const MathObjectPtr*> m_value;
 };
 
 Token::Token(netfloat_t value)
   : m_value(value) {}
 
-Token::Token(const CpuBuffer::Entry& bufferEntry)
-  : m_value(bufferEntry) {}
+Token::Token(const MathObjectPtr& object)
+  : m_value(&object) {}
 
 bool Token::isNumeric() const {
   return std::holds_alternative<netfloat_t>(m_value);
@@ -95,48 +122,163 @@ netfloat_t Token::floatValue() const {
   return std::get<netfloat_t>(m_value);
 }
 
-const CpuBuffer::Entry& Token::bufferEntry() const {
-  return std::get<CpuBuffer::Entry>(m_value);
+MathObjectType Token::type() const {
+  return objectType(*std::get<const MathObjectPtr*>(m_value));
 }
 
-bool parsenetfloat_t(const std::string& strValue, netfloat_t& value) {
-  std::stringstream ss(strValue);
-  ss >> value;
-  return !ss.fail() && ss.eof();
+template<class T>
+T& Token::object() const {
+  return *std::get<std::unique_ptr<T>>(*std::get<const MathObjectPtr*>(m_value));
 }
 
-Token parseToken(const CpuBuffer& buffer, const std::string& strToken) {
-  netfloat_t value = 0;
-  if (parsenetfloat_t(strToken, value)) {
-    return value;
+MathObjectPtr createObject(const ValueType& type) {
+  switch (type.type) {
+    case MathObjectType::Array:
+      return std::make_unique<Vector>(type.shape[0]);
+    case MathObjectType::Array2:
+      return std::make_unique<Matrix>(type.shape[0], type.shape[1]);
+    case MathObjectType::Array3:
+      return std::make_unique<Kernel>(type.shape[0], type.shape[1], type.shape[2]);
+    case MathObjectType::Scalar:
+      return std::make_unique<Scalar>();
   }
-  else {
-    return buffer.entries.at(strToken);
+  EXCEPTION("Invalid type");
+}
+
+// Maps the values of a graph to buffer items, temporaries and constants. The graph's types are
+// inferred and checked on construction.
+class Operands {
+  public:
+    Operands(const CpuBuffer& buffer, const Graph& graph, CpuComputation& computation);
+
+    Token get(Value value) const;
+
+    // Returns the object the result is written to, constructing a temporary if needed
+    template<class T>
+    T& result(Value value);
+
+  private:
+    const Graph& m_graph;
+    CpuComputation& m_computation;
+    GraphTypes m_types;
+    std::vector<const MathObjectPtr*> m_items;
+    std::vector<const MathObjectPtr*> m_temporaries;
+};
+
+Operands::Operands(const CpuBuffer& buffer, const Graph& graph, CpuComputation& computation)
+  : m_graph(graph)
+  , m_computation(computation)
+  , m_temporaries(graph.numTemporaries(), nullptr) {
+
+  std::vector<ValueType> itemTypes;
+
+  for (size_t i = 0; i < graph.numItems(); ++i) {
+    const std::string& name = graph.itemName(Value{ ValueKind::Item, uint32_t(i) });
+
+    auto entry = buffer.entries.find(name);
+    if (entry == buffer.entries.end()) {
+      EXCEPTION("Buffer has no item named '" << name << "'");
+    }
+
+    const MathObjectPtr& object = buffer.items[entry->second.index];
+    m_items.push_back(&object);
+    itemTypes.push_back(std::visit([](const auto& ptr) {
+      return ValueType{ ptr->type(), ptr->shape() };
+    }, object));
+  }
+
+  m_types = inferTypes(graph, itemTypes);
+}
+
+Token Operands::get(Value value) const {
+  switch (value.kind) {
+    case ValueKind::Item:
+      return *m_items[value.index];
+    case ValueKind::Temporary:
+      ASSERT(m_temporaries[value.index] != nullptr);
+      return *m_temporaries[value.index];
+    case ValueKind::Constant:
+      return m_graph.constantValue(value);
   }
+  EXCEPTION("Invalid value");
 }
 
-CpuComputationStep compileMultiplyCommand(const CpuBuffer& buffer,
-  const std::vector<std::string>& tokens) {
+template<class T>
+T& Operands::result(Value value) {
+  if (value.kind == ValueKind::Item) {
+    return *std::get<std::unique_ptr<T>>(*m_items[value.index]);
+  }
+
+  ASSERT(value.kind == ValueKind::Temporary);
 
-  const CpuBuffer::Entry& returnVal = buffer.entries.at(tokens[0]);
-  const std::string& functionName = tokens[1];
-  
-  ASSERT(functionName == "multiply");
-  ASSERT(tokens.size() == 4);
+  m_computation.temporaries.push_back(createObject(m_types.temporaries[value.index]));
+  m_temporaries[value.index] = &m_computation.temporaries.back();
+
+  return *std::get<std::unique_ptr<T>>(m_computation.temporaries.back());
+}
 
+CpuComputationStep compileCopyInstruction(Operands& operands, const Instruction& instruction) {
   CpuComputationStep step;
-  step.command = functionName;
 
-  Token arg1 = parseToken(buffer, tokens[2]);
-  Token arg2 = parseToken(buffer, tokens[3]);
+  Token arg1 = operands.get(instruction.args[0]);
+
+  if (arg1.isNumeric()) {
+    EXCEPTION("No function 'copy' matching argument types");
+  }
+  else if (arg1.type() == MathObjectType::Array) {
+    Vector& V = arg1.object<Vector>();
+    Vector& R = operands.result<Vector>(instruction.result);
+
+    step.function = [&R, &V]() {
+      R = V;
+    };
+  }
+  else if (arg1.type() == MathObjectType::Array2) {
+    Matrix& M = arg1.object<Matrix>();
+    Matrix& R = operands.result<Matrix>(instruction.result);
+
+    step.function = [&R, &M]() {
+      R = M;
+    };
+  }
+  else if (arg1.type() == MathObjectType::Array3) {
+    Kernel& K = arg1.object<Kernel>();
+    Kernel& R = operands.result<Kernel>(instruction.result);
+
+    step.function = [&R, &K]() {
+      R = K;
+    };
+  }
+  else if (arg1.type() == MathObjectType::Scalar) {
+    Scalar& x = arg1.object<Scalar>();
+    Scalar& r = operands.result<Scalar>(instruction.result);
+
+    step.function = [&r, &x]() {
+      r = x;
+    };
+  }
+  else {
+    EXCEPTION("No function 'copy' matching argument types");
+  }
+
+  return step;
+}
+
+CpuComputationStep compileMultiplyInstruction(Operands& operands,
+  const Instruction& instruction) {
+
+  CpuComputationStep step;
+
+  Token arg1 = operands.get(instruction.args[0]);
+  Token arg2 = operands.get(instruction.args[1]);
 
   if (arg1.isNumeric()) {
     EXCEPTION("No function 'multiply' matching argument types");
   }
-  else if (arg1.bufferEntry().type == MathObjectType::Array) {
+  else if (arg1.type() == MathObjectType::Array) {
     if (arg2.isNumeric()) {
-      Vector& R = *(std::get<VectorPtr>(buffer.items[returnVal.index]));
-      Vector& V = *(std::get<VectorPtr>(buffer.items[arg1.bufferEntry().index]));
+      Vector& V = arg1.object<Vector>();
+      Vector& R = operands.result<Vector>(instruction.result);
       netfloat_t x = arg2.floatValue();
 
       step.function = [&R, &V, x]() {
@@ -147,14 +289,14 @@ CpuComputationStep compileMultiplyCommand(const CpuBuffer& buffer,
       EXCEPTION("No function 'multiply' matching argument types");
     }
   }
-  else if (arg1.bufferEntry().type == MathObjectType::Array2) {
+  else if (arg1.type() == MathObjectType::Array2) {
     if (arg2.isNumeric()) {
       EXCEPTION("No function 'multiply' matching argument types");
     }
-    else if (arg2.bufferEntry().type == MathObjectType::Array) {
-      Vector& R = *(std::get<VectorPtr>(buffer.items[returnVal.index]));
-      Matrix& M = *(std::get<MatrixPtr>(buffer.items[arg1.bufferEntry().index]));
-      Vector& V = *(std::get<VectorPtr>(buffer.items[arg2.bufferEntry().index]));
+    else if (arg2.type() == MathObjectType::Array) {
+      Matrix& M = arg1.object<Matrix>();
+      Vector& V = arg2.object<Vector>();
+      Vector& R = operands.result<Vector>(instruction.result);
 
       step.function = [&R, &M, &V]() {
         R = M * V;
@@ -171,32 +313,23 @@ CpuComputationStep compileMultiplyCommand(const CpuBuffer& buffer,
   return step;
 }
 
-CpuComputationStep compileAddCommand(const CpuBuffer& buffer,
-  const std::vector<std::string>& tokens) {
-
-  const CpuBuffer::Entry& returnVal = buffer.entries.at(tokens[0]);
-  const std::string& functionName = tokens[1];
-  
-  ASSERT(functionName == "add");
-  ASSERT(tokens.size() == 4);
-
+CpuComputationStep compileAddInstruction(Operands& operands, const Instruction& instruction) {
   CpuComputationStep step;
-  step.command = functionName;
 
-  Token arg1 = parseToken(buffer, tokens[2]);
-  Token arg2 = parseToken(buffer, tokens[3]);
+  Token arg1 = operands.get(instruction.args[0]);
+  Token arg2 = operands.get(instruction.args[1]);
 
   if (arg1.isNumeric()) {
     EXCEPTION("No function 'add' matching argument types");
   }
-  else if (arg1.bufferEntry().type == MathObjectType::Array) {
+  else if (arg1.type() == MathObjectType::Array) {
     if (arg2.isNumeric()) {
       EXCEPTION("No function 'add' matching argument types");
     }
-    else if (arg2.bufferEntry().type == MathObjectType::Array) {
-      Vector& R = *(std::get<VectorPtr>(buffer.items[returnVal.index]));
-      Vector& A = *(std::get<VectorPtr>(buffer.items[arg1.bufferEntry().index]));
-      Vector& B = *(std::get<VectorPtr>(buffer.items[arg2.bufferEntry().index]));
+    else if (arg2.type() == MathObjectType::Array) {
+      Vector& A = arg1.object<Vector>();
+      Vector& B = arg2.object<Vector>();
+      Vector& R = operands.result<Vector>(instruction.result);
 
       step.function = [&R, &A, &B]() {
         R = A + B;
@@ -213,35 +346,181 @@ CpuComputationStep compileAddCommand(const CpuBuffer& buffer,
   return step;
 }
 
-CpuComputationStep compileCommand(const Buffer& buf, const std::string& command) {
-  const auto& buffer = dynamic_cast<const CpuBuffer&>(buf);
+CpuComputationStep compileSumInstruction(Operands& operands, const Instruction& instruction) {
+  CpuComputationStep step;
+
+  Token arg1 = operands.get(instruction.args[0]);
+
+  if (arg1.isNumeric()) {
+    EXCEPTION("No function 'sum' matching argument types");
+  }
+  else if (arg1.type() == MathObjectType::Array) {
+    Vector& V = arg1.object<Vector>();
+    Scalar& s = operands.result<Scalar>(instruction.result);
 
-  std::vector<std::string> tokens = tokenizeCommand(command);
+    step.function = [&s, &V]() {
+      s = V.sum();
+    };
+  }
+  else if (arg1.type() == MathObjectType::Array2) {
+    Matrix& M = arg1.object<Matrix>();
+    Scalar& s = operands.result<Scalar>(instruction.result);
 
-  ASSERT(tokens.size() >= 2);
-  const std::string& functionName = tokens[1];
+    step.function = [&s, &M]() {
+      s = M.sum();
+    };
+  }
+  else {
+    EXCEPTION("No function 'sum' matching argument types");
+  }
 
-  if (functionName == "multiply") {
-    return compileMultiplyCommand(buffer, tokens);
+  return step;
+}
+
+CpuComputationStep compileDotInstruction(Operands& operands, const Instruction& instruction) {
+  CpuComputationStep step;
+
+  Token arg1 = operands.get(instruction.args[0]);
+  Token arg2 = operands.get(instruction.args[1]);
+
+  if (arg1.isNumeric() || arg2.isNumeric()) {
+    EXCEPTION("No function 'dot' matching argument types");
   }
-  else if (functionName == "add") {
-    return compileAddCommand(buffer, tokens);
+  else if (arg1.type() == MathObjectType::Array && arg2.type() == MathObjectType::Array) {
+    Vector& A = arg1.object<Vector>();
+    Vector& B = arg2.object<Vector>();
+    Scalar& s = operands.result<Scalar>(instruction.result);
+
+    step.function = [&s, &A, &B]() {
+      s = A.dot(B);
+    };
   }
   else {
-    EXCEPTION("Function '" << functionName << "' not recognised");
+    EXCEPTION("No function 'dot' matching argument types");
   }
+
+  return step;
+}
+
+CpuComputationStep compileNormInstruction(Operands& operands, const Instruction& instruction) {
+  CpuComputationStep step;
+
+  Token arg1 = operands.get(instruction.args[0]);
+
+  if (arg1.isNumeric()) {
+    EXCEPTION("No function 'norm' matching argument types");
+  }
+  else if (arg1.type() == MathObjectType::Array) {
+    Vector& V = arg1.object<Vector>();
+    Scalar& s = operands.result<Scalar>(instruction.result);
+
+    step.function = [&s, &V]() {
+      s = V.magnitude();
+    };
+  }
+  else {
+    EXCEPTION("No function 'norm' matching argument types");
+  }
+
+  return step;
+}
+
+CpuComputationStep compileInstruction(Operands& operands, const Instruction& instruction) {
+  switch (instruction.op) {
+    case OpCode::Copy: return compileCopyInstruction(operands, instruction);
+    case OpCode::Multiply: return compileMultiplyInstruction(operands, instruction);
+    case OpCode::Add: return compileAddInstruction(operands, instruction);
+    case OpCode::Sum: return compileSumInstruction(operands, instruction);
+    case OpCode::Dot: return compileDotInstruction(operands, instruction);
+    case OpCode::Norm: return compileNormInstruction(operands, instruction);
+    case OpCode::LoopBegin:
+    case OpCode::LoopEnd: break;
+  }
+
+  EXCEPTION("Function '" << opCodeName(instruction.op) << "' not supported");
+}
+
+CpuComputationStep compileLoop(Operands& operands, const Graph& graph, size_t& i);
+
+// Compiles instructions from i until the end of the enclosing loop, leaving i at its LoopEnd
+void compileBlock(Operands& operands, const Graph& graph, size_t& i,
+  std::vector<CpuComputationStep>& steps) {
+
+  const std::vector<Instruction>& instructions = graph.instructions();
+
+  for (; i < instructions.size(); ++i) {
+    const Instruction& instruction = instructions[i];
+
+    if (instruction.op == OpCode::LoopEnd) {
+      return;
+    }
+
+    CpuComputationStep step = instruction.op == OpCode::LoopBegin ?
+      compileLoop(operands, graph, i) :
+      compileInstruction(operands, instruction);
+
+#ifndef NDEBUG
+    step.command = graph.describe(instruction);
+#endif
+    steps.push_back(step);
+  }
+}
+
+CpuComputationStep compileLoop(Operands& operands, const Graph& graph, size_t& i) {
+  const Loop& loop = graph.loop(graph.instructions()[i]);
+
+  std::vector<CpuComputationStepFn> body;
+  {
+    std::vector<CpuComputationStep> bodySteps;
+    compileBlock(operands, graph, ++i, bodySteps);
+
+    for (const auto& step : bodySteps) {
+      body.push_back(step.function);
+    }
+  }
+
+  CpuComputationStep step;
+  size_t maxIterations = loop.maxIterations;
+
+  if (loop.conditional) {
+    const Scalar& s = operands.get(loop.condition).object<Scalar>();
+    netfloat_t threshold = loop.threshold;
+
+    step.function = [body, maxIterations, &s, threshold]() {
+      for (size_t n = 0; n < maxIterations; ++n) {
+        for (const auto& fn : body) {
+          fn();
+        }
+        if (s.value() < threshold) {
+          break;
+        }
+      }
+    };
+  }
+  else {
+    step.function = [body, maxIterations]() {
+      for (size_t n = 0; n < maxIterations; ++n) {
+        for (const auto& fn : body) {
+          fn();
+        }
+      }
+    };
+  }
+
+  return step;
 }
 
 CpuExecutor::CpuExecutor(Logger& logger)
   : m_logger(logger) {}
 
-ComputationPtr CpuExecutor::compile(const Buffer& buffer, const ComputationDesc& desc) const {
+ComputationPtr CpuExecutor::compile(const Buffer& buf, const Graph& graph) const {
+  const auto& buffer = dynamic_cast<const CpuBuffer&>(buf);
+
   auto computation = std::make_unique<CpuComputation>();
+  Operands operands(buffer, graph, *computation);
 
-  for (const std::string& command : desc.steps) {
-    CpuComputationStep step = compileCommand(buffer, command);
-    computation->steps.push_back(step);
-  }
+  size_t i = 0;
+  compileBlock(operands, graph, i, computation->steps);
 
   return computation;
 }
@@ -0,0 +1,61 @@
+#include "free_list.hpp"
+#include <algorithm>
+#include <iterator>
+
+FreeList::FreeList(uint64_t size) {
+  if (size > 0) {
+    m_ranges[0] = size;
+  }
+}
+
+bool FreeList::allocate(uint64_t size, uint64_t alignment, uint64_t& offset) {
+  alignment = std::max<uint64_t>(alignment, 1);
+
+  for (auto i = m_ranges.begin(); i != m_ranges.end(); ++i) {
+    uint64_t rangeOffset = i->first;
+    uint64_t rangeEnd = i->first + i->second;
+    uint64_t alignedOffset = (rangeOffset + alignment - 1) / alignment * alignment;
+
+    if (alignedOffset + size > rangeEnd) {
+      continue;
+    }
+
+    m_ranges.erase(i);
+
+    if (alignedOffset > rangeOffset) {
+      m_ranges[rangeOffset] = alignedOffset - rangeOffset;
+    }
+
+    uint64_t end = alignedOffset + size;
+    if (end < rangeEnd) {
+      m_ranges[end] = rangeEnd - end;
+    }
+
+    offset = alignedOffset;
+    return true;
+  }
+
+  return false;
+}
+
+void FreeList::free(uint64_t offset, uint64_t size) {
+  auto next = m_ranges.lower_bound(offset);
+  if (next != m_ranges.end() && next->first == offset + size) {
+    size += next->second;
+    next = m_ranges.erase(next);
+  }
+
+  if (next != m_ranges.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      prev->second += size;
+      return;
+    }
+  }
+
+  m_ranges[offset] = size;
+}
+
+const std::map<uint64_t, uint64_t>& FreeList::ranges() const {
+  return m_ranges;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+
+// The free ranges of a block of memory. Allocation is first fit, and freed ranges are merged with
+// their neighbours.
+class FreeList {
+  public:
+    explicit FreeList(uint64_t size);
+
+    // Returns false if no free range can hold size bytes at the alignment. Any space skipped to
+    // align the allocation stays free.
+    bool allocate(uint64_t size, uint64_t alignment, uint64_t& offset);
+    void free(uint64_t offset, uint64_t size);
+
+    // Offset and size of each free range
+    const std::map<uint64_t, uint64_t>& ranges() const;
+
+  private:
+    std::map<uint64_t, uint64_t> m_ranges;
+};
@@ -3,19 +3,104 @@
 #include <string>
 #include <memory>
 #include <vector>
+#include <cstdint>
 
 using ShaderHandle = size_t;
+using CommandsHandle = size_t;
+using BufferHandle = size_t;
+using FrameHandle = uint64_t;
+
+// The number of 32-bit push constants a dispatch can have; 128 bytes is the least any device
+// supports
+const size_t MaxDispatchParameters = 32;
+
+// The device buffer is split across up to MaxBufferBindings storage buffers, bound as an array.
+// Shaders address element i of binding b as (b << BufferBindingShift) + i.
+const size_t MaxBufferBindings = 16;
+const size_t BufferBindingShift = 28;
+
+// Each frame of a device buffer has its own copy of the bindings that aren't shared, so the
+// transfers of one request can overlap with the dispatches of another
+const size_t FramesInFlight = 2;
+// The most device buffers a Gpu can hold at once
+const size_t MaxGpuBuffers = 8;
+
+struct GpuDispatch {
+  ShaderHandle shader;
+  size_t numWorkgroups;
+  // The shader's push constants
+  std::vector<uint32_t> parameters;
+};
+
+// What the executor needs to know about the device to choose launch configurations
+struct GpuProperties {
+  // Identifies the device, for keying results measured on it. Empty if it can't be identified.
+  std::string deviceId;
+  // The most invocations a workgroup can have
+  size_t maxWorkgroupSize;
+  // The most workgroups a dispatch can have
+  size_t maxWorkgroupCount;
+  // The shared memory available to a workgroup, in bytes
+  size_t maxSharedMemory;
+  // The number of bindings shaders can address, and the largest each can be, in bytes
+  size_t maxBufferBindings;
+  size_t maxBufferSize;
+  // Zero if unknown
+  size_t subgroupSize;
+  // Whether compute shaders can use the subgroup arithmetic operations
+  bool subgroupArithmetic;
+  // Whether frames read and write mapped device memory directly instead of staging buffers
+  bool zeroCopy;
+};
+
+// A byte range of one of the device buffer's bindings
+struct GpuBufferRange {
+  size_t binding;
+  size_t offset;
+  size_t size;
+};
 
 class Gpu {
   public:
-    virtual ShaderHandle compileShader(const std::string& source) = 0;
-    virtual void submitBuffer(const void* buffer, size_t bufferSize) = 0;
-    virtual void executeShader(size_t shaderIndex, size_t numWorkgroups) = 0;
-    virtual void retrieveBuffer(void* data) = 0;
+    virtual const GpuProperties& properties() const = 0;
+    // Returns a handle for each source, in order. Implementations may compile them concurrently.
+    virtual std::vector<ShaderHandle> compileShaders(const std::vector<std::string>& sources) = 0;
+    // Device buffers can have frames in flight at the same time as each other
+    virtual BufferHandle createBuffer() = 0;
+    // The buffer must have no frames in flight
+    virtual void freeBuffer(BufferHandle buffer) = 0;
+    // Creates the binding, replacing any the buffer had, and uploads all of data to it. A shared
+    // binding has one copy for all the buffer's frames, for data that rarely changes; the others
+    // have one per frame. The buffer must have no frames in flight.
+    virtual void submitBuffer(BufferHandle buffer, size_t binding, const void* data, size_t size,
+      bool shared) = 0;
+    // In zero-copy mode, returns the device memory of a shared binding, mapped for the host to read
+    // and write directly while the buffer has no frames in flight. Otherwise returns null.
+    virtual void* mappedBinding(BufferHandle buffer, size_t binding) = 0;
+    // Records a sequence of dispatches once, to be replayed by each frame that runs it. Each
+    // dispatch sees the writes of the ones before it.
+    virtual CommandsHandle recordCommands(const std::vector<GpuDispatch>& dispatches) = 0;
+    virtual void freeCommands(CommandsHandle commands) = 0;
+    // Starts the buffer's next frame without waiting for it: uploads the input ranges, runs the
+    // commands and then downloads the output ranges. data holds the data of each binding, laid out
+    // like the submitted bindings, and can be modified again as soon as this returns. Each buffer
+    // can have up to FramesInFlight frames in flight, which must be retrieved in order. Inputs in a
+    // shared binding are only written once the frames in flight have finished with it, and frames
+    // see the writes of earlier frames' commands to shared bindings. The carried ranges, of
+    // bindings that aren't shared, are first copied from the buffer's previous frame once its
+    // commands have finished, for data they wrote that the host doesn't have.
+    virtual FrameHandle submitFrame(BufferHandle buffer, const std::vector<const void*>& data,
+      const std::vector<GpuBufferRange>& inputs, const std::vector<GpuBufferRange>& carried,
+      CommandsHandle commands, const std::vector<GpuBufferRange>& outputs) = 0;
+    // Waits for the frame's dispatches to finish, but not for its outputs to be downloaded
+    virtual void waitForFrame(FrameHandle frame) = 0;
+    // Waits for the frame to finish and copies its outputs into the data of each binding
+    virtual void retrieveFrame(FrameHandle frame, const std::vector<void*>& data) = 0;
 
     virtual ~Gpu() {}
 };
 
 using GpuPtr = std::unique_ptr<Gpu>;
 
-GpuPtr createGpu();
+// Zero-copy transfers are used where the device's memory allows unless allowZeroCopy is false
+GpuPtr createGpu(bool allowZeroCopy = true);
@@ -4,371 +4,2171 @@
 #include "utils.hpp"
 #include "timer.hpp"
 #include "gpu.hpp"
+#include "gpu_steps.hpp"
 #include <map>
+#include <functional>
 #include <fstream>
 #include <variant>
 #include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <optional>
+#include <deque>
+#include <iomanip>
+#include <limits>
+#include <filesystem>
 
 namespace {
 
 struct GpuBufferItem {
   MathObjectType type;
   Triple shape;
+  // The address of the item's first element, which encodes the binding that holds the item
   size_t offset;
 };
 
+// Items and temporaries are placed at multiples of this many elements (64 bytes)
+const size_t BufferAlignment = 16;
+
+// Items of at least this many elements (4 MB) get a binding of their own where the device has
+// enough, so they can be allocated and uploaded without the rest of the buffer
+const size_t LargeItemSize = size_t(1) << 20;
+
+size_t alignUp(size_t n, size_t alignment) {
+  return (n + alignment - 1) / alignment * alignment;
+}
+
+size_t bufferAddress(size_t binding, size_t offset) {
+  return (binding << BufferBindingShift) + offset;
+}
+
+size_t addressBinding(size_t address) {
+  return address >> BufferBindingShift;
+}
+
+size_t addressOffset(size_t address) {
+  return address & ((size_t(1) << BufferBindingShift) - 1);
+}
+
+// Appends the byte range of size elements at address, merging it with the last range if they're
+// only separated by alignment padding, which is never worth a separate copy. Ranges must be
+// appended in order of address.
+void appendRange(std::vector<GpuBufferRange>& ranges, size_t address, size_t size) {
+  if (size == 0) {
+    return;
+  }
+
+  size_t binding = addressBinding(address);
+  size_t byteOffset = addressOffset(address) * sizeof(netfloat_t);
+  size_t byteSize = size * sizeof(netfloat_t);
+
+  if (!ranges.empty() && ranges.back().binding == binding
+    && byteOffset <= alignUp(ranges.back().offset + ranges.back().size,
+    BufferAlignment * sizeof(netfloat_t))) {
+
+    ranges.back().size = byteOffset + byteSize - ranges.back().offset;
+  }
+  else {
+    ranges.push_back(GpuBufferRange{ binding, byteOffset, byteSize });
+  }
+}
+
+// The buffer is split across several device buffer bindings, since one storage buffer may not be
+// able to hold all of it. Constant items are kept apart from the rest where the device has enough
+// bindings, so theirs can be shared by all the frames. Inserting an item only records it. The
+// first computation compiled against the buffer lays it out for the device, and nothing is
+// allocated or copied until the first execute, which allocates each binding once and moves the
+// items' data into the allocations. In zero-copy mode, the items of a shared binding are then
+// moved again, into the binding's mapped device memory.
 class GpuBuffer : public Buffer {
   public:
-    std::vector<netfloat_t> storage;
-    std::map<std::string, GpuBufferItem> items;
+    GpuBuffer();
+
+    // Distinguishes buffers, so an executor knows which one the device holds
+    const uint64_t id;
+    // Expires when the buffer is destroyed, so an executor can tell whether a buffer it holds a
+    // device copy of still exists
+    const std::shared_ptr<GpuBuffer*> self;
+    // Item offsets are set by layout()
+    mutable std::map<std::string, GpuBufferItem> items;
+    // The most scratch space needed by any computation compiled against the buffer. Computations
+    // compiled after the buffer is allocated must fit in what was reserved.
+    mutable size_t scratchSize = 0;
 
     void insert(const std::string& name, Array& item) override;
     void insert(const std::string& name, Array2& item) override;
     void insert(const std::string& name, Array3& item) override;
+    void insert(const std::string& name, Scalar& item) override;
+    void setConstant(const std::string& name, bool constant) override;
+    void markDirty(const std::string& name) override;
+
+    // Places the items in as few bindings as the device needs, with the scratch space after the
+    // items of the last. Throws if they don't fit in the device's bindings. Like scratchSize, the
+    // layout is set through a const buffer, since it's fixed by the first compile.
+    void layout(const GpuProperties& device) const;
+    inline bool isLaidOut() const;
+
+    // The address of the scratch space
+    size_t scratchOffset() const;
+    // The most elements of scratch space the binding that holds it can fit
+    size_t scratchCapacity() const;
+    // The number of elements of each binding, given the size of the scratch space
+    std::vector<size_t> bindingSizes(size_t scratchSize) const;
+    // Returns the byte ranges of all the items
+    std::vector<GpuBufferRange> itemRanges() const;
+    // Returns the byte ranges to upload before an execute: every item that isn't constant, and
+    // constant items whose copy in the next frame is stale. Items in mapped bindings are skipped,
+    // since the host writes them directly, as are items the device owns. Frames are used in turn,
+    // so a constant item marked dirty is uploaded by each of the next FramesInFlight calls, or just
+    // the next if it's in a shared binding. Adjacent ranges are merged.
+    std::vector<GpuBufferRange> uploadRanges();
+    // Called once the whole buffer has been uploaded to every frame
+    void clearDirty();
+    // Marks the items a computation has been submitted to write but not copy back, whose only
+    // up-to-date copies are then on the device, and those it copies back, which the host then has.
+    // Marking an item dirty gives it back to the host.
+    void setDeviceOwned(const std::vector<std::string>& written,
+      const std::vector<std::string>& retrieved);
+    // Called once the items the device owns have been copied back
+    void clearDeviceOwned();
+    // Returns the byte ranges of the items the device owns that aren't in mapped bindings
+    std::vector<GpuBufferRange> deviceOwnedRanges() const;
+    // Returns the byte ranges of the items the device owns in bindings that aren't shared, which
+    // each frame has to copy from the one before
+    std::vector<GpuBufferRange> carriedRanges() const;
+
+    // Allocates storage for each binding's items, followed by the scratch space, and points the
+    // items at it
+    void allocate();
+
+    inline bool isAllocated() const;
+    inline size_t numBindings() const;
+    // Whether the binding holds only constant items, so it can be shared by all the frames
+    inline bool isShared(size_t binding) const;
+    // Moves the items of a shared binding into the binding's mapped device memory, which must
+    // already hold the same data, and points them at it
+    void map(size_t binding, void* data);
+    // Moves the items of the binding back into its storage, if it was mapped
+    void unmap(size_t binding);
+    // The mapped device memory the binding's items are in, or null
+    inline const void* mapping(size_t binding) const;
+    // The storage of each binding, or its mapped device memory
+    std::vector<void*> storage();
+    // The number of elements allocated for the binding
+    inline size_t size(size_t binding) const;
 
   private:
+    struct FreeDeleter {
+      void operator()(netfloat_t* ptr) const { std::free(ptr); }
+    };
+
+    struct Segment {
+      bool shared;
+      // The number of elements taken by items
+      size_t itemsSize;
+      size_t size;
+      std::unique_ptr<netfloat_t, FreeDeleter> storage;
+      netfloat_t* mapped;
+    };
+
+    struct ItemSlot {
+      std::string name;
+      size_t size;
+      // Set by layout()
+      size_t address;
+      bool constant;
+      // The number of frames whose copy of the item is out of date
+      size_t staleFrames;
+      // Set while the device has the only up-to-date copy, which mustn't be overwritten by the
+      // host's
+      bool deviceOwned;
+      // Points the item at the given location, first copying its data there if copy is set
+      std::function<void(netfloat_t*, bool copy)> bind;
+    };
+
     template<class T>
     void insertItem(const std::string& name, T& item);
+    ItemSlot& slot(const std::string& name);
+    // The number of copies of the item the device holds
+    size_t copies(const ItemSlot& s) const;
+    // Places the slots, in order, in bindings of up to capacity elements, giving items of at least
+    // LargeItemSize bindings of their own if separateLarge is set, and packing constant items
+    // into shared bindings of their own if shareConstants is set. Returns the bindings, without
+    // storage, and sets the one that holds the scratch space, which is never shared.
+    std::vector<Segment> place(size_t capacity, bool separateLarge, bool shareConstants,
+      size_t& scratchBinding) const;
+
+    bool m_allocated = false;
+    // The layout, fixed by layout()
+    mutable bool m_laidOut = false;
+    mutable size_t m_bindingCapacity = 0;
+    // One per binding
+    mutable std::vector<Segment> m_segments;
+    // The binding that holds the scratch space
+    mutable size_t m_scratchSegment = 0;
+    // In order of insertion until the buffer is laid out, then by address
+    mutable std::vector<ItemSlot> m_slots;
+    mutable std::map<std::string, size_t> m_slotIndices;
 };
 
-template<class T>
-void GpuBuffer::insertItem(const std::string& name, T& item) {
-  size_t size = item.storage().size();
-  size_t offset = storage.size();
-  storage.resize(offset + size);
-  memcpy(storage.data() + offset, item.storage().data(), size * sizeof(netfloat_t));
-  item.setDataPtr(storage.data() + offset);
-  items.insert({ name, GpuBufferItem{ item.type(), item.shape(), offset } });
+GpuBuffer::GpuBuffer()
+  : id([]() {
+      static std::atomic<uint64_t> nextId{0};
+      return nextId++;
+    }())
+  , self(std::make_shared<GpuBuffer*>(this)) {}
+
+bool GpuBuffer::isLaidOut() const {
+  return m_laidOut;
 }
 
-void GpuBuffer::insert(const std::string& name, Array& item) {
-  insertItem(name, item);
+bool GpuBuffer::isAllocated() const {
+  return m_allocated;
 }
 
-void GpuBuffer::insert(const std::string& name, Array2& item) {
-  insertItem(name, item);
+size_t GpuBuffer::numBindings() const {
+  return m_segments.size();
 }
 
-void GpuBuffer::insert(const std::string& name, Array3& item) {
-  insertItem(name, item);
+bool GpuBuffer::isShared(size_t binding) const {
+  return m_segments[binding].shared;
 }
 
-struct GpuComputationStep {
-  std::string commands;
-  size_t shader;
-  size_t numWorkgroups;
-};
+const void* GpuBuffer::mapping(size_t binding) const {
+  return m_segments[binding].mapped;
+}
 
-class GpuComputation : public Computation {
-  public:
-    std::vector<GpuComputationStep> steps;
-};
+std::vector<void*> GpuBuffer::storage() {
+  std::vector<void*> storage;
+  for (Segment& segment : m_segments) {
+    storage.push_back(segment.mapped ? segment.mapped : segment.storage.get());
+  }
+  return storage;
+}
 
-using GpuComputationPtr = std::unique_ptr<GpuComputation>;
+size_t GpuBuffer::size(size_t binding) const {
+  return m_segments[binding].size;
+}
 
-struct ShaderSnippet {
-  std::string command;
-  size_t workSize;
-  std::string source;
-};
+template<class T>
+void GpuBuffer::insertItem(const std::string& name, T& item) {
+  ASSERT_MSG(!isLaidOut(), "Can't insert '" << name << "' after a computation has been compiled "
+    "against the buffer");
+  ASSERT_MSG(items.count(name) == 0, "Buffer already has an item named '" << name << "'");
+
+  Triple shape = item.shape();
+  size_t size = shape[0] * shape[1] * shape[2];
+
+  ASSERT_MSG(size <= size_t(1) << BufferBindingShift, "Item '" << name << "' is too large");
+
+  m_slotIndices[name] = m_slots.size();
+  m_slots.push_back(ItemSlot{ name, size, 0, false, FramesInFlight, false,
+    [&item, size](netfloat_t* data, bool copy) {
+      if (copy) {
+        memcpy(data, item.data(), size * sizeof(netfloat_t));
+      }
+      item.setDataPtr(data);
+    }
+  });
+  items.insert({ name, GpuBufferItem{ item.type(), shape, 0 } });
+}
 
-class Token {
-  public:
-    Token(netfloat_t value);
-    Token(const GpuBufferItem& bufferItem);
+GpuBuffer::ItemSlot& GpuBuffer::slot(const std::string& name) {
+  auto i = m_slotIndices.find(name);
+  ASSERT_MSG(i != m_slotIndices.end(), "Buffer has no item named '" << name << "'");
+  return m_slots[i->second];
+}
 
-    bool isNumeric() const;
-    netfloat_t floatValue() const;
-    const GpuBufferItem& bufferItem() const;
+size_t GpuBuffer::copies(const ItemSlot& s) const {
+  return isLaidOut() && isShared(addressBinding(s.address)) ? 1 : FramesInFlight;
+}
 
-  private:
-    std::variant<netfloat_t, GpuBufferItem> m_value;
-};
+// An item made non-constant after the buffer is laid out stays in a shared binding if it's in one,
+// and is uploaded to it every execute
+void GpuBuffer::setConstant(const std::string& name, bool constant) {
+  ItemSlot& s = slot(name);
+  // The device copy of a constant item may be stale if it was previously uploaded every execute
+  if (constant && !s.constant) {
+    s.staleFrames = copies(s);
+  }
+  s.constant = constant;
+}
 
-Token::Token(netfloat_t value)
-  : m_value(value) {}
+void GpuBuffer::markDirty(const std::string& name) {
+  ItemSlot& s = slot(name);
+  s.staleFrames = copies(s);
+  s.deviceOwned = false;
+}
 
-Token::Token(const GpuBufferItem& bufferItem)
-  : m_value(bufferItem) {}
+std::vector<GpuBuffer::Segment> GpuBuffer::place(size_t capacity, bool separateLarge,
+  bool shareConstants, size_t& scratchBinding) const {
 
-bool Token::isNumeric() const {
-  return std::holds_alternative<netfloat_t>(m_value);
-}
+  std::vector<Segment> segments;
+  // The bindings small items are currently packed into, shared and not
+  std::optional<size_t> packed[2];
 
-netfloat_t Token::floatValue() const {
-  return std::get<netfloat_t>(m_value);
-}
+  for (ItemSlot& s : m_slots) {
+    bool shared = shareConstants && s.constant;
+    bool large = separateLarge && s.size >= LargeItemSize;
+    std::optional<size_t> binding = large ? std::nullopt : packed[shared];
 
-const GpuBufferItem& Token::bufferItem() const {
-  return std::get<GpuBufferItem>(m_value);
-}
+    if (!binding || alignUp(segments[*binding].itemsSize, BufferAlignment) + s.size > capacity) {
+      binding = segments.size();
+      segments.push_back(Segment{ shared, 0, 0, nullptr, nullptr });
 
-bool parsenetfloat_t(const std::string& strValue, netfloat_t& value) {
-  std::stringstream ss(strValue);
-  ss >> value;
-  return !ss.fail() && ss.eof();
-}
+      if (!large) {
+        packed[shared] = binding;
+      }
+    }
 
-Token parseToken(const GpuBuffer& buffer, const std::string& strToken) {
-  netfloat_t value = 0;
-  if (parsenetfloat_t(strToken, value)) {
-    return value;
+    Segment& segment = segments[*binding];
+    size_t offset = alignUp(segment.itemsSize, BufferAlignment);
+    segment.itemsSize = offset + s.size;
+    s.address = bufferAddress(*binding, offset);
   }
-  else {
-    return buffer.items.at(strToken);
+
+  // The scratch space follows the small items that aren't shared, or has a binding of its own if
+  // there aren't any
+  if (!packed[false]) {
+    packed[false] = segments.size();
+    segments.push_back(Segment{ false, 0, 0, nullptr, nullptr });
   }
+  scratchBinding = *packed[false];
+
+  return segments;
 }
 
-ShaderSnippet compileMultiplyCommand(const GpuBuffer& buffer,
-  const std::vector<std::string>& tokens) {
+// Bindings are limited to 2^BufferBindingShift elements by the addressing scheme, as well as by the
+// device's maxBufferSize. Layouts are tried from the most bindings to the fewest: large items on
+// their own, then constant items apart from the rest, then everything packed together.
+void GpuBuffer::layout(const GpuProperties& device) const {
+  ASSERT(!isLaidOut());
 
-  const GpuBufferItem& returnVal = buffer.items.at(tokens[0]);
-  const std::string& functionName = tokens[1];
-  
-  ASSERT(functionName == "multiply");
-  ASSERT(tokens.size() == 4);
+  size_t capacity = std::min(device.maxBufferSize / sizeof(netfloat_t),
+    size_t(1) << BufferBindingShift);
+  size_t maxBindings = std::min(device.maxBufferBindings, MaxBufferBindings);
 
-  ShaderSnippet snippet;
+  for (const ItemSlot& s : m_slots) {
+    if (s.size > capacity) {
+      EXCEPTION("Item '" << s.name << "' needs " << s.size * sizeof(netfloat_t) << " bytes, but "
+        "the device's storage buffers can't be larger than " << capacity * sizeof(netfloat_t));
+    }
+  }
 
-  Token arg1 = parseToken(buffer, tokens[2]);
-  Token arg2 = parseToken(buffer, tokens[3]);
+  std::vector<Segment> segments = place(capacity, true, true, m_scratchSegment);
 
-  if (arg1.isNumeric()) {
-    EXCEPTION("No function 'multiply' matching argument types");
+  if (segments.size() > maxBindings) {
+    segments = place(capacity, false, true, m_scratchSegment);
   }
-  else if (arg1.bufferItem().type == MathObjectType::Array) {
-    if (arg2.isNumeric()) {
-      size_t rOffset = returnVal.offset;
-      size_t vOffset = arg1.bufferItem().offset;
-      size_t vSize = arg1.bufferItem().shape[0];
-      netfloat_t x = arg2.floatValue();
 
-      snippet.source = STR("vecScalarMultiply(" << vOffset << ", " << vSize << ", " << x << ", "
-        << rOffset << ");");
+  if (segments.size() > maxBindings) {
+    segments = place(capacity, false, false, m_scratchSegment);
+  }
 
-      snippet.workSize = vSize;
-    }
-    else {
-      EXCEPTION("No function 'multiply' matching argument types");
-    }
+  if (segments.size() > maxBindings) {
+    EXCEPTION("Buffer needs " << segments.size() << " storage buffer bindings of up to "
+      << capacity * sizeof(netfloat_t) << " bytes, but the device only supports " << maxBindings);
   }
-  else if (arg1.bufferItem().type == MathObjectType::Array2) {
-    if (arg2.isNumeric()) {
-      EXCEPTION("No function 'multiply' matching argument types");
+
+  m_segments = std::move(segments);
+  m_bindingCapacity = capacity;
+  m_laidOut = true;
+
+  std::sort(m_slots.begin(), m_slots.end(), [](const ItemSlot& a, const ItemSlot& b) {
+    return a.address < b.address;
+  });
+
+  for (size_t i = 0; i < m_slots.size(); ++i) {
+    ItemSlot& s = m_slots[i];
+    m_slotIndices[s.name] = i;
+    items.at(s.name).offset = s.address;
+    s.staleFrames = std::min(s.staleFrames, copies(s));
+  }
+}
+
+size_t GpuBuffer::scratchOffset() const {
+  ASSERT(isLaidOut());
+  return bufferAddress(m_scratchSegment,
+    alignUp(m_segments[m_scratchSegment].itemsSize, BufferAlignment));
+}
+
+size_t GpuBuffer::scratchCapacity() const {
+  return m_bindingCapacity - addressOffset(scratchOffset());
+}
+
+std::vector<size_t> GpuBuffer::bindingSizes(size_t scratchSize) const {
+  std::vector<size_t> sizes;
+
+  for (size_t i = 0; i < m_segments.size(); ++i) {
+    size_t size = alignUp(m_segments[i].itemsSize, BufferAlignment);
+    if (i == m_scratchSegment) {
+      size += alignUp(scratchSize, BufferAlignment);
     }
-    else if (arg2.bufferItem().type == MathObjectType::Array) {
-      size_t rOffset = returnVal.offset;
-      size_t mOffset = arg1.bufferItem().offset;
-      size_t mCols = arg1.bufferItem().shape[0];
-      size_t mRows = arg1.bufferItem().shape[1];
-      size_t vOffset = arg2.bufferItem().offset;
-      size_t vSize = arg2.bufferItem().shape[0];
+    // Storage buffers can't be empty
+    sizes.push_back(std::max(size, BufferAlignment));
+  }
+
+  return sizes;
+}
+
+std::vector<GpuBufferRange> GpuBuffer::itemRanges() const {
+  std::vector<GpuBufferRange> ranges;
 
-      ASSERT_MSG(mCols == vSize, "Cannot multiply a " << mCols
-        << "-column matrix with a vector of size " << vSize);
+  for (const ItemSlot& s : m_slots) {
+    appendRange(ranges, s.address, s.size);
+  }
+
+  return ranges;
+}
 
-      snippet.source = STR("matVecMultiply(" << mOffset << ", " << mCols << ", " << mRows << ", "
-        << vOffset << ", " << vSize << ", " << rOffset << ");");
+std::vector<GpuBufferRange> GpuBuffer::uploadRanges() {
+  std::vector<GpuBufferRange> ranges;
 
-      snippet.workSize = mRows;
+  for (ItemSlot& s : m_slots) {
+    if (mapping(addressBinding(s.address))) {
+      s.staleFrames = 0;
+      continue;
     }
-    else {
-      EXCEPTION("No function 'multiply' matching argument types");
+
+    if (s.deviceOwned) {
+      continue;
     }
-  }
-  else {
-    EXCEPTION("No function 'multiply' matching argument types");
+
+    if (!s.constant || s.staleFrames > 0) {
+      appendRange(ranges, s.address, s.size);
+    }
+    s.staleFrames = s.staleFrames > 0 ? s.staleFrames - 1 : 0;
   }
 
-  return snippet;
+  return ranges;
 }
 
-ShaderSnippet compileAddCommand(const GpuBuffer& buffer, const std::vector<std::string>& tokens) {
-  const GpuBufferItem& returnVal = buffer.items.at(tokens[0]);
-  const std::string& functionName = tokens[1];
-  
-  ASSERT(functionName == "add");
-  ASSERT(tokens.size() == 4);
+// The host's copy of every item is up to date again, so none are owned by the device
+void GpuBuffer::clearDirty() {
+  for (ItemSlot& s : m_slots) {
+    s.staleFrames = 0;
+    s.deviceOwned = false;
+  }
+}
 
-  ShaderSnippet snippet;
+// The device writes mapped items in place, so the host always has them
+void GpuBuffer::setDeviceOwned(const std::vector<std::string>& written,
+  const std::vector<std::string>& retrieved) {
 
-  Token arg1 = parseToken(buffer, tokens[2]);
-  Token arg2 = parseToken(buffer, tokens[3]);
+  for (const std::string& name : written) {
+    ItemSlot& s = slot(name);
+    s.deviceOwned = !mapping(addressBinding(s.address));
+  }
 
-  if (arg1.isNumeric()) {
-    EXCEPTION("No function 'add' matching argument types");
+  for (const std::string& name : retrieved) {
+    slot(name).deviceOwned = false;
   }
-  else if (arg1.bufferItem().type == MathObjectType::Array) {
-    if (arg2.isNumeric()) {
-      EXCEPTION("No function 'add' matching argument types");
-    }
-    else if (arg2.bufferItem().type == MathObjectType::Array) {
-      size_t rOffset = returnVal.offset;
-      size_t aOffset = arg1.bufferItem().offset;
-      size_t aSize = arg1.bufferItem().shape[0];
-      size_t bOffset = arg2.bufferItem().offset;
-      size_t bSize = arg2.bufferItem().shape[0];
+}
 
-      ASSERT_MSG(aSize == bSize, "Cannot add vectors of sizes " << aSize << " and " << bSize);
+void GpuBuffer::clearDeviceOwned() {
+  for (ItemSlot& s : m_slots) {
+    s.deviceOwned = false;
+  }
+}
 
-      snippet.source = STR("vecVecAdd(" << aOffset << ", " << bOffset << ", " << aSize << ", "
-        << rOffset << ");");
+std::vector<GpuBufferRange> GpuBuffer::deviceOwnedRanges() const {
+  std::vector<GpuBufferRange> ranges;
 
-      snippet.workSize = aSize;
-    }
-    else {
-      EXCEPTION("No function 'add' matching argument types");
+  for (const ItemSlot& s : m_slots) {
+    if (s.deviceOwned) {
+      appendRange(ranges, s.address, s.size);
     }
   }
-  else {
-    EXCEPTION("No function 'add' matching argument types");
+
+  return ranges;
+}
+
+std::vector<GpuBufferRange> GpuBuffer::carriedRanges() const {
+  std::vector<GpuBufferRange> ranges;
+
+  for (const ItemSlot& s : m_slots) {
+    if (s.deviceOwned && !isShared(addressBinding(s.address))) {
+      appendRange(ranges, s.address, s.size);
+    }
   }
 
-  return snippet;
+  return ranges;
 }
 
-ShaderSnippet compileCommand(const Buffer& buf, const std::string& command) {
-  const auto& buffer = dynamic_cast<const GpuBuffer&>(buf);
+void GpuBuffer::allocate() {
+  ASSERT(isLaidOut());
+  ASSERT(!isAllocated());
 
-  std::vector<std::string> tokens = tokenizeCommand(command);
+  std::vector<size_t> sizes = bindingSizes(scratchSize);
 
-  ASSERT(tokens.size() >= 2);
-  const std::string& functionName = tokens[1];
+  for (size_t i = 0; i < m_segments.size(); ++i) {
+    size_t bytes = sizes[i] * sizeof(netfloat_t);
+    auto ptr = static_cast<netfloat_t*>(std::aligned_alloc(BufferAlignment * sizeof(netfloat_t),
+      bytes));
+    ASSERT_MSG(ptr != nullptr, "Failed to allocate " << bytes << " bytes");
 
-  ShaderSnippet snippet;
+    m_segments[i].storage.reset(ptr);
+    m_segments[i].size = sizes[i];
+    memset(ptr, 0, bytes);
+  }
+
+  for (const ItemSlot& s : m_slots) {
+    s.bind(m_segments[addressBinding(s.address)].storage.get() + addressOffset(s.address), true);
+  }
+
+  m_allocated = true;
+}
+
+void GpuBuffer::map(size_t binding, void* data) {
+  Segment& segment = m_segments[binding];
+  ASSERT(isAllocated() && segment.shared && segment.mapped == nullptr);
 
-  if (functionName == "multiply") {
-    snippet = compileMultiplyCommand(buffer, tokens);
+  segment.mapped = static_cast<netfloat_t*>(data);
+
+  for (const ItemSlot& s : m_slots) {
+    if (addressBinding(s.address) == binding) {
+      s.bind(segment.mapped + addressOffset(s.address), false);
+    }
   }
-  else if (functionName == "add") {
-    snippet = compileAddCommand(buffer, tokens);
+}
+
+void GpuBuffer::unmap(size_t binding) {
+  Segment& segment = m_segments[binding];
+  if (segment.mapped == nullptr) {
+    return;
   }
-  else {
-    EXCEPTION("Function '" << functionName << "' not recognised");
+
+  for (const ItemSlot& s : m_slots) {
+    if (addressBinding(s.address) == binding) {
+      s.bind(segment.storage.get() + addressOffset(s.address), true);
+    }
   }
 
-  snippet.command = command;
+  segment.mapped = nullptr;
+}
 
-  return snippet;
+void GpuBuffer::insert(const std::string& name, Array& item) {
+  insertItem(name, item);
 }
 
-class GpuExecutor : public Executor {
+void GpuBuffer::insert(const std::string& name, Array2& item) {
+  insertItem(name, item);
+}
+
+void GpuBuffer::insert(const std::string& name, Array3& item) {
+  insertItem(name, item);
+}
+
+void GpuBuffer::insert(const std::string& name, Scalar& item) {
+  insertItem(name, item);
+}
+
+class GpuComputation : public Computation {
   public:
-    GpuExecutor(Logger& logger);
-  
-    ComputationPtr compile(const Buffer& buffer, const ComputationDesc& desc) const override;
-    void execute(Buffer& buffer, const Computation& computation) const override;
+    // The computation must not outlive the executor that compiled it
+    GpuComputation(Gpu& gpu);
+
+    std::vector<GpuComputationStep> steps;
+    // The steps, with loops unrolled, recorded for replay
+    std::optional<CommandsHandle> commands;
+    // Temporaries occupy [scratchOffset, scratchOffset + scratchSize) of the buffer
+    size_t scratchOffset;
+    size_t scratchSize;
+    // The byte ranges copied back to the host after executing
+    std::vector<GpuBufferRange> outputs;
+    // The items copied back, and the others the computation writes
+    std::vector<std::string> retrieved;
+    std::vector<std::string> deviceWrites;
+
+    ~GpuComputation() override;
 
   private:
-    GpuComputationStep compileStep(std::vector<ShaderSnippet>& snippets, size_t workSize) const;
+    Gpu& m_gpu;
+};
 
-    Logger& m_logger;
-    GpuPtr m_gpu;
+using GpuComputationPtr = std::unique_ptr<GpuComputation>;
+
+GpuComputation::GpuComputation(Gpu& gpu)
+  : m_gpu(gpu) {}
+
+GpuComputation::~GpuComputation() {
+  if (commands) {
+    m_gpu.freeCommands(*commands);
+  }
+}
+
+// Default launch configurations, for operations that haven't been tuned on the device
+const size_t ElementwiseWorkgroupSize = 32;
+const size_t ReductionWorkgroupSize = 256;
+// Reductions of up to ReductionChunkSize elements run in a single workgroup. Larger ones are split
+// across a workgroup per chunk, up to MaxReductionPartials, and a single workgroup then adds their
+// partial results. Every device can dispatch far more than MaxReductionPartials workgroups.
+const size_t ReductionChunkSize = 4096;
+const size_t MaxReductionPartials = 256;
+// Each workgroup of a matrix-vector multiply computes MatVecRowsPerWorkgroup elements of the
+// result, splitting each row across its lanes
+const size_t MatVecWorkgroupSize = 256;
+const size_t MatVecRowsPerWorkgroup = 8;
+// The default of MATVEC_TILE_SIZE in functions.glsl
+const size_t MatVecTileSize = 2048;
+
+// Tuning measures each candidate over this many back to back dispatches, taking the fastest of
+// several runs
+const size_t BenchmarkDispatches = 10;
+const size_t BenchmarkRuns = 3;
+
+// The device keeps copies of this many of the most recently used buffers. The other device buffer
+// is for tuning.
+const size_t MaxResidentBuffers = MaxGpuBuffers - 1;
+
+// How a dispatch is launched. The autotuner chooses among alternatives to the defaults.
+struct LaunchConfig {
+  size_t workgroupSize = ElementwiseWorkgroupSize;
+  // For matVecMultiply, the elements of the result each workgroup computes, and the number of
+  // elements of the vector staged in shared memory at once
+  size_t rowsPerWorkgroup = 0;
+  size_t tileSize = 0;
 };
 
-GpuExecutor::GpuExecutor(Logger& logger)
-  : m_logger(logger)
-  , m_gpu(createGpu()) {}
+// The shared memory declared by functions.glsl, which every shader includes
+size_t sharedMemorySize(const LaunchConfig& config) {
+  size_t tileSize = config.tileSize != 0 ? config.tileSize : MatVecTileSize;
+  return (2 * config.workgroupSize + tileSize) * sizeof(float);
+}
 
-GpuComputationStep GpuExecutor::compileStep(std::vector<ShaderSnippet>& snippets,
-  size_t workSize) const {
+// Launch configurations measured on a device, keyed by operation and shape. Each line of the file
+// is a configuration followed by its key.
+class KernelTunings {
+  public:
+    // Loads what was saved for the device by previous runs. Nothing is saved if deviceId is empty.
+    KernelTunings(const std::string& deviceId);
 
-  size_t workgroupSize = 32;
-  size_t numWorkgroups = (workSize + workgroupSize - 1) / workgroupSize;
+    std::optional<LaunchConfig> find(const std::string& key) const;
+    // Adds the configuration and saves the file
+    void insert(const std::string& key, const LaunchConfig& config);
 
-  std::ifstream fin("data/functions.glsl");
-  std::stringstream commands;
-  std::stringstream shaderSource;
+  private:
+    std::filesystem::path m_path;
+    std::map<std::string, LaunchConfig> m_configs;
+};
+
+KernelTunings::KernelTunings(const std::string& deviceId) {
+  if (deviceId.empty()) {
+    return;
+  }
 
-  shaderSource << "#version 450" << std::endl << std::endl;
-  shaderSource << "layout (local_size_x = " << workgroupSize << ") in;" << std::endl << std::endl;
+  m_path = CacheDirectory / "tuning" / (deviceId + ".txt");
 
+  std::ifstream fin(m_path);
   std::string line;
   while (std::getline(fin, line)) {
-    shaderSource << line << std::endl;
+    std::stringstream ss(line);
+    LaunchConfig config;
+    std::string key;
+
+    ss >> config.workgroupSize >> config.rowsPerWorkgroup >> config.tileSize;
+    std::getline(ss, key);
+    trimLeft(key);
+
+    if (ss && config.workgroupSize != 0 && !key.empty()) {
+      m_configs[key] = config;
+    }
   }
+}
 
-  shaderSource << std::endl;
-  shaderSource << "void main() {" << std::endl;
+std::optional<LaunchConfig> KernelTunings::find(const std::string& key) const {
+  auto i = m_configs.find(key);
+  if (i == m_configs.end()) {
+    return std::nullopt;
+  }
+  return i->second;
+}
 
-  for (const ShaderSnippet& snippet : snippets) {
-    shaderSource << snippet.source << std::endl;
-    commands << snippet.command << std::endl;
+void KernelTunings::insert(const std::string& key, const LaunchConfig& config) {
+  m_configs[key] = config;
+
+  if (m_path.empty()) {
+    return;
   }
 
-  shaderSource << "}" << std::endl;
+  std::stringstream ss;
+  for (const auto& [name, tuned] : m_configs) {
+    ss << tuned.workgroupSize << " " << tuned.rowsPerWorkgroup << " " << tuned.tileSize << " "
+      << name << std::endl;
+  }
 
-  GpuComputationStep step;
-  step.shader = m_gpu->compileShader(shaderSource.str());
-  step.numWorkgroups = numWorkgroups;
-  step.commands = commands.str();
+  std::string file = ss.str();
+  writeCacheFile(m_path, file.data(), file.size());
+}
 
-  return step;
+// Formats x as a GLSL float literal that converts back to x exactly
+std::string floatLiteral(netfloat_t x) {
+  std::stringstream ss;
+  ss << std::setprecision(std::numeric_limits<netfloat_t>::max_digits10) << x;
+
+  std::string literal = ss.str();
+  if (literal.find_first_of(".e") == std::string::npos) {
+    literal += ".0";
+  }
+  return literal;
 }
 
-ComputationPtr GpuExecutor::compile(const Buffer& buffer, const ComputationDesc& desc) const {
-  auto computation = std::make_unique<GpuComputation>();
+// Collects the offsets, sizes and scalars a shader uses, which are passed to it as push constants
+// so that shaders differing only in those values are the same source and share a pipeline. Values
+// that don't fit are written into the source as literals.
+class ShaderParameters {
+  public:
+    // Each returns a GLSL expression for the value
+    std::string add(size_t value);
+    std::string add(netfloat_t value);
 
-  std::vector<ShaderSnippet> snippets;
-  size_t currentWorkgroupSize = 0;
+    inline const std::vector<uint32_t>& values() const;
 
-  for (const std::string& command : desc.steps) {
-    ShaderSnippet snippet = compileCommand(buffer, command);
+  private:
+    // Returns the index of the value's slot, or -1 if there's no room for it
+    int slot(uint32_t value);
 
-    if (snippet.workSize == currentWorkgroupSize || snippets.empty()) {
-      snippets.push_back(snippet);
-      currentWorkgroupSize = snippet.workSize;
-    }
-    else {
-      computation->steps.push_back(compileStep(snippets, currentWorkgroupSize));
-      snippets.clear();
-      snippets.push_back(snippet);
-      currentWorkgroupSize = 0;
-    }
-  }
+    std::vector<uint32_t> m_values;
+};
+
+const std::vector<uint32_t>& ShaderParameters::values() const {
+  return m_values;
+}
 
-  if (!snippets.empty()) {
-    ASSERT(currentWorkgroupSize != 0);
-    computation->steps.push_back(compileStep(snippets, currentWorkgroupSize));
+int ShaderParameters::slot(uint32_t value) {
+  if (m_values.size() == MaxDispatchParameters) {
+    return -1;
   }
 
-  return computation;
+  m_values.push_back(value);
+  return m_values.size() - 1;
 }
 
-void GpuExecutor::execute(Buffer& buf, const Computation& computation) const {
-  auto& buffer = dynamic_cast<GpuBuffer&>(buf);
-  int64_t submitTime = 0;
-  int64_t executionTime = 0;
-  int64_t retrievalTime = 0;
+std::string ShaderParameters::add(size_t value) {
+  ASSERT(value <= std::numeric_limits<uint32_t>::max());
 
-  Timer timer;
-  timer.start();
-  m_gpu->submitBuffer(buffer.storage.data(), buffer.storage.size() * sizeof(netfloat_t));
-  submitTime = timer.stop();
+  int i = slot(static_cast<uint32_t>(value));
+  return i == -1 ? STR(value << "u") : STR("params.p[" << i << "]");
+}
 
-  timer.start();
+std::string ShaderParameters::add(netfloat_t value) {
+  static_assert(sizeof(netfloat_t) == sizeof(uint32_t));
+
+  uint32_t bits = 0;
+  memcpy(&bits, &value, sizeof(bits));
+
+  int i = slot(bits);
+  return i == -1 ? floatLiteral(value) : STR("uintBitsToFloat(params.p[" << i << "])");
+}
+
+// Generates the code for a run of elementwise snippets with the same work size. Each invocation
+// keeps its elements of the items the run touches in registers, so an item is read at most once
+// and written at most once however many of the snippets use it.
+class ElementwiseChain {
+  public:
+    ElementwiseChain(size_t workSize, ShaderParameters& parameters);
+
+    inline size_t workSize() const;
+    inline ShaderParameters& parameters();
+
+    // Returns a variable holding the invocation's element of the item at offset
+    std::string load(size_t offset);
+    // Sets the invocation's element of the item at offset to expression
+    void store(size_t offset, const std::string& expression);
+    void append(const std::string& line);
+
+    // Returns the chain's code, which ends by writing the modified elements back to the buffer
+    std::string finish();
+
+  private:
+    struct Register {
+      std::string name;
+      bool dirty;
+    };
+
+    size_t m_workSize;
+    ShaderParameters& m_parameters;
+    std::stringstream m_source;
+    // By item offset
+    std::map<size_t, Register> m_registers;
+};
+
+ElementwiseChain::ElementwiseChain(size_t workSize, ShaderParameters& parameters)
+  : m_workSize(workSize)
+  , m_parameters(parameters) {}
+
+size_t ElementwiseChain::workSize() const {
+  return m_workSize;
+}
+
+ShaderParameters& ElementwiseChain::parameters() {
+  return m_parameters;
+}
+
+std::string ElementwiseChain::load(size_t offset) {
+  auto i = m_registers.find(offset);
+  if (i != m_registers.end()) {
+    return i->second.name;
+  }
+
+  std::string name = STR("r" << m_registers.size());
+  m_source << "float " << name << " = readBuffer(" << m_parameters.add(offset) << " + index);"
+    << std::endl;
+  m_registers.insert({ offset, Register{ name, false } });
+
+  return name;
+}
+
+void ElementwiseChain::store(size_t offset, const std::string& expression) {
+  auto i = m_registers.find(offset);
+  if (i != m_registers.end()) {
+    m_source << i->second.name << " = " << expression << ";" << std::endl;
+    i->second.dirty = true;
+    return;
+  }
+
+  std::string name = STR("r" << m_registers.size());
+  m_source << "float " << name << " = " << expression << ";" << std::endl;
+  m_registers.insert({ offset, Register{ name, true } });
+}
+
+void ElementwiseChain::append(const std::string& line) {
+  m_source << line << std::endl;
+}
+
+// Each invocation handles every element a whole grid apart, so a dispatch can cover more elements
+// than it has invocations
+std::string ElementwiseChain::finish() {
+  std::stringstream source;
+  source << "for (uint index = gl_GlobalInvocationID.x; index < " << m_parameters.add(m_workSize)
+    << "; index += gl_NumWorkGroups.x * gl_WorkGroupSize.x) {" << std::endl;
+  source << m_source.str();
+
+  for (const auto& [offset, reg] : m_registers) {
+    if (reg.dirty) {
+      source << "writeBuffer(" << m_parameters.add(offset) << " + index, " << reg.name << ");"
+        << std::endl;
+    }
+  }
+
+  source << "}";
+  return source.str();
+}
+
+// A region of the buffer a snippet reads or writes
+struct BufferAccess {
+  size_t offset;
+  size_t size;
+  // Each invocation only touches the element at its own index
+  bool local;
+};
+
+struct ShaderSnippet {
+  std::string command;
+  size_t workSize = 0;
+  // Generates the code of a snippet that isn't elementwise
+  std::function<std::string(ShaderParameters&, const LaunchConfig&)> source;
+  // Generates the code of an elementwise snippet
+  std::function<void(ElementwiseChain&)> emit;
+  // The number of workgroups the snippet needs, if it isn't one invocation per element of its work
+  // size
+  std::function<size_t(const LaunchConfig&)> numWorkgroups;
+  // Used unless a configuration has been tuned for the tuning key
+  LaunchConfig launch;
+  // Names the operation and its shape. Snippets without one aren't tuned, except that elementwise
+  // dispatches are tuned by work size.
+  std::string tuningKey;
+  // Reduces across the lanes of its workgroups, so gets a dispatch of its own
+  bool isReduction = false;
+  // Each invocation only touches the elements at its own index, so the snippet can join a
+  // register-resident chain and loop without synchronisation
+  bool isElementwise = false;
+  std::vector<BufferAccess> reads;
+  std::vector<BufferAccess> writes;
+};
+
+// Whether the snippet touches elements that a different invocation of the dispatch writes, or
+// writes elements a different invocation reads, in which case it can't join the dispatch. There's
+// no synchronisation between invocations of a dispatch.
+bool dependsOn(const ShaderSnippet& snippet, const std::vector<ShaderSnippet>& dispatch) {
+  auto conflict = [](const BufferAccess& a, const BufferAccess& b) {
+    bool sameInvocation = a.local && b.local && a.offset == b.offset;
+    return !sameInvocation && a.offset < b.offset + b.size && b.offset < a.offset + a.size;
+  };
+
+  for (const ShaderSnippet& prev : dispatch) {
+    for (const BufferAccess& write : prev.writes) {
+      for (const BufferAccess& access : snippet.reads) {
+        if (conflict(write, access)) {
+          return true;
+        }
+      }
+      for (const BufferAccess& access : snippet.writes) {
+        if (conflict(write, access)) {
+          return true;
+        }
+      }
+    }
+    for (const BufferAccess& read : prev.reads) {
+      for (const BufferAccess& access : snippet.writes) {
+        if (conflict(read, access)) {
+          return true;
+        }
+      }
+    }
+  }
+
+  return false;
+}
+
+// An instruction's snippet, or a loop that has to be dispatched iteration by iteration
+struct CompiledNode {
+  ShaderSnippet snippet;
+  bool isLoop = false;
+  size_t iterations = 0;
+  bool conditional = false;
+  size_t conditionOffset = 0;
+  netfloat_t threshold = 0;
+  // Set on the device once the condition is met
+  size_t flagOffset = 0;
+  std::vector<CompiledNode> body;
+};
+
+class Token {
+  public:
+    Token(netfloat_t value);
+    Token(const GpuBufferItem& bufferItem);
+
+    bool isNumeric() const;
+    netfloat_t floatValue() const;
+    const GpuBufferItem& bufferItem() const;
+
+  private:
+    std::variant<netfloat_t, GpuBufferItem> m_value;
+};
+
+Token::Token(netfloat_t value)
+  : m_value(value) {}
+
+Token::Token(const GpuBufferItem& bufferItem)
+  : m_value(bufferItem) {}
+
+bool Token::isNumeric() const {
+  return std::holds_alternative<netfloat_t>(m_value);
+}
+
+netfloat_t Token::floatValue() const {
+  return std::get<netfloat_t>(m_value);
+}
+
+const GpuBufferItem& Token::bufferItem() const {
+  return std::get<GpuBufferItem>(m_value);
+}
+
+// Maps the values of a graph to buffer items, temporaries and constants. The graph's types are
+// inferred and checked on construction.
+class Operands {
+  public:
+    Operands(const GpuBuffer& buffer, const Graph& graph, GpuComputation& computation);
+
+    Token get(Value value) const;
+
+    // Returns the item the result is written to, allocating scratch space for a temporary
+    GpuBufferItem result(Value value);
+    // Returns the offset of size elements of scratch space
+    size_t allocate(size_t size);
+
+  private:
+    const Graph& m_graph;
+    GpuComputation& m_computation;
+    GraphTypes m_types;
+    std::vector<GpuBufferItem> m_items;
+    std::vector<GpuBufferItem> m_temporaries;
+    std::vector<bool> m_defined;
+};
+
+Operands::Operands(const GpuBuffer& buffer, const Graph& graph, GpuComputation& computation)
+  : m_graph(graph)
+  , m_computation(computation)
+  , m_temporaries(graph.numTemporaries())
+  , m_defined(graph.numTemporaries(), false) {
+
+  std::vector<ValueType> itemTypes;
+
+  for (size_t i = 0; i < graph.numItems(); ++i) {
+    const std::string& name = graph.itemName(Value{ ValueKind::Item, uint32_t(i) });
+
+    auto item = buffer.items.find(name);
+    if (item == buffer.items.end()) {
+      EXCEPTION("Buffer has no item named '" << name << "'");
+    }
+    m_items.push_back(item->second);
+    itemTypes.push_back(ValueType{ item->second.type, item->second.shape });
+  }
+
+  m_types = inferTypes(graph, itemTypes);
+}
+
+Token Operands::get(Value value) const {
+  switch (value.kind) {
+    case ValueKind::Item:
+      return m_items[value.index];
+    case ValueKind::Temporary:
+      ASSERT(m_defined[value.index]);
+      return m_temporaries[value.index];
+    case ValueKind::Constant:
+      return m_graph.constantValue(value);
+  }
+  EXCEPTION("Invalid value");
+}
+
+GpuBufferItem Operands::result(Value value) {
+  if (value.kind == ValueKind::Item) {
+    return m_items[value.index];
+  }
+
+  ASSERT(value.kind == ValueKind::Temporary);
+
+  const ValueType& type = m_types.temporaries[value.index];
+  const Triple& shape = type.shape;
+  GpuBufferItem item{ type.type, shape, allocate(shape[0] * shape[1] * shape[2]) };
+  m_temporaries[value.index] = item;
+  m_defined[value.index] = true;
+
+  return item;
+}
+
+ShaderSnippet compileMultiplyInstruction(Operands& operands, const Instruction& instruction) {
+  ShaderSnippet snippet;
+
+  Token arg1 = operands.get(instruction.args[0]);
+  Token arg2 = operands.get(instruction.args[1]);
+
+  if (arg1.isNumeric()) {
+    EXCEPTION("No function 'multiply' matching argument types");
+  }
+  else if (arg1.bufferItem().type == MathObjectType::Array) {
+    if (arg2.isNumeric()) {
+      size_t vOffset = arg1.bufferItem().offset;
+      size_t vSize = arg1.bufferItem().shape[0];
+      netfloat_t x = arg2.floatValue();
+      size_t rOffset = operands.result(instruction.result).offset;
+
+      snippet.emit = [=](ElementwiseChain& chain) {
+        std::string v = chain.load(vOffset);
+        chain.store(rOffset, v + " * " + chain.parameters().add(x));
+      };
+
+      snippet.workSize = vSize;
+      snippet.isElementwise = true;
+      snippet.reads = { BufferAccess{ vOffset, vSize, true } };
+      snippet.writes = { BufferAccess{ rOffset, vSize, true } };
+    }
+    else {
+      EXCEPTION("No function 'multiply' matching argument types");
+    }
+  }
+  else if (arg1.bufferItem().type == MathObjectType::Array2) {
+    if (arg2.isNumeric()) {
+      EXCEPTION("No function 'multiply' matching argument types");
+    }
+    else if (arg2.bufferItem().type == MathObjectType::Array) {
+      size_t mOffset = arg1.bufferItem().offset;
+      size_t mCols = arg1.bufferItem().shape[0];
+      size_t mRows = arg1.bufferItem().shape[1];
+      size_t vOffset = arg2.bufferItem().offset;
+      size_t vSize = arg2.bufferItem().shape[0];
+
+      size_t rOffset = operands.result(instruction.result).offset;
+
+      snippet.source = [=](ShaderParameters& params, const LaunchConfig& config) {
+        return STR("matVecMultiply(" << params.add(mOffset) << ", " << params.add(mCols) << ", "
+          << params.add(mRows) << ", " << params.add(vOffset) << ", " << params.add(vSize) << ", "
+          << params.add(rOffset) << ", " << params.add(config.rowsPerWorkgroup) << ");");
+      };
+      snippet.numWorkgroups = [mRows](const LaunchConfig& config) {
+        return (mRows + config.rowsPerWorkgroup - 1) / config.rowsPerWorkgroup;
+      };
+
+      snippet.launch = LaunchConfig{ MatVecWorkgroupSize, MatVecRowsPerWorkgroup, MatVecTileSize };
+      snippet.tuningKey = STR("matVecMultiply " << mRows << "x" << mCols);
+      snippet.isReduction = true;
+      snippet.reads = {
+        BufferAccess{ mOffset, mCols * mRows, false },
+        BufferAccess{ vOffset, vSize, false }
+      };
+      snippet.writes = { BufferAccess{ rOffset, mRows, true } };
+    }
+    else {
+      EXCEPTION("No function 'multiply' matching argument types");
+    }
+  }
+  else {
+    EXCEPTION("No function 'multiply' matching argument types");
+  }
+
+  return snippet;
+}
+
+ShaderSnippet compileAddInstruction(Operands& operands, const Instruction& instruction) {
+  ShaderSnippet snippet;
+
+  Token arg1 = operands.get(instruction.args[0]);
+  Token arg2 = operands.get(instruction.args[1]);
+
+  if (arg1.isNumeric()) {
+    EXCEPTION("No function 'add' matching argument types");
+  }
+  else if (arg1.bufferItem().type == MathObjectType::Array) {
+    if (arg2.isNumeric()) {
+      EXCEPTION("No function 'add' matching argument types");
+    }
+    else if (arg2.bufferItem().type == MathObjectType::Array) {
+      size_t aOffset = arg1.bufferItem().offset;
+      size_t aSize = arg1.bufferItem().shape[0];
+      size_t bOffset = arg2.bufferItem().offset;
+
+      size_t rOffset = operands.result(instruction.result).offset;
+
+      snippet.emit = [=](ElementwiseChain& chain) {
+        std::string a = chain.load(aOffset);
+        std::string b = chain.load(bOffset);
+        chain.store(rOffset, a + " + " + b);
+      };
+
+      snippet.workSize = aSize;
+      snippet.isElementwise = true;
+      snippet.reads = {
+        BufferAccess{ aOffset, aSize, true },
+        BufferAccess{ bOffset, aSize, true }
+      };
+      snippet.writes = { BufferAccess{ rOffset, aSize, true } };
+    }
+    else {
+      EXCEPTION("No function 'add' matching argument types");
+    }
+  }
+  else {
+    EXCEPTION("No function 'add' matching argument types");
+  }
+
+  return snippet;
+}
+
+size_t singleWorkgroup(const LaunchConfig&) {
+  return 1;
+}
+
+// The call a reduction snippet makes, given the address its result or partial results go to
+using ReductionCall = std::function<std::string(ShaderParameters&, size_t)>;
+
+// Compiles a reduction of size elements to rOffset. call reduces the elements over the workgroups
+// of its dispatch, each writing its partial result, and finish is the function that reduces the
+// partial results. If one workgroup is enough, single is called instead and there's no second
+// dispatch.
+std::vector<ShaderSnippet> compileReduction(Operands& operands, const std::string& name,
+  size_t size, size_t rOffset, ReductionCall call, ReductionCall single,
+  const std::string& finish) {
+
+  size_t numPartials = std::min(MaxReductionPartials,
+    std::max<size_t>(1, (size + ReductionChunkSize - 1) / ReductionChunkSize));
+
+  ShaderSnippet snippet;
+  snippet.launch.workgroupSize = ReductionWorkgroupSize;
+  snippet.tuningKey = STR(name << " " << size);
+  snippet.isReduction = true;
+
+  if (numPartials == 1) {
+    snippet.source = [=](ShaderParameters& params, const LaunchConfig&) {
+      return single(params, rOffset);
+    };
+    snippet.numWorkgroups = singleWorkgroup;
+
+    return { snippet };
+  }
+
+  size_t partialsOffset = operands.allocate(numPartials);
+
+  snippet.source = [=](ShaderParameters& params, const LaunchConfig&) {
+    return call(params, partialsOffset);
+  };
+  snippet.numWorkgroups = [numPartials](const LaunchConfig&) {
+    return numPartials;
+  };
+
+  ShaderSnippet finishSnippet;
+  finishSnippet.source = [=](ShaderParameters& params, const LaunchConfig&) {
+    return STR(finish << "(" << params.add(partialsOffset) << ", " << params.add(numPartials)
+      << ", " << params.add(rOffset) << ");");
+  };
+  finishSnippet.numWorkgroups = singleWorkgroup;
+  finishSnippet.launch.workgroupSize = ReductionWorkgroupSize;
+  finishSnippet.tuningKey = STR(finish << " " << numPartials);
+  finishSnippet.isReduction = true;
+
+  return { snippet, finishSnippet };
+}
+
+std::vector<ShaderSnippet> compileSumInstruction(Operands& operands,
+  const Instruction& instruction) {
+
+  Token arg1 = operands.get(instruction.args[0]);
+
+  if (arg1.isNumeric()) {
+    EXCEPTION("No function 'sum' matching argument types");
+  }
+  else if (arg1.bufferItem().type == MathObjectType::Array
+    || arg1.bufferItem().type == MathObjectType::Array2) {
+
+    size_t vOffset = arg1.bufferItem().offset;
+    size_t vSize = arg1.bufferItem().shape[0] * arg1.bufferItem().shape[1];
+    size_t rOffset = operands.result(instruction.result).offset;
+
+    auto call = [=](ShaderParameters& params, size_t offset) {
+      return STR("vecSum(" << params.add(vOffset) << ", " << params.add(vSize) << ", "
+        << params.add(offset) << ");");
+    };
+
+    return compileReduction(operands, "vecSum", vSize, rOffset, call, call, "vecSum");
+  }
+  else {
+    EXCEPTION("No function 'sum' matching argument types");
+  }
+}
+
+std::vector<ShaderSnippet> compileDotInstruction(Operands& operands,
+  const Instruction& instruction) {
+
+  Token arg1 = operands.get(instruction.args[0]);
+  Token arg2 = operands.get(instruction.args[1]);
+
+  if (arg1.isNumeric() || arg2.isNumeric()) {
+    EXCEPTION("No function 'dot' matching argument types");
+  }
+  else if (arg1.bufferItem().type == MathObjectType::Array
+    && arg2.bufferItem().type == MathObjectType::Array) {
+
+    size_t aOffset = arg1.bufferItem().offset;
+    size_t aSize = arg1.bufferItem().shape[0];
+    size_t bOffset = arg2.bufferItem().offset;
+
+    size_t rOffset = operands.result(instruction.result).offset;
+
+    auto call = [=](ShaderParameters& params, size_t offset) {
+      return STR("vecDot(" << params.add(aOffset) << ", " << params.add(bOffset) << ", "
+        << params.add(aSize) << ", " << params.add(offset) << ");");
+    };
+
+    return compileReduction(operands, "vecDot", aSize, rOffset, call, call, "vecSum");
+  }
+  else {
+    EXCEPTION("No function 'dot' matching argument types");
+  }
+}
+
+std::vector<ShaderSnippet> compileNormInstruction(Operands& operands,
+  const Instruction& instruction) {
+
+  Token arg1 = operands.get(instruction.args[0]);
+
+  if (arg1.isNumeric()) {
+    EXCEPTION("No function 'norm' matching argument types");
+  }
+  else if (arg1.bufferItem().type == MathObjectType::Array) {
+    size_t vOffset = arg1.bufferItem().offset;
+    size_t vSize = arg1.bufferItem().shape[0];
+    size_t rOffset = operands.result(instruction.result).offset;
+
+    auto call = [=](ShaderParameters& params, size_t offset) {
+      return STR("vecSquareSum(" << params.add(vOffset) << ", " << params.add(vSize) << ", "
+        << params.add(offset) << ");");
+    };
+    auto single = [=](ShaderParameters& params, size_t offset) {
+      return STR("vecNorm(" << params.add(vOffset) << ", " << params.add(vSize) << ", "
+        << params.add(offset) << ");");
+    };
+
+    return compileReduction(operands, "vecNorm", vSize, rOffset, call, single, "vecSumRoot");
+  }
+  else {
+    EXCEPTION("No function 'norm' matching argument types");
+  }
+}
+
+size_t Operands::allocate(size_t size) {
+  size_t offset = m_computation.scratchOffset + m_computation.scratchSize;
+  m_computation.scratchSize += alignUp(size, BufferAlignment);
+
+  ASSERT_MSG(addressOffset(m_computation.scratchOffset) + m_computation.scratchSize
+    <= size_t(1) << BufferBindingShift, "Computation needs too much scratch space");
+
+  return offset;
+}
+
+ShaderSnippet compileCopyInstruction(Operands& operands, const Instruction& instruction) {
+  ShaderSnippet snippet;
+
+  Token arg1 = operands.get(instruction.args[0]);
+
+  if (arg1.isNumeric()) {
+    EXCEPTION("No function 'copy' matching argument types");
+  }
+  else {
+    const GpuBufferItem& src = arg1.bufferItem();
+    size_t size = src.shape[0] * src.shape[1] * src.shape[2];
+    size_t rOffset = operands.result(instruction.result).offset;
+
+    size_t srcOffset = src.offset;
+
+    snippet.emit = [=](ElementwiseChain& chain) {
+      chain.store(rOffset, chain.load(srcOffset));
+    };
+
+    snippet.workSize = size;
+    snippet.isElementwise = true;
+    snippet.reads = { BufferAccess{ srcOffset, size, true } };
+    snippet.writes = { BufferAccess{ rOffset, size, true } };
+  }
+
+  return snippet;
+}
+
+// Reductions may compile to more than one snippet
+std::vector<ShaderSnippet> compileInstruction(Operands& operands,
+  const Instruction& instruction) {
+
+  switch (instruction.op) {
+    case OpCode::Copy: return { compileCopyInstruction(operands, instruction) };
+    case OpCode::Multiply: return { compileMultiplyInstruction(operands, instruction) };
+    case OpCode::Add: return { compileAddInstruction(operands, instruction) };
+    case OpCode::Sum: return compileSumInstruction(operands, instruction);
+    case OpCode::Dot: return compileDotInstruction(operands, instruction);
+    case OpCode::Norm: return compileNormInstruction(operands, instruction);
+    case OpCode::LoopBegin:
+    case OpCode::LoopEnd: break;
+  }
+
+  EXCEPTION("Function '" << opCodeName(instruction.op) << "' not supported");
+}
+
+CompiledNode compileLoop(Operands& operands, const Graph& graph, size_t& i);
+
+// Compiles instructions from i until the end of the enclosing loop, leaving i at its LoopEnd
+void compileBlock(Operands& operands, const Graph& graph, size_t& i,
+  std::vector<CompiledNode>& nodes) {
+
+  const std::vector<Instruction>& instructions = graph.instructions();
+
+  for (; i < instructions.size(); ++i) {
+    const Instruction& instruction = instructions[i];
+
+    if (instruction.op == OpCode::LoopEnd) {
+      return;
+    }
+
+    if (instruction.op == OpCode::LoopBegin) {
+      nodes.push_back(compileLoop(operands, graph, i));
+    }
+    else {
+      for (ShaderSnippet& snippet : compileInstruction(operands, instruction)) {
+        CompiledNode node;
+        node.snippet = std::move(snippet);
+        node.snippet.command = graph.describe(instruction);
+        nodes.push_back(node);
+      }
+    }
+  }
+}
+
+bool canLoopInShader(const std::vector<CompiledNode>& body) {
+  for (const CompiledNode& node : body) {
+    if (node.isLoop || node.snippet.isReduction || !node.snippet.isElementwise
+      || node.snippet.workSize != body.front().snippet.workSize) {
+
+      return false;
+    }
+  }
+  return !body.empty();
+}
+
+CompiledNode compileLoop(Operands& operands, const Graph& graph, size_t& i) {
+  const Instruction& instruction = graph.instructions()[i];
+  const Loop& loop = graph.loop(instruction);
+
+  CompiledNode node;
+  compileBlock(operands, graph, ++i, node.body);
+
+  node.snippet.command = graph.describe(instruction);
+  node.iterations = loop.maxIterations;
+
+  if (loop.conditional) {
+    node.conditional = true;
+    node.conditionOffset = operands.get(loop.condition).bufferItem().offset;
+    node.threshold = loop.threshold;
+    node.flagOffset = operands.allocate(1);
+  }
+
+  // An unconditional loop over elementwise snippets runs inside the shader, and is itself
+  // elementwise
+  if (!node.conditional && canLoopInShader(node.body)) {
+    std::string counter = STR("loop" << instruction.loop);
+    size_t iterations = loop.maxIterations;
+    std::vector<ShaderSnippet> body;
+    std::stringstream command;
+
+    command << node.snippet.command << std::endl;
+
+    for (const CompiledNode& bodyNode : node.body) {
+      const ShaderSnippet& snippet = bodyNode.snippet;
+
+      body.push_back(snippet);
+      command << snippet.command << std::endl;
+      node.snippet.reads.insert(node.snippet.reads.end(), snippet.reads.begin(),
+        snippet.reads.end());
+      node.snippet.writes.insert(node.snippet.writes.end(), snippet.writes.begin(),
+        snippet.writes.end());
+    }
+
+    command << "}";
+
+    // Everything the body touches is loaded before the loop, so the loop only updates registers
+    std::vector<BufferAccess> accesses = node.snippet.reads;
+    accesses.insert(accesses.end(), node.snippet.writes.begin(), node.snippet.writes.end());
+
+    node.snippet.emit = [body, counter, iterations, accesses](ElementwiseChain& chain) {
+      for (const BufferAccess& access : accesses) {
+        chain.load(access.offset);
+      }
+      chain.append(STR("for (uint " << counter << " = 0; " << counter << " < "
+        << chain.parameters().add(iterations) << "; ++" << counter << ") {"));
+      for (const ShaderSnippet& snippet : body) {
+        snippet.emit(chain);
+      }
+      chain.append("}");
+    };
+
+    node.snippet.command = command.str();
+    node.snippet.workSize = node.body.front().snippet.workSize;
+    node.snippet.isElementwise = true;
+    node.body.clear();
+
+    return node;
+  }
+
+  node.isLoop = true;
+  return node;
+}
+
+class GpuExecutor : public Executor {
+  public:
+    GpuExecutor(Logger& logger, bool autotune, bool allowZeroCopy);
+  
+    ComputationPtr compile(const Buffer& buffer, const Graph& graph) const override;
+    void execute(Buffer& buffer, const Computation& computation) const override;
+    void submit(Buffer& buffer, const Computation& computation) const override;
+    void wait() const override;
+
+    ~GpuExecutor() override;
+
+  private:
+    GpuComputationStep compileStep(const std::vector<ShaderSnippet>& snippets,
+      const LaunchConfig& config, const std::vector<size_t>& loopFlags) const;
+    // Returns the tuned configuration for the dispatch of the snippets if there is one, tuning it
+    // first in autotune mode, and otherwise the default
+    LaunchConfig launchConfig(const std::vector<ShaderSnippet>& snippets) const;
+    std::vector<LaunchConfig> launchCandidates(const LaunchConfig& defaults) const;
+    LaunchConfig tune(const std::string& key, const std::vector<ShaderSnippet>& snippets,
+      const std::vector<LaunchConfig>& candidates) const;
+    void emitBlock(const std::vector<CompiledNode>& nodes, GpuComputation& computation,
+      std::vector<size_t>& loopFlags) const;
+    void emitLoop(const CompiledNode& node, GpuComputation& computation,
+      std::vector<size_t>& loopFlags) const;
+    // Returns the device's copy of the buffer. If there isn't one, creates one, uploads the whole
+    // buffer to it and sets created.
+    BufferHandle residentBuffer(GpuBuffer& buffer, bool& created) const;
+    FrameHandle submitFrame(GpuBuffer& buffer, const GpuComputation& computation) const;
+
+    struct ResidentBuffer {
+      uint64_t id;
+      BufferHandle handle;
+      std::weak_ptr<GpuBuffer*> buffer;
+    };
+
+    // Frees the device's copy of the buffer. If the buffer still exists, first copies back the
+    // items only the device has, and moves any in its mapped memory back to the buffer.
+    void evict(const ResidentBuffer& resident) const;
+
+    // Buffers are identified by id rather than address, since a new buffer may be allocated where
+    // a destroyed one was
+    struct Submission {
+      uint64_t bufferId;
+      // Where the outputs are retrieved to
+      std::vector<void*> storage;
+      FrameHandle frame;
+    };
+
+    Logger& m_logger;
+    GpuPtr m_gpu;
+    bool m_autotune;
+    mutable KernelTunings m_tunings;
+    // Least recently used first
+    mutable std::vector<ResidentBuffer> m_residentBuffers;
+    // Oldest first
+    mutable std::deque<Submission> m_submissions;
+    // The number of elements of each binding of the computation being compiled, whether each is
+    // shared, and the device buffer of zeroes laid out like that it's tuned with, once created
+    mutable std::vector<size_t> m_tuningBufferSizes;
+    mutable std::vector<bool> m_tuningBufferShared;
+    mutable std::optional<BufferHandle> m_tuningBuffer;
+    // An empty command list, for frames that only transfer data
+    mutable std::optional<CommandsHandle> m_noCommands;
+};
+
+GpuExecutor::GpuExecutor(Logger& logger, bool autotune, bool allowZeroCopy)
+  : m_logger(logger)
+  , m_gpu(createGpu(allowZeroCopy))
+  , m_autotune(autotune)
+  , m_tunings(m_gpu->properties().deviceId) {
+
+  m_logger.info(m_gpu->properties().zeroCopy ? "GPU transfers map device memory directly"
+                                             : "GPU transfers go through staging buffers");
+}
+
+GpuExecutor::~GpuExecutor() {
+  while (!m_submissions.empty()) {
+    wait();
+  }
+
+  for (const ResidentBuffer& resident : m_residentBuffers) {
+    evict(resident);
+  }
+
+  if (m_noCommands) {
+    m_gpu->freeCommands(*m_noCommands);
+  }
+}
+
+// Compiles the snippets into one shader, dispatched over enough workgroups for the largest of
+// them, up to the device's limit; elementwise snippets and matVecMultiply loop over the work the
+// dispatch doesn't cover. Consecutive elementwise snippets with the same work size are chained. The
+// source only depends on the pattern of operations and the launch configuration; the buffer
+// offsets, sizes and scalars are the step's parameters. loopFlags are the flags of the enclosing
+// conditional loops; the shader does nothing once any of them is set.
+GpuComputationStep GpuExecutor::compileStep(const std::vector<ShaderSnippet>& snippets,
+  const LaunchConfig& config, const std::vector<size_t>& loopFlags) const {
+
+  size_t numWorkgroups = 0;
+  for (const ShaderSnippet& snippet : snippets) {
+    numWorkgroups = std::max(numWorkgroups, snippet.numWorkgroups ? snippet.numWorkgroups(config)
+      : (snippet.workSize + config.workgroupSize - 1) / config.workgroupSize);
+  }
+  numWorkgroups = std::min(numWorkgroups, m_gpu->properties().maxWorkgroupCount);
+
+  std::ifstream fin("data/functions.glsl");
+  std::stringstream commands;
+  std::stringstream shaderSource;
+
+  shaderSource << "#version 450" << std::endl;
+  shaderSource << "#define BUFFER_BINDINGS " << m_gpu->properties().maxBufferBindings << std::endl;
+  shaderSource << "#define BUFFER_BINDING_SHIFT " << BufferBindingShift << std::endl;
+  if (m_gpu->properties().subgroupArithmetic) {
+    shaderSource << "#extension GL_KHR_shader_subgroup_arithmetic : require" << std::endl;
+    shaderSource << "#define SUBGROUP_ARITHMETIC" << std::endl;
+  }
+  if (config.tileSize != 0) {
+    shaderSource << "#define MATVEC_TILE_SIZE " << config.tileSize << std::endl;
+  }
+  shaderSource << std::endl;
+  shaderSource << "layout (local_size_x = " << config.workgroupSize << ") in;" << std::endl
+    << std::endl;
+  shaderSource << "layout (std430, push_constant) uniform Parameters {" << std::endl;
+  shaderSource << "  uint p[" << MaxDispatchParameters << "];" << std::endl;
+  shaderSource << "} params;" << std::endl << std::endl;
+
+  std::string line;
+  while (std::getline(fin, line)) {
+    shaderSource << line << std::endl;
+  }
+
+  shaderSource << std::endl;
+  shaderSource << "void main() {" << std::endl;
+
+  ShaderParameters params;
+
+  for (size_t flagOffset : loopFlags) {
+    shaderSource << "if (loopExited(" << params.add(flagOffset) << ")) return;" << std::endl;
+  }
+
+  std::optional<ElementwiseChain> chain;
+
+  auto endChain = [&]() {
+    if (chain) {
+      shaderSource << chain->finish() << std::endl;
+      chain.reset();
+    }
+  };
+
+  for (const ShaderSnippet& snippet : snippets) {
+    if (snippet.isElementwise) {
+      if (chain && chain->workSize() != snippet.workSize) {
+        endChain();
+      }
+      if (!chain) {
+        chain.emplace(snippet.workSize, params);
+      }
+      snippet.emit(*chain);
+    }
+    else {
+      endChain();
+      shaderSource << snippet.source(params, config) << std::endl;
+    }
+
+    commands << snippet.command << std::endl;
+  }
+
+  endChain();
+
+  shaderSource << "}" << std::endl;
+
+  GpuComputationStep step;
+  step.source = shaderSource.str();
+  step.parameters = params.values();
+  step.numWorkgroups = numWorkgroups;
+  step.commands = commands.str();
+
+  return step;
+}
+
+LaunchConfig GpuExecutor::launchConfig(const std::vector<ShaderSnippet>& snippets) const {
+  std::string key;
+  LaunchConfig defaults;
+
+  if (snippets.size() == 1 && !snippets.front().isElementwise) {
+    key = snippets.front().tuningKey;
+    defaults = snippets.front().launch;
+  }
+  else {
+    size_t workSize = 0;
+    for (const ShaderSnippet& snippet : snippets) {
+      workSize = std::max(workSize, snippet.workSize);
+    }
+    key = STR("elementwise " << workSize);
+  }
+
+  if (key.empty()) {
+    return defaults;
+  }
+
+  std::optional<LaunchConfig> tuned = m_tunings.find(key);
+  if (tuned) {
+    return *tuned;
+  }
+
+  if (!m_autotune) {
+    return defaults;
+  }
+
+  LaunchConfig config = tune(key, snippets, launchCandidates(defaults));
+  m_tunings.insert(key, config);
+
+  return config;
+}
+
+// Workgroup sizes are powers of two, which the reductions need, and multiples of the subgroup size.
+// Only matVecMultiply has rows per workgroup and tile sizes to vary. Configurations that need more
+// shared memory than the device has are left out.
+std::vector<LaunchConfig> GpuExecutor::launchCandidates(const LaunchConfig& defaults) const {
+  const GpuProperties& device = m_gpu->properties();
+
+  std::vector<size_t> rowCounts = { 0 };
+  std::vector<size_t> tileSizes = { 0 };
+
+  if (defaults.rowsPerWorkgroup != 0) {
+    rowCounts = { 1, 2, 4, 8, 16, 32 };
+    tileSizes = { 1024, 2048, 4096 };
+  }
+
+  std::vector<LaunchConfig> candidates;
+
+  for (size_t workgroupSize = 32; workgroupSize <= device.maxWorkgroupSize; workgroupSize *= 2) {
+    if (device.subgroupSize != 0 && workgroupSize % device.subgroupSize != 0) {
+      continue;
+    }
+
+    for (size_t rows : rowCounts) {
+      for (size_t tileSize : tileSizes) {
+        LaunchConfig config{ workgroupSize, rows, tileSize };
+
+        if (rows <= workgroupSize && sharedMemorySize(config) <= device.maxSharedMemory) {
+          candidates.push_back(config);
+        }
+      }
+    }
+  }
+
+  if (candidates.empty()) {
+    candidates.push_back(defaults);
+  }
+
+  return candidates;
+}
+
+// Times each candidate on a zeroed buffer laid out like the computation's, which the kernels' speed
+// doesn't depend on, and returns the fastest
+LaunchConfig GpuExecutor::tune(const std::string& key, const std::vector<ShaderSnippet>& snippets,
+  const std::vector<LaunchConfig>& candidates) const {
+
+  if (!m_tuningBuffer) {
+    m_tuningBuffer = m_gpu->createBuffer();
+
+    for (size_t i = 0; i < m_tuningBufferSizes.size(); ++i) {
+      std::vector<netfloat_t> zeros(m_tuningBufferSizes[i]);
+      m_gpu->submitBuffer(*m_tuningBuffer, i, zeros.data(), zeros.size() * sizeof(netfloat_t),
+        m_tuningBufferShared[i]);
+    }
+  }
+
+  std::vector<GpuComputationStep> steps;
+  std::vector<std::string> sources;
+  for (const LaunchConfig& config : candidates) {
+    steps.push_back(compileStep(snippets, config, {}));
+    sources.push_back(steps.back().source);
+  }
+
+  std::vector<ShaderHandle> shaders = m_gpu->compileShaders(sources);
+
+  size_t best = 0;
+  int64_t bestTime = std::numeric_limits<int64_t>::max();
+
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    GpuDispatch dispatch{ shaders[i], steps[i].numWorkgroups, steps[i].parameters };
+    CommandsHandle commands = m_gpu->recordCommands(std::vector<GpuDispatch>(BenchmarkDispatches,
+      dispatch));
+
+    auto execute = [&]() {
+      m_gpu->retrieveFrame(m_gpu->submitFrame(*m_tuningBuffer, {}, {}, {}, commands, {}), {});
+    };
+
+    // The first run pays for any lazy pipeline and memory setup
+    execute();
+
+    Timer timer;
+    int64_t time = std::numeric_limits<int64_t>::max();
+    for (size_t run = 0; run < BenchmarkRuns; ++run) {
+      timer.start();
+      execute();
+      time = std::min(time, timer.stop());
+    }
+
+    m_gpu->freeCommands(commands);
+
+    if (time < bestTime) {
+      best = i;
+      bestTime = time;
+    }
+  }
+
+  const LaunchConfig& config = candidates[best];
+
+  m_logger.info(STR("Tuned " << key << ": workgroup size " << config.workgroupSize
+    << ", rows per workgroup " << config.rowsPerWorkgroup << ", tile size " << config.tileSize
+    << " (" << bestTime << " microseconds for " << BenchmarkDispatches << " dispatches, "
+    << candidates.size() << " candidates)"));
+
+  return config;
+}
+
+void GpuExecutor::emitBlock(const std::vector<CompiledNode>& nodes, GpuComputation& computation,
+  std::vector<size_t>& loopFlags) const {
+
+  // The snippets of the next dispatch
+  std::vector<ShaderSnippet> snippets;
+
+  auto flush = [&]() {
+    if (!snippets.empty()) {
+      computation.steps.push_back(compileStep(snippets, launchConfig(snippets), loopFlags));
+      snippets.clear();
+    }
+  };
+
+  for (const CompiledNode& node : nodes) {
+    if (node.isLoop) {
+      flush();
+      emitLoop(node, computation, loopFlags);
+      continue;
+    }
+
+    const ShaderSnippet& snippet = node.snippet;
+
+    if (snippet.isReduction) {
+      flush();
+      computation.steps.push_back(compileStep({ snippet }, launchConfig({ snippet }), loopFlags));
+      continue;
+    }
+
+    // Dispatches are ordered by barriers, so a snippet that depends on another invocation's work
+    // starts a new one
+    if (dependsOn(snippet, snippets)) {
+      flush();
+    }
+
+    snippets.push_back(snippet);
+  }
+
+  flush();
+}
+
+// The host replays the loop's dispatches. A conditional loop sets a flag in the buffer once its
+// condition is met, after which the remaining dispatches do nothing, so the host never has to
+// read the condition back.
+void GpuExecutor::emitLoop(const CompiledNode& node, GpuComputation& computation,
+  std::vector<size_t>& loopFlags) const {
+
+  if (node.conditional) {
+    ShaderSnippet reset;
+    reset.command = node.snippet.command;
+    reset.source = [flagOffset = node.flagOffset](ShaderParameters& params, const LaunchConfig&) {
+      return STR("resetLoopFlag(" << params.add(flagOffset) << ");");
+    };
+    reset.workSize = 1;
+
+    computation.steps.push_back(compileStep({ reset }, reset.launch, loopFlags));
+  }
+
+  size_t begin = computation.steps.size();
+
+  GpuComputationStep beginStep;
+  beginStep.kind = GpuComputationStep::Kind::LoopBegin;
+  beginStep.commands = node.snippet.command;
+  beginStep.iterations = node.iterations;
+  computation.steps.push_back(beginStep);
+
+  if (node.conditional) {
+    loopFlags.push_back(node.flagOffset);
+  }
+
+  emitBlock(node.body, computation, loopFlags);
+
+  if (node.conditional) {
+    ShaderSnippet check;
+    check.command = node.snippet.command;
+    check.source = [node](ShaderParameters& params, const LaunchConfig&) {
+      return STR("exitLoopIfBelow(" << params.add(node.conditionOffset) << ", "
+        << params.add(node.threshold) << ", " << params.add(node.flagOffset) << ");");
+    };
+    check.workSize = 1;
+
+    computation.steps.push_back(compileStep({ check }, check.launch, loopFlags));
+    loopFlags.pop_back();
+  }
+
+  GpuComputationStep endStep;
+  endStep.kind = GpuComputationStep::Kind::LoopEnd;
+  endStep.commands = "}";
+  endStep.match = begin;
+  computation.steps.push_back(endStep);
+
+  computation.steps[begin].match = computation.steps.size() - 1;
+}
+
+ComputationPtr GpuExecutor::compile(const Buffer& buf, const Graph& graph) const {
+  const auto& buffer = dynamic_cast<const GpuBuffer&>(buf);
+
+  auto computation = std::make_unique<GpuComputation>(*m_gpu);
+
+  // The first computation compiled against the buffer lays it out for the device
+  if (!buffer.isLaidOut()) {
+    buffer.layout(m_gpu->properties());
+  }
+  else if (buffer.numBindings() > m_gpu->properties().maxBufferBindings) {
+    EXCEPTION("Buffer was laid out across " << buffer.numBindings() << " storage buffer bindings, "
+      "but the device only supports " << m_gpu->properties().maxBufferBindings);
+  }
+
+  computation->scratchOffset = buffer.scratchOffset();
+  computation->scratchSize = 0;
+
+  Operands operands(buffer, graph, *computation);
+
+  std::vector<CompiledNode> nodes;
+  size_t i = 0;
+  compileBlock(operands, graph, i, nodes);
+
+  m_tuningBufferSizes = buffer.bindingSizes(computation->scratchSize);
+  m_tuningBufferShared.clear();
+  for (size_t i = 0; i < buffer.numBindings(); ++i) {
+    m_tuningBufferShared.push_back(buffer.isShared(i));
+  }
+
+  std::vector<size_t> loopFlags;
+  emitBlock(nodes, *computation, loopFlags);
+
+  if (m_tuningBuffer) {
+    m_gpu->freeBuffer(*m_tuningBuffer);
+    m_tuningBuffer.reset();
+  }
+
+  std::vector<std::string> sources;
+  for (GpuComputationStep& step : computation->steps) {
+    if (step.kind == GpuComputationStep::Kind::Dispatch) {
+      sources.push_back(std::move(step.source));
+    }
+  }
+
+  std::vector<ShaderHandle> shaders = m_gpu->compileShaders(sources);
+  auto shader = shaders.begin();
+  for (GpuComputationStep& step : computation->steps) {
+    if (step.kind == GpuComputationStep::Kind::Dispatch) {
+      step.shader = *shader++;
+    }
+  }
+
+  if (graph.outputs().empty()) {
+    computation->outputs = buffer.itemRanges();
+    for (const auto& entry : buffer.items) {
+      computation->retrieved.push_back(entry.first);
+    }
+  }
+  else {
+    std::vector<GpuBufferItem> outputs;
+    for (Value output : graph.outputs()) {
+      outputs.push_back(operands.get(output).bufferItem());
+      computation->retrieved.push_back(graph.itemName(output));
+    }
+    std::sort(outputs.begin(), outputs.end(), [](const auto& a, const auto& b) {
+      return a.offset < b.offset;
+    });
+
+    for (const GpuBufferItem& output : outputs) {
+      const Triple& shape = output.shape;
+      appendRange(computation->outputs, output.offset, shape[0] * shape[1] * shape[2]);
+    }
+  }
+
+  for (const Instruction& instruction : graph.instructions()) {
+    if (instruction.op == OpCode::LoopBegin || instruction.op == OpCode::LoopEnd
+      || instruction.result.kind != ValueKind::Item) {
+
+      continue;
+    }
+
+    const std::string& name = graph.itemName(instruction.result);
+    const auto& retrieved = computation->retrieved;
+    auto& writes = computation->deviceWrites;
+
+    if (std::count(retrieved.begin(), retrieved.end(), name) == 0
+      && std::count(writes.begin(), writes.end(), name) == 0) {
+
+      writes.push_back(name);
+    }
+  }
+
+  if (computation->scratchSize > buffer.scratchCapacity()) {
+    EXCEPTION("Computation needs " << computation->scratchSize * sizeof(netfloat_t) << " bytes of "
+      "scratch space, but only " << buffer.scratchCapacity() * sizeof(netfloat_t) << " fit in the "
+      "device's storage buffer after the buffer's items");
+  }
+
+  if (buffer.isAllocated()) {
+    ASSERT_MSG(computation->scratchSize <= buffer.scratchSize,
+      "Computation needs more scratch space than the buffer reserved; compile it before the "
+      "buffer's first execute");
+  }
+  buffer.scratchSize = std::max(buffer.scratchSize, computation->scratchSize);
+
+  computation->commands = m_gpu->recordCommands(unrollSteps(computation->steps));
+
+  return computation;
+}
+
+void GpuExecutor::execute(Buffer& buf, const Computation& computation) const {
+  auto& buffer = dynamic_cast<GpuBuffer&>(buf);
   const auto& c = dynamic_cast<const GpuComputation&>(computation);
-  for (const auto& step : c.steps) {
+
+  // Another frame of the buffer would have to be retrieved first
+  for (const Submission& submission : m_submissions) {
+    ASSERT_MSG(submission.bufferId != buffer.id,
+      "Can't execute with submissions against the same buffer outstanding");
+  }
+
+  Timer timer;
+  timer.start();
+  FrameHandle frame = submitFrame(buffer, c);
+  int64_t submitTime = timer.stop();
+
 #ifndef NDEBUG
+  for (const GpuComputationStep& step : c.steps) {
     m_logger.info(STR("Executing commands: \n" << step.commands));
-#endif
-    m_gpu->executeShader(step.shader, step.numWorkgroups);
   }
-  executionTime = timer.stop();
+#endif
 
   timer.start();
-  m_gpu->retrieveBuffer(buffer.storage.data());
-  retrievalTime = timer.stop();
+  m_gpu->waitForFrame(frame);
+  int64_t executionTime = timer.stop();
+
+  timer.start();
+  m_gpu->retrieveFrame(frame, buffer.storage());
+  int64_t retrievalTime = timer.stop();
 
   m_logger.info(STR("Submit time = " << submitTime));
   m_logger.info(STR("Execution time = " << executionTime));
-  m_logger.info(STR("Retrieval time = " << retrievalTime));
+  size_t retrievedBytes = 0;
+  for (const GpuBufferRange& range : c.outputs) {
+    retrievedBytes += range.size;
+  }
+  m_logger.info(STR("Retrieval time = " << retrievalTime << " (" << retrievedBytes << " bytes)"));
+}
+
+// Each buffer resident on the device has its own frames, so submissions against different buffers
+// can be in flight together, as can FramesInFlight against the same buffer. The device only waits
+// when results are retrieved.
+void GpuExecutor::submit(Buffer& buf, const Computation& computation) const {
+  auto& buffer = dynamic_cast<GpuBuffer&>(buf);
+  const auto& c = dynamic_cast<const GpuComputation&>(computation);
+
+  size_t outstanding = std::count_if(m_submissions.begin(), m_submissions.end(),
+    [&buffer](const Submission& submission) { return submission.bufferId == buffer.id; });
+
+  ASSERT_MSG(outstanding < FramesInFlight, "Can't have more than " << FramesInFlight
+    << " submissions against the same buffer outstanding");
+
+  FrameHandle frame = submitFrame(buffer, c);
+  m_submissions.push_back(Submission{ buffer.id, buffer.storage(), frame });
+}
+
+void GpuExecutor::wait() const {
+  ASSERT_MSG(!m_submissions.empty(), "There are no submissions to wait for");
+
+  Submission submission = m_submissions.front();
+  m_submissions.pop_front();
+
+  m_gpu->retrieveFrame(submission.frame, submission.storage);
+}
+
+// Buffers that have been destroyed keep their device copies until they're evicted
+BufferHandle GpuExecutor::residentBuffer(GpuBuffer& buffer, bool& created) const {
+  created = false;
+
+  auto i = std::find_if(m_residentBuffers.begin(), m_residentBuffers.end(),
+    [&buffer](const ResidentBuffer& resident) { return resident.id == buffer.id; });
+
+  if (i != m_residentBuffers.end()) {
+    ResidentBuffer resident = *i;
+    m_residentBuffers.erase(i);
+    m_residentBuffers.push_back(resident);
+
+    return resident.handle;
+  }
+
+  if (m_residentBuffers.size() == MaxResidentBuffers) {
+    // The least recently used buffer without submissions outstanding
+    auto evicted = std::find_if(m_residentBuffers.begin(), m_residentBuffers.end(),
+      [this](const ResidentBuffer& resident) {
+        return std::none_of(m_submissions.begin(), m_submissions.end(),
+          [&resident](const Submission& submission) {
+            return submission.bufferId == resident.id;
+          });
+      });
+
+    ASSERT_MSG(evicted != m_residentBuffers.end(), "Can't have submissions against more than "
+      << MaxResidentBuffers << " buffers outstanding");
+
+    evict(*evicted);
+    m_residentBuffers.erase(evicted);
+  }
+
+  BufferHandle handle = m_gpu->createBuffer();
+  std::vector<void*> storage = buffer.storage();
+
+  for (size_t i = 0; i < storage.size(); ++i) {
+    m_gpu->submitBuffer(handle, i, storage[i], buffer.size(i) * sizeof(netfloat_t),
+      buffer.isShared(i));
+
+    // The items of a shared binding can live in its mapped memory, unless another executor's
+    // device copy already holds them
+    void* mapped = buffer.isShared(i) ? m_gpu->mappedBinding(handle, i) : nullptr;
+    if (mapped != nullptr && buffer.mapping(i) == nullptr) {
+      buffer.map(i, mapped);
+    }
+  }
+  buffer.clearDirty();
+
+  m_residentBuffers.push_back(ResidentBuffer{ buffer.id, handle, buffer.self });
+  created = true;
+
+  return handle;
+}
+
+FrameHandle GpuExecutor::submitFrame(GpuBuffer& buffer, const GpuComputation& c) const {
+  ASSERT_MSG(buffer.isLaidOut() && buffer.scratchOffset() == c.scratchOffset,
+    "The computation was compiled against a buffer laid out differently");
+
+  if (!buffer.isAllocated()) {
+    buffer.allocate();
+  }
+
+  bool created = false;
+  BufferHandle handle = residentBuffer(buffer, created);
+
+  // A new device copy already has everything
+  std::vector<GpuBufferRange> inputs;
+  if (!created) {
+    inputs = buffer.uploadRanges();
+  }
+
+  std::vector<GpuBufferRange> carried = buffer.carriedRanges();
+  buffer.setDeviceOwned(c.deviceWrites, c.retrieved);
+
+  // Outputs in this device copy's mapped memory are already where the items are
+  std::vector<GpuBufferRange> outputs;
+  for (const GpuBufferRange& range : c.outputs) {
+    if (buffer.mapping(range.binding) == nullptr
+      || buffer.mapping(range.binding) != m_gpu->mappedBinding(handle, range.binding)) {
+
+      outputs.push_back(range);
+    }
+  }
+
+  std::vector<void*> storage = buffer.storage();
+  return m_gpu->submitFrame(handle, std::vector<const void*>(storage.begin(), storage.end()),
+    inputs, carried, *c.commands, outputs);
+}
+
+void GpuExecutor::evict(const ResidentBuffer& resident) const {
+  if (std::shared_ptr<GpuBuffer*> buffer = resident.buffer.lock()) {
+    std::vector<GpuBufferRange> owned = (*buffer)->deviceOwnedRanges();
+
+    // Runs no commands, just copies back the items only the device has
+    if (!owned.empty()) {
+      if (!m_noCommands) {
+        m_noCommands = m_gpu->recordCommands({});
+      }
+
+      std::vector<void*> storage = (*buffer)->storage();
+      FrameHandle frame = m_gpu->submitFrame(resident.handle,
+        std::vector<const void*>(storage.begin(), storage.end()), {},
+        (*buffer)->carriedRanges(), *m_noCommands, owned);
+
+      m_gpu->retrieveFrame(frame, storage);
+      (*buffer)->clearDeviceOwned();
+    }
+
+    for (size_t i = 0; i < (*buffer)->numBindings(); ++i) {
+      void* mapped = (*buffer)->isShared(i) ? m_gpu->mappedBinding(resident.handle, i) : nullptr;
+      if (mapped != nullptr && (*buffer)->mapping(i) == mapped) {
+        (*buffer)->unmap(i);
+      }
+    }
+  }
+
+  m_gpu->freeBuffer(resident.handle);
 }
 
 }
 
-ExecutorPtr createGpuExecutor(Logger& logger) {
-  return std::make_unique<GpuExecutor>(logger);
+ExecutorPtr createGpuExecutor(Logger& logger, bool autotune, bool allowZeroCopy) {
+  return std::make_unique<GpuExecutor>(logger, autotune, allowZeroCopy);
 }
 
 BufferPtr createGpuBuffer() {
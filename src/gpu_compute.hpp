@@ -3,5 +3,11 @@
 #include "compute.hpp"
 
 class Logger;
-ExecutorPtr createGpuExecutor(Logger& logger);
+
+// Launch configurations tuned on the device by previous runs are used wherever one is known. In
+// autotune mode, compile() first measures alternatives for operations that haven't been tuned, and
+// saves the fastest. Submissions against several buffers can be outstanding at once, up to two
+// against each. Pass allowZeroCopy = false to copy through staging buffers even where the device's
+// memory could be mapped directly.
+ExecutorPtr createGpuExecutor(Logger& logger, bool autotune = false, bool allowZeroCopy = true);
 BufferPtr createGpuBuffer();
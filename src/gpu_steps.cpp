@@ -0,0 +1,83 @@
+#include "gpu_steps.hpp"
+#include "exception.hpp"
+#include <algorithm>
+
+namespace {
+
+// Returns the number of dispatches the steps expand to, or MaxUnrolledDispatches + 1 if it's more
+// than that
+size_t numUnrolledDispatches(const std::vector<GpuComputationStep>& steps) {
+  const size_t tooMany = MaxUnrolledDispatches + 1;
+
+  // The dispatches so far of each enclosing loop's body, and of the steps outside them
+  std::vector<size_t> counts{ 0 };
+
+  for (const GpuComputationStep& step : steps) {
+    switch (step.kind) {
+      case GpuComputationStep::Kind::Dispatch: {
+        counts.back() = std::min(counts.back() + 1, tooMany);
+        break;
+      }
+      case GpuComputationStep::Kind::LoopBegin: {
+        counts.push_back(0);
+        break;
+      }
+      case GpuComputationStep::Kind::LoopEnd: {
+        size_t body = counts.back();
+        size_t iterations = steps[step.match].iterations;
+        counts.pop_back();
+
+        size_t loop = body == 0 ? 0 : std::min(iterations, tooMany / body + 1) * body;
+        counts.back() = std::min(counts.back() + loop, tooMany);
+        break;
+      }
+    }
+  }
+
+  return counts.back();
+}
+
+}
+
+std::vector<GpuDispatch> unrollSteps(const std::vector<GpuComputationStep>& steps) {
+  size_t numDispatches = numUnrolledDispatches(steps);
+  if (numDispatches > MaxUnrolledDispatches) {
+    EXCEPTION("Error compiling computation; Its loops expand to more than "
+      << MaxUnrolledDispatches << " dispatches");
+  }
+
+  std::vector<GpuDispatch> dispatches;
+  dispatches.reserve(numDispatches);
+  std::vector<size_t> iterationsLeft;
+
+  for (size_t i = 0; i < steps.size(); ++i) {
+    const GpuComputationStep& step = steps[i];
+
+    switch (step.kind) {
+      case GpuComputationStep::Kind::Dispatch: {
+        dispatches.push_back(GpuDispatch{ step.shader, step.numWorkgroups, step.parameters });
+        break;
+      }
+      case GpuComputationStep::Kind::LoopBegin: {
+        if (step.iterations == 0) {
+          i = step.match;
+        }
+        else {
+          iterationsLeft.push_back(step.iterations);
+        }
+        break;
+      }
+      case GpuComputationStep::Kind::LoopEnd: {
+        if (--iterationsLeft.back() > 0) {
+          i = step.match;
+        }
+        else {
+          iterationsLeft.pop_back();
+        }
+        break;
+      }
+    }
+  }
+
+  return dispatches;
+}
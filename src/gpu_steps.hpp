@@ -0,0 +1,36 @@
+#pragma once
+
+#include "gpu.hpp"
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// A dispatch of a compiled computation, or one end of a loop around a run of them
+struct GpuComputationStep {
+  enum class Kind {
+    Dispatch,
+    LoopBegin,
+    LoopEnd
+  };
+
+  Kind kind = Kind::Dispatch;
+  std::string commands;
+  // The shader's source, until the computation's shaders are compiled together
+  std::string source;
+  size_t shader = 0;
+  std::vector<uint32_t> parameters;
+  size_t numWorkgroups = 0;
+  // For LoopBegin, the number of iterations
+  size_t iterations = 0;
+  // For LoopBegin and LoopEnd, the index of the other end of the loop
+  size_t match = 0;
+};
+
+// The most dispatches a computation's loops can expand to. Each is recorded, so the limit bounds
+// the memory and recording time a computation takes.
+const size_t MaxUnrolledDispatches = 1 << 16;
+
+// Expands the steps' loops into the sequence of dispatches they make. Conditional loops are
+// expanded fully; their dispatches do nothing once the loop's flag is set. Throws if that would
+// be more than MaxUnrolledDispatches dispatches.
+std::vector<GpuDispatch> unrollSteps(const std::vector<GpuComputationStep>& steps);
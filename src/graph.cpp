@@ -0,0 +1,241 @@
+#include "graph.hpp"
+#include "utils.hpp"
+
+namespace {
+
+struct OpCodeInfo {
+  OpCode op;
+  const char* name;
+  size_t arity;
+};
+
+const OpCodeInfo OpCodes[] = {
+  { OpCode::Copy, "copy", 1 },
+  { OpCode::Add, "add", 2 },
+  { OpCode::Multiply, "multiply", 2 },
+  { OpCode::Sum, "sum", 1 },
+  { OpCode::Dot, "dot", 2 },
+  { OpCode::Norm, "norm", 1 },
+  { OpCode::LoopBegin, "repeat", 0 },
+  { OpCode::LoopEnd, "end", 0 }
+};
+
+const OpCodeInfo& opCodeInfo(OpCode op) {
+  for (const OpCodeInfo& info : OpCodes) {
+    if (info.op == op) {
+      return info;
+    }
+  }
+  EXCEPTION("Unknown op code");
+}
+
+}
+
+const char* opCodeName(OpCode op) {
+  return opCodeInfo(op).name;
+}
+
+size_t opCodeArity(OpCode op) {
+  return opCodeInfo(op).arity;
+}
+
+bool parseOpCode(const std::string& name, OpCode& op) {
+  for (const OpCodeInfo& info : OpCodes) {
+    if (name == info.name) {
+      op = info.op;
+      return true;
+    }
+  }
+  return false;
+}
+
+Graph::Graph() {}
+
+Value Graph::item(const std::string& name) {
+  auto i = m_itemIndices.find(name);
+  if (i != m_itemIndices.end()) {
+    return Value{ ValueKind::Item, i->second };
+  }
+
+  uint32_t index = static_cast<uint32_t>(m_itemNames.size());
+  m_itemNames.push_back(name);
+  m_itemIndices.insert({ name, index });
+
+  return Value{ ValueKind::Item, index };
+}
+
+Value Graph::constant(netfloat_t value) {
+  uint32_t index = static_cast<uint32_t>(m_constants.size());
+  m_constants.push_back(value);
+
+  return Value{ ValueKind::Constant, index };
+}
+
+Value Graph::add(Value a, Value b) {
+  return emit(OpCode::Add, a, b);
+}
+
+Value Graph::multiply(Value a, Value b) {
+  return emit(OpCode::Multiply, a, b);
+}
+
+Value Graph::sum(Value v) {
+  return emit(OpCode::Sum, v, v);
+}
+
+Value Graph::dot(Value a, Value b) {
+  return emit(OpCode::Dot, a, b);
+}
+
+Value Graph::norm(Value v) {
+  return emit(OpCode::Norm, v, v);
+}
+
+Value Graph::apply(OpCode op, const std::vector<Value>& args) {
+  ASSERT_MSG(op != OpCode::LoopBegin && op != OpCode::LoopEnd,
+    "Use beginLoop() and endLoop() for loops");
+  ASSERT_MSG(args.size() == opCodeArity(op), "Function '" << opCodeName(op) << "' takes "
+    << opCodeArity(op) << " argument(s), got " << args.size());
+
+  return emit(op, args[0], args.back());
+}
+
+void Graph::assign(Value dst, Value src) {
+  ASSERT_MSG(dst.kind == ValueKind::Item, "Can only assign to a buffer item");
+
+  if (src.kind == ValueKind::Temporary) {
+    Temporary& temporary = m_temporaries[src.index];
+
+    if (!temporary.used && !temporary.elided && temporary.producer + 1 == m_instructions.size()) {
+      m_instructions.back().result = dst;
+      temporary.elided = true;
+      temporary.dst = dst;
+      return;
+    }
+  }
+
+  use(src);
+  push(Instruction{ OpCode::Copy, dst, { src, src } }, m_instructions.size());
+}
+
+void Graph::beginLoop(size_t maxIterations) {
+  uint32_t index = static_cast<uint32_t>(m_loops.size());
+  m_loops.push_back(Loop{ maxIterations, false, Value{ ValueKind::Constant, 0 }, 0.0 });
+  m_openLoops.push_back(index);
+
+  Instruction instruction{ OpCode::LoopBegin, Value{}, {} };
+  instruction.loop = index;
+  push(instruction, m_instructions.size());
+}
+
+void Graph::endLoop() {
+  ASSERT_MSG(!m_openLoops.empty(), "endLoop() without a matching beginLoop()");
+
+  Instruction instruction{ OpCode::LoopEnd, Value{}, {} };
+  instruction.loop = m_openLoops.back();
+  m_openLoops.pop_back();
+  push(instruction, m_instructions.size());
+}
+
+void Graph::endLoop(Value condition, netfloat_t threshold) {
+  ASSERT_MSG(!m_openLoops.empty(), "endLoop() without a matching beginLoop()");
+  ASSERT_MSG(condition.kind != ValueKind::Constant, "Loop condition must be a scalar item or "
+    "temporary");
+
+  use(condition);
+
+  Loop& loop = m_loops[m_openLoops.back()];
+  loop.conditional = true;
+  loop.condition = condition;
+  loop.threshold = threshold;
+
+  endLoop();
+}
+
+void Graph::markOutput(Value item) {
+  ASSERT_MSG(item.kind == ValueKind::Item, "Only buffer items can be outputs");
+
+  for (Value output : m_outputs) {
+    if (output.index == item.index) {
+      return;
+    }
+  }
+  m_outputs.push_back(item);
+}
+
+Value Graph::emit(OpCode op, Value a, Value b) {
+  use(a);
+  use(b);
+
+  Value result{ ValueKind::Temporary, static_cast<uint32_t>(m_temporaries.size()) };
+  m_temporaries.push_back(Temporary{ m_instructions.size(), false, false, result });
+  push(Instruction{ op, result, { a, b } }, m_instructions.size());
+
+  return result;
+}
+
+void Graph::push(const Instruction& instruction, size_t position) {
+  if (position == m_instructions.size()) {
+    m_instructions.push_back(instruction);
+    return;
+  }
+
+  for (Temporary& temporary : m_temporaries) {
+    if (temporary.producer >= position && temporary.producer < m_instructions.size()) {
+      ++temporary.producer;
+    }
+  }
+  m_instructions.insert(m_instructions.begin() + position, instruction);
+}
+
+// Marks value as used. If an earlier assign() elided the temporary, its producer is made to write
+// the temporary again, followed by a copy to the assigned item.
+void Graph::use(Value value) {
+  if (value.kind != ValueKind::Temporary) {
+    return;
+  }
+
+  ASSERT_MSG(value.index < m_temporaries.size(), "Value doesn't belong to this graph");
+  Temporary& temporary = m_temporaries[value.index];
+
+  if (temporary.elided) {
+    temporary.elided = false;
+    m_instructions[temporary.producer].result = value;
+    push(Instruction{ OpCode::Copy, temporary.dst, { value, value } }, temporary.producer + 1);
+  }
+
+  temporary.used = true;
+}
+
+std::string Graph::describe(const Instruction& instruction) const {
+  auto name = [this](Value value) -> std::string {
+    switch (value.kind) {
+      case ValueKind::Item: return m_itemNames[value.index];
+      case ValueKind::Temporary: return STR("%" << value.index);
+      case ValueKind::Constant: return STR(m_constants[value.index]);
+    }
+    return "";
+  };
+
+  std::stringstream ss;
+
+  if (instruction.op == OpCode::LoopBegin) {
+    const Loop& loop = m_loops[instruction.loop];
+    ss << "repeat " << loop.maxIterations;
+    if (loop.conditional) {
+      ss << " until " << name(loop.condition) << " < " << loop.threshold;
+    }
+    ss << " {";
+    return ss.str();
+  }
+  if (instruction.op == OpCode::LoopEnd) {
+    return "}";
+  }
+
+  ss << name(instruction.result) << " = " << opCodeName(instruction.op);
+  for (size_t i = 0; i < opCodeArity(instruction.op); ++i) {
+    ss << " " << name(instruction.args[i]);
+  }
+
+  return ss.str();
+}
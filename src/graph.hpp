@@ -0,0 +1,155 @@
+#pragma once
+
+#include "types.hpp"
+#include "exception.hpp"
+#include <string>
+#include <vector>
+#include <array>
+#include <map>
+#include <cstdint>
+
+// A typed intermediate representation of a computation. Executors compile a Graph directly; the
+// command strings of a ComputationDesc are lowered to one first.
+//
+//   Graph g;
+//   Value a = g.multiply(g.item("M"), g.item("V"));
+//   g.assign(g.item("C"), g.add(a, g.item("B")));
+//
+// Loops are delimited by LoopBegin and LoopEnd instructions, which may nest.
+
+enum class OpCode {
+  Copy,
+  Add,
+  Multiply,
+  Sum,
+  Dot,
+  Norm,
+  LoopBegin,
+  LoopEnd
+};
+
+const char* opCodeName(OpCode op);
+size_t opCodeArity(OpCode op);
+// Returns false if name isn't the name of an operation
+bool parseOpCode(const std::string& name, OpCode& op);
+
+enum class ValueKind : uint8_t {
+  Item,       // A named buffer item
+  Temporary,  // The result of an instruction, stored by the executor
+  Constant
+};
+
+struct Value {
+  ValueKind kind;
+  uint32_t index;
+};
+
+struct Instruction {
+  OpCode op;
+  Value result;
+  std::array<Value, 2> args;
+  // For LoopBegin and LoopEnd, an index into Graph::loops()
+  uint32_t loop = 0;
+};
+
+struct Loop {
+  size_t maxIterations;
+  // If set, the loop exits after any iteration at the end of which the scalar condition is less
+  // than threshold
+  bool conditional;
+  Value condition;
+  netfloat_t threshold;
+};
+
+class Graph {
+  public:
+    Graph();
+
+    Value item(const std::string& name);
+    Value constant(netfloat_t value);
+
+    Value add(Value a, Value b);
+    Value multiply(Value a, Value b);
+    Value sum(Value v);
+    Value dot(Value a, Value b);
+    Value norm(Value v);
+    Value apply(OpCode op, const std::vector<Value>& args);
+
+    // If src is the result of the most recent instruction and hasn't been used yet, that
+    // instruction writes to dst directly; otherwise a copy is emitted.
+    void assign(Value dst, Value src);
+
+    // Repeats the instructions up to the matching endLoop() maxIterations times
+    void beginLoop(size_t maxIterations);
+    void endLoop();
+    // Also exits the loop early once condition < threshold at the end of an iteration
+    void endLoop(Value condition, netfloat_t threshold);
+
+    // Executors that copy results back from a device only copy the items marked as outputs, or
+    // every item if none are
+    void markOutput(Value item);
+
+    inline const std::vector<Instruction>& instructions() const;
+    inline const Loop& loop(const Instruction& instruction) const;
+    inline size_t numItems() const;
+    inline size_t numTemporaries() const;
+    inline const std::vector<Value>& outputs() const;
+    inline const std::string& itemName(Value value) const;
+    inline netfloat_t constantValue(Value value) const;
+
+    // E.g. "C = add %0 B"
+    std::string describe(const Instruction& instruction) const;
+
+  private:
+    struct Temporary {
+      size_t producer;
+      bool used;
+      // Set if assign() made the producer write to dst instead
+      bool elided;
+      Value dst;
+    };
+
+    Value emit(OpCode op, Value a, Value b);
+    void push(const Instruction& instruction, size_t position);
+    void use(Value value);
+
+    std::vector<std::string> m_itemNames;
+    std::map<std::string, uint32_t> m_itemIndices;
+    std::vector<netfloat_t> m_constants;
+    std::vector<Temporary> m_temporaries;
+    std::vector<Instruction> m_instructions;
+    std::vector<Loop> m_loops;
+    std::vector<uint32_t> m_openLoops;
+    std::vector<Value> m_outputs;
+};
+
+const std::vector<Instruction>& Graph::instructions() const {
+  return m_instructions;
+}
+
+const Loop& Graph::loop(const Instruction& instruction) const {
+  DBG_ASSERT(instruction.op == OpCode::LoopBegin || instruction.op == OpCode::LoopEnd);
+  return m_loops[instruction.loop];
+}
+
+size_t Graph::numItems() const {
+  return m_itemNames.size();
+}
+
+size_t Graph::numTemporaries() const {
+  return m_temporaries.size();
+}
+
+const std::vector<Value>& Graph::outputs() const {
+  return m_outputs;
+}
+
+const std::string& Graph::itemName(Value value) const {
+  DBG_ASSERT(value.kind == ValueKind::Item);
+  return m_itemNames[value.index];
+}
+
+netfloat_t Graph::constantValue(Value value) const {
+  DBG_ASSERT(value.kind == ValueKind::Constant);
+  return m_constants[value.index];
+}
@@ -4,6 +4,8 @@
 #include "utils.hpp"
 #include "timer.hpp"
 #include <chrono>
+#include <cmath>
+#include <algorithm>
 
 using std::chrono::duration_cast;
 
@@ -13,12 +15,14 @@ struct InputData {
   Vector B;
 };
 
-void runBenchmark(Logger& logger, const InputData& data, bool gpu) {
+// Returns the value of C after running the computation
+Vector runBenchmark(Logger& logger, const InputData& data, bool gpu, bool autotune,
+  bool allowZeroCopy) {
   ExecutorPtr executor;
   BufferPtr buffer;
 
   if (gpu) {
-    executor = createGpuExecutor(logger);
+    executor = createGpuExecutor(logger, autotune, allowZeroCopy);
     buffer = createGpuBuffer();
   }
   else {
@@ -38,23 +42,16 @@ void runBenchmark(Logger& logger, const InputData& data, bool gpu) {
   buffer->insert("B", B);
   buffer->insert("C", C);
 
+  // The matrix doesn't change between runs, so the GPU only has to upload it once
+  buffer->setConstant("M");
+
   ComputationDesc comp1;
   comp1.steps = {
     "A = multiply M V",
     "C = add A B",
+    "repeat 13 {",
     "C = add C B",
-    "C = add C B",
-    "C = add C B",
-    "C = add C B",
-    "C = add C B",
-    "C = add C B",
-    "C = add C B",
-    "C = add C B",
-    "C = add C B",
-    "C = add C B",
-    "C = add C B",
-    "C = add C B",
-    "C = add C B"
+    "}"
   };
 
   ComputationDesc comp2;
@@ -81,10 +78,15 @@ void runBenchmark(Logger& logger, const InputData& data, bool gpu) {
   };
 
   comp1.chain(comp2);
+  comp1.outputs = { "C" };
 
+  Timer timer;
+  timer.start();
   ComputationPtr c = executor->compile(*buffer, comp1);
+  auto compileTime = timer.stop();
+
+  logger.info(STR("Compile time: " << compileTime / 1000.0 << " milliseconds"));
 
-  Timer timer;
   timer.start();
   executor->execute(*buffer, *c);
   auto elapsed = timer.stop();
@@ -92,11 +94,116 @@ void runBenchmark(Logger& logger, const InputData& data, bool gpu) {
   logger.info(STR("Running time: " << elapsed / 1000.0 << " milliseconds"));
 
   //logger.info(STR(C));
+
+  // C's data belongs to the buffer, so return a copy
+  return Vector(C);
 }
 
-int main() {
+// Streams requests through C = M V, each with its own V, and logs the sustained rate with and
+// without overlapping the transfers of one request with the dispatches of another
+void runStreamingBenchmark(Logger& logger, const InputData& data, bool allowZeroCopy) {
+  const size_t numRequests = 200;
+
+  ExecutorPtr executor = createGpuExecutor(logger, false, allowZeroCopy);
+  BufferPtr buffer = createGpuBuffer();
+
+  Matrix M = data.M;
+  Vector V = data.V;
+  Vector C(data.B.size());
+
+  buffer->insert("M", M);
+  buffer->insert("V", V);
+  buffer->insert("C", C);
+
+  buffer->setConstant("M");
+
+  ComputationDesc desc;
+  desc.steps = { "C = multiply M V" };
+  desc.outputs = { "C" };
+
+  ComputationPtr c = executor->compile(*buffer, desc);
+
+  // Returns the number of requests per second
+  auto stream = [&](bool overlap) {
+    Timer timer;
+    timer.start();
+
+    for (size_t i = 0; i < numRequests; ++i) {
+      V.fill(static_cast<netfloat_t>(i));
+      executor->submit(*buffer, *c);
+
+      // Request i's results are waited for once request i + 1 has been submitted
+      if (!overlap || i > 0) {
+        executor->wait();
+      }
+    }
+
+    if (overlap) {
+      executor->wait();
+    }
+
+    return numRequests * 1000000.0 / timer.stop();
+  };
+
+  // The first request uploads the matrix
+  executor->execute(*buffer, *c);
+
+  double serial = stream(false);
+  double overlapped = stream(true);
+
+  logger.info(STR("Streamed " << numRequests << " requests: " << serial << " requests/second "
+    << "serially, " << overlapped << " requests/second overlapped (" << overlapped / serial
+    << "x)"));
+}
+
+// Logs the largest difference between the CPU and GPU results relative to the magnitude of the
+// CPU's
+void compareResults(Logger& logger, const Vector& cpu, const Vector& gpu) {
+  const netfloat_t tolerance = 1e-4;
+
+  netfloat_t maxError = 0;
+  for (size_t i = 0; i < cpu.size(); ++i) {
+    netfloat_t error = std::fabs(gpu[i] - cpu[i]) / std::max<netfloat_t>(std::fabs(cpu[i]), 1);
+    maxError = std::max(maxError, error);
+  }
+
+  if (maxError <= tolerance) {
+    logger.info(STR("GPU results match CPU results (max relative error " << maxError << ")"));
+  }
+  else {
+    logger.error(STR("GPU results differ from CPU results (max relative error " << maxError
+      << ")"));
+  }
+}
+
+// Pass --autotune to tune the GPU kernels for this device before the first GPU run, --stream to run
+// just the streaming benchmark, or --no-zero-copy to transfer through staging buffers even where
+// the device's memory could be mapped directly
+int main(int argc, char** argv) {
   LoggerPtr logger = createStdoutLogger();
 
+  bool autotune = false;
+  bool streamOnly = false;
+  bool allowZeroCopy = true;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+
+    if (arg == "--autotune") {
+      autotune = true;
+    }
+    else if (arg == "--stream") {
+      streamOnly = true;
+    }
+    else if (arg == "--no-zero-copy") {
+      allowZeroCopy = false;
+    }
+    else {
+      logger->error(STR("Unrecognised option " << arg));
+      return 1;
+    }
+  }
+
   InputData data{
     Matrix(4096, 4096),
     Vector(4096),
@@ -109,11 +216,27 @@ int main() {
   //data.V.randomize(1.0);
   //data.B.randomize(1.0);
 
+  if (streamOnly) {
+    logger->info("Running GPU streaming benchmark...");
+    runStreamingBenchmark(*logger, data, allowZeroCopy);
+    return 0;
+  }
+
   logger->info("Running CPU benchmark...");
-  runBenchmark(*logger, data, false);
+  Vector cpuResult = runBenchmark(*logger, data, false, false, allowZeroCopy);
 
+  // Unless the cache directory is left over from a previous run, the first GPU run compiles its
+  // shaders from scratch and the second loads them from the cache
   logger->info("Running GPU benchmark...");
-  runBenchmark(*logger, data, true);
+  Vector gpuResult = runBenchmark(*logger, data, true, autotune, allowZeroCopy);
+
+  logger->info("Running GPU benchmark with warm shader cache...");
+  runBenchmark(*logger, data, true, false, allowZeroCopy);
+
+  compareResults(*logger, cpuResult, gpuResult);
+
+  logger->info("Running GPU streaming benchmark...");
+  runStreamingBenchmark(*logger, data, allowZeroCopy);
 
   return 0;
 }
@@ -1,11 +1,168 @@
 #include "math.hpp"
 #include "exception.hpp"
+#include "random.hpp"
+#include "parallel.hpp"
 #include <ostream>
 #include <cstring>
-#include <random>
+#include <cmath>
+#include <vector>
 
 namespace {
 
+const size_t NumAccumulators = 16;
+const size_t ReductionChunkSize = 1 << 14;
+
+// Sums f(i) over [begin, end) into independent accumulators, which the compiler can keep in vector
+// registers, and then combines them as a tree.
+template<class F>
+inline netfloat_t accumulate(size_t begin, size_t end, F f) {
+  netfloat_t acc[NumAccumulators] = {};
+
+  size_t i = begin;
+  for (; i + NumAccumulators <= end; i += NumAccumulators) {
+    for (size_t k = 0; k < NumAccumulators; ++k) {
+      acc[k] += f(i + k);
+    }
+  }
+  for (size_t k = 0; i < end; ++i, ++k) {
+    acc[k] += f(i);
+  }
+
+  for (size_t n = NumAccumulators / 2; n > 0; n /= 2) {
+    for (size_t k = 0; k < n; ++k) {
+      acc[k] += acc[k + n];
+    }
+  }
+
+  return acc[0];
+}
+
+netfloat_t pairwiseSum(std::vector<netfloat_t>& values) {
+  size_t n = values.size();
+  while (n > 1) {
+    size_t half = n / 2;
+    for (size_t k = 0; k < half; ++k) {
+      values[k] = values[2 * k] + values[2 * k + 1];
+    }
+    if (n % 2 == 1) {
+      values[half] = values[n - 1];
+    }
+    n = (n + 1) / 2;
+  }
+  return n == 1 ? values[0] : 0.0;
+}
+
+// Reduces fixed-size chunks of [0, size) in parallel and adds the partial results pairwise. The
+// result doesn't depend on the number of threads.
+template<class F>
+netfloat_t parallelAccumulate(size_t size, F f) {
+  size_t numChunks = (size + ReductionChunkSize - 1) / ReductionChunkSize;
+
+  if (numChunks <= 1) {
+    return accumulate(0, size, f);
+  }
+
+  std::vector<netfloat_t> partials(numChunks);
+  parallelFor(size, ReductionChunkSize, [&](size_t begin, size_t end) {
+    partials[begin / ReductionChunkSize] = accumulate(begin, end, f);
+  });
+
+  return pairwiseSum(partials);
+}
+
+const size_t TransposeTileSize = 8;
+const size_t TransposeLeafSize = 64;
+const size_t TransposeBandSize = 256;
+const size_t AxpyBandSize = 512;
+// matVecMultiply splits the rows into bands of about this many elements of the matrix
+const size_t MatVecBandSize = size_t(1) << 16;
+
+// Transposes a full tile through a local block, which the compiler keeps in vector registers and
+// shuffles. Rows are loaded whole so the loads vectorize.
+inline void transposeTile(const netfloat_t* src, size_t srcStride, netfloat_t* dst,
+  size_t dstStride) {
+
+  const size_t N = TransposeTileSize;
+  netfloat_t tile[N][N];
+
+  for (size_t r = 0; r < N; ++r) {
+    for (size_t c = 0; c < N; ++c) {
+      tile[r][c] = src[r * srcStride + c];
+    }
+  }
+  for (size_t c = 0; c < N; ++c) {
+    for (size_t r = 0; r < N; ++r) {
+      dst[c * dstStride + r] = tile[r][c];
+    }
+  }
+}
+
+// Writes the transpose of the cols x rows block at src to dst, halving the longer side until the
+// block fits in cache
+void transposeBlock(const netfloat_t* src, size_t srcStride, netfloat_t* dst, size_t dstStride,
+  size_t cols, size_t rows) {
+
+  const size_t N = TransposeTileSize;
+
+  if (cols > TransposeLeafSize || rows > TransposeLeafSize) {
+    if (cols >= rows) {
+      size_t half = (cols / 2 + N - 1) / N * N;
+      transposeBlock(src, srcStride, dst, dstStride, half, rows);
+      transposeBlock(src + half, srcStride, dst + half * dstStride, dstStride, cols - half, rows);
+    }
+    else {
+      size_t half = (rows / 2 + N - 1) / N * N;
+      transposeBlock(src, srcStride, dst, dstStride, cols, half);
+      transposeBlock(src + half * srcStride, srcStride, dst + half, dstStride, cols, rows - half);
+    }
+    return;
+  }
+
+  size_t fullCols = cols / N * N;
+  size_t fullRows = rows / N * N;
+
+  for (size_t r = 0; r < fullRows; r += N) {
+    for (size_t c = 0; c < fullCols; c += N) {
+      transposeTile(src + r * srcStride + c, srcStride, dst + c * dstStride + r, dstStride);
+    }
+  }
+  for (size_t r = 0; r < rows; ++r) {
+    for (size_t c = (r < fullRows ? fullCols : 0); c < cols; ++c) {
+      dst[c * dstStride + r] = src[r * srcStride + c];
+    }
+  }
+}
+
+// r[i] += sum over k of x[k] * M.row(k)[i] for i in [begin, end). Four rows are accumulated at a
+// time so that each element of r is loaded and stored once per four rows.
+void axpyRows(ConstMatrixView M, const netfloat_t* x, size_t xStride, netfloat_t* r, size_t begin,
+  size_t end) {
+
+  size_t k = 0;
+  for (; k + 4 <= M.rows(); k += 4) {
+    const netfloat_t* m0 = &M.at(0, k);
+    const netfloat_t* m1 = &M.at(0, k + 1);
+    const netfloat_t* m2 = &M.at(0, k + 2);
+    const netfloat_t* m3 = &M.at(0, k + 3);
+    netfloat_t x0 = x[k * xStride];
+    netfloat_t x1 = x[(k + 1) * xStride];
+    netfloat_t x2 = x[(k + 2) * xStride];
+    netfloat_t x3 = x[(k + 3) * xStride];
+
+    for (size_t i = begin; i < end; ++i) {
+      r[i] += x0 * m0[i] + x1 * m1[i] + x2 * m2[i] + x3 * m3[i];
+    }
+  }
+  for (; k < M.rows(); ++k) {
+    const netfloat_t* m = &M.at(0, k);
+    netfloat_t xk = x[k * xStride];
+
+    for (size_t i = begin; i < end; ++i) {
+      r[i] += xk * m[i];
+    }
+  }
+}
+
 bool arraysEqual(const netfloat_t* A, const netfloat_t* B, size_t size) {
   for (size_t i = 0; i < size; ++i) {
     if (A[i] != B[i]) {
@@ -119,6 +276,61 @@ std::ostream& operator<<(std::ostream& os, const DataArray& v) {
   return os;
 }
 
+Scalar::Scalar(netfloat_t value)
+  : m_storage(1)
+  , m_data(m_storage.data()) {
+
+  *m_data = value;
+}
+
+Scalar::Scalar(const Scalar& cpy)
+  : m_storage(1)
+  , m_data(m_storage.data()) {
+
+  *m_data = *cpy.m_data;
+}
+
+Scalar::Scalar(netfloat_t* data, bool copyData) {
+  if (copyData) {
+    m_storage = DataArray(1);
+    m_data = m_storage.data();
+    *m_data = *data;
+  }
+  else {
+    m_data = data;
+  }
+}
+
+void Scalar::setDataPtr(netfloat_t* data) {
+  m_storage = DataArray();
+  m_data = data;
+}
+
+Scalar& Scalar::operator=(const Scalar& rhs) {
+  *m_data = *rhs.m_data;
+  return *this;
+}
+
+Scalar& Scalar::operator=(netfloat_t value) {
+  *m_data = value;
+  return *this;
+}
+
+ScalarPtr Scalar::createShallow(DataArray& data) {
+  DBG_ASSERT(data.size() == 1);
+  return ScalarPtr(new Scalar(data.data(), false));
+}
+
+ConstScalarPtr Scalar::createShallow(const DataArray& data) {
+  DBG_ASSERT(data.size() == 1);
+  return ConstScalarPtr(new Scalar(const_cast<netfloat_t*>(data.data()), false));
+}
+
+std::ostream& operator<<(std::ostream& os, const Scalar& s) {
+  os << s.value();
+  return os;
+}
+
 Vector::Vector(std::initializer_list<netfloat_t> data)
   : m_storage(data.size())
   , m_data(m_storage.data())
@@ -166,21 +378,14 @@ Vector::Vector(const Vector& cpy)
   memcpy(m_data, cpy.m_data, m_size * sizeof(netfloat_t));
 }
 
-Vector::Vector(Vector&& mv) {
-  m_size = mv.m_size;
+// A shallow vector's pointer is transferred, so the new vector is shallow too
+Vector::Vector(Vector&& mv)
+  : m_storage(std::move(mv.m_storage))
+  , m_data(mv.m_data)
+  , m_size(mv.m_size) {
 
-  if (mv.isShallow()) {
-    m_storage = DataArray(m_size);
-    m_data = m_storage.data();
-    memcpy(m_data, mv.m_data, m_size * sizeof(netfloat_t));
-  }
-  else {
-    m_storage = std::move(mv.m_storage);
-    m_data = m_storage.data();
-    
-    mv.m_data = nullptr;
-    mv.m_size = 0;
-  }
+  mv.m_data = nullptr;
+  mv.m_size = 0;
 }
 
 Vector& Vector::operator=(const Vector& rhs) {
@@ -231,12 +436,7 @@ netfloat_t Vector::magnitude() const {
 }
 
 netfloat_t Vector::squareMagnitude() const {
-  netfloat_t sqSum = 0.0;
-  for (size_t i = 0; i < m_size; ++i) {
-    netfloat_t x = m_data[i];
-    sqSum += x * x;
-  }
-  return sqSum;
+  return ::squareMagnitude(view());
 }
 
 void Vector::zero() {
@@ -250,13 +450,11 @@ void Vector::fill(netfloat_t x) {
 }
 
 Vector& Vector::randomize(netfloat_t standardDeviation) {
-  static std::mt19937 gen(0);
-  std::normal_distribution<netfloat_t> dist(0.0, standardDeviation);
+  return randomize(standardDeviation, nextRandomSeed());
+}
 
-  for (size_t i = 0; i < m_size; ++i) {
-    m_data[i] = dist(gen);
-  }
-  
+Vector& Vector::randomize(netfloat_t standardDeviation, uint64_t seed) {
+  randomFillNormal(m_data, m_size, standardDeviation, seed);
   return *this;
 }
 
@@ -268,85 +466,7 @@ void Vector::normalize() {
 }
 
 netfloat_t Vector::dot(const Vector& rhs) const {
-  DBG_ASSERT(rhs.m_size == m_size);
-
-  netfloat_t x = 0.0;
-  for (size_t i = 0; i < m_size; ++i) {
-    x += m_data[i] * rhs[i];
-  }
-  return x;
-}
-
-Vector Vector::hadamard(const Vector& rhs) const {
-  DBG_ASSERT(rhs.m_size == m_size);
-
-  Vector v(m_size);
-  for (size_t i = 0; i < m_size; ++i) {
-    v[i] = m_data[i] * rhs[i];
-  }
-  return v;
-}
-
-Vector Vector::operator+(const Vector& rhs) const {
-  DBG_ASSERT(rhs.m_size == m_size);
-
-  Vector v(m_size);
-  for (size_t i = 0; i < m_size; ++i) {
-    v[i] = m_data[i] + rhs[i];
-  }
-  return v;
-}
-
-Vector Vector::operator-(const Vector& rhs) const {
-  DBG_ASSERT(rhs.m_size == m_size);
-
-  Vector v(m_size);
-  for (size_t i = 0; i < m_size; ++i) {
-    v[i] = m_data[i] - rhs[i];
-  }
-  return v;
-}
-
-Vector Vector::operator/(const Vector& rhs) const {
-  DBG_ASSERT(rhs.m_size == m_size);
-
-  Vector v(m_size);
-  for (size_t i = 0; i < m_size; ++i) {
-    v[i] = m_data[i] / rhs[i];
-  }
-  return v;
-}
-
-Vector Vector::operator*(netfloat_t s) const {
-  Vector v(m_size);
-  for (size_t i = 0; i < m_size; ++i) {
-    v[i] = m_data[i] * s;
-  }
-  return v;
-}
-
-Vector Vector::operator/(netfloat_t s) const {
-  Vector v(m_size);
-  for (size_t i = 0; i < m_size; ++i) {
-    v[i] = m_data[i] / s;
-  }
-  return v;
-}
-
-Vector Vector::operator+(netfloat_t s) const {
-  Vector v(m_size);
-  for (size_t i = 0; i < m_size; ++i) {
-    v[i] = m_data[i] + s;
-  }
-  return v;
-}
-
-Vector Vector::operator-(netfloat_t s) const {
-  Vector v(m_size);
-  for (size_t i = 0; i < m_size; ++i) {
-    v[i] = m_data[i] - s;
-  }
-  return v;
+  return ::dot(view(), rhs.view());
 }
 
 Vector& Vector::operator+=(const Vector& rhs) {
@@ -392,13 +512,7 @@ Vector& Vector::operator/=(netfloat_t x) {
 }
 
 netfloat_t Vector::sum() const {
-  netfloat_t s = 0.0;
-
-  for (size_t i = 0; i < m_size; ++i) {
-    s += m_data[i];
-  }
-
-  return s;
+  return ::sum(view());
 }
 
 Vector Vector::computeTransform(const std::function<netfloat_t(netfloat_t)>& f) const {
@@ -499,23 +613,16 @@ Matrix::Matrix(const Matrix& cpy)
   memcpy(m_data, cpy.m_data, m_cols * m_rows * sizeof(netfloat_t));
 }
 
-Matrix::Matrix(Matrix&& mv) {
-  m_cols = mv.m_cols;
-  m_rows = mv.m_rows;
+// A shallow matrix's pointer is transferred, so the new matrix is shallow too
+Matrix::Matrix(Matrix&& mv)
+  : m_storage(std::move(mv.m_storage))
+  , m_data(mv.m_data)
+  , m_rows(mv.m_rows)
+  , m_cols(mv.m_cols) {
 
-  if (mv.isShallow()) {
-    m_storage = DataArray(m_cols * m_rows);
-    m_data = m_storage.data();
-    memcpy(m_data, mv.m_data, m_cols * m_rows * sizeof(netfloat_t));
-  }
-  else {
-    m_storage = std::move(mv.m_storage);
-    m_data = m_storage.data();
-    
-    mv.m_data = nullptr;
-    mv.m_cols = 0;
-    mv.m_rows = 0;
-  }
+  mv.m_data = nullptr;
+  mv.m_cols = 0;
+  mv.m_rows = 0;
 }
 
 Matrix& Matrix::operator=(const Matrix& rhs) {
@@ -557,45 +664,11 @@ void Matrix::setDataPtr(netfloat_t* data) {
 }
 
 Vector Matrix::operator*(const Vector& rhs) const {
-  DBG_ASSERT(rhs.size() == m_cols);
-
   Vector v(m_rows);
-  for (size_t r = 0; r < m_rows; ++r) {
-    netfloat_t sum = 0.0;
-    for (size_t c = 0; c < m_cols; ++c) {
-      sum += at(c, r) * rhs[c];
-    }
-    v[r] = sum;
-  }
+  matVecMultiply(view(), rhs.view(), v.view());
   return v;
 }
 
-Matrix Matrix::operator+(const Matrix& rhs) const {
-  DBG_ASSERT(rhs.m_cols == m_cols);
-  DBG_ASSERT(rhs.m_rows == m_rows);
-
-  Matrix m(m_cols, m_rows);
-
-  for (size_t i = 0; i < size(); ++i) {
-    m.m_data[i] = m_data[i] + rhs.m_data[i];
-  }
-
-  return m;
-}
-
-Matrix Matrix::operator-(const Matrix& rhs) const {
-  DBG_ASSERT(rhs.m_cols == m_cols);
-  DBG_ASSERT(rhs.m_rows == m_rows);
-
-  Matrix m(m_cols, m_rows);
-
-  for (size_t i = 0; i < size(); ++i) {
-    m.m_data[i] = m_data[i] - rhs.m_data[i];
-  }
-
-  return m;
-}
-
 Matrix& Matrix::operator+=(netfloat_t x) {
   for (size_t i = 0; i < size(); ++i) {
     m_data[i] += x;
@@ -639,16 +712,8 @@ Matrix& Matrix::operator-=(const Matrix& rhs) {
 }
 
 Vector Matrix::transposeMultiply(const Vector& rhs) const {
-  DBG_ASSERT(rhs.size() == m_rows);
-
   Vector v(m_cols);
-  for (size_t c = 0; c < m_cols; ++c) {
-    netfloat_t sum = 0.0;
-    for (size_t r = 0; r < m_rows; ++r) {
-      sum += at(c, r) * rhs[r];
-    }
-    v[c] = sum;
-  }
+  transposeMatVecMultiply(view(), rhs.view(), v.view());
   return v;
 }
 
@@ -663,33 +728,21 @@ void Matrix::fill(netfloat_t x) {
 }
 
 Matrix& Matrix::randomize(netfloat_t standardDeviation) {
-  static std::mt19937 gen(0);
-  std::normal_distribution<netfloat_t> dist(0.0, standardDeviation);
+  return randomize(standardDeviation, nextRandomSeed());
+}
 
-  for (size_t i = 0; i < size(); ++i) {
-    m_data[i] = dist(gen);
-  }
-  
+Matrix& Matrix::randomize(netfloat_t standardDeviation, uint64_t seed) {
+  randomFillNormal(m_data, size(), standardDeviation, seed);
   return *this;
 }
 
 netfloat_t Matrix::sum() const {
-  netfloat_t s = 0.0;
-
-  for (size_t i = 0; i < size(); ++i) {
-    s += m_data[i];
-  }
-
-  return s;
+  return ::sum(view());
 }
 
 Matrix Matrix::transpose() const {
   Matrix m(m_rows, m_cols);
-  for (size_t c = 0; c < m_cols; ++c) {
-    for (size_t r = 0; r < m_rows; ++r) {
-      m.set(r, c, at(c, r));
-    }
-  }
+  ::transpose(view(), m.view());
   return m;
 }
 
@@ -803,25 +856,18 @@ Kernel::Kernel(const Kernel& cpy)
   memcpy(m_data, cpy.m_data, m_W * m_H * m_D * sizeof(netfloat_t));
 }
 
-Kernel::Kernel(Kernel&& mv) {
-  m_W = mv.m_W;
-  m_H = mv.m_H;
-  m_D = mv.m_D;
+// A shallow kernel's pointer is transferred, so the new kernel is shallow too
+Kernel::Kernel(Kernel&& mv)
+  : m_storage(std::move(mv.m_storage))
+  , m_data(mv.m_data)
+  , m_D(mv.m_D)
+  , m_H(mv.m_H)
+  , m_W(mv.m_W) {
 
-  if (mv.isShallow()) {
-    m_storage = DataArray(m_W * m_H * m_D);
-    m_data = m_storage.data();
-    memcpy(m_data, mv.m_data, m_W * m_H * m_D * sizeof(netfloat_t));
-  }
-  else {
-    m_storage = std::move(mv.m_storage);
-    m_data = m_storage.data();
-    
-    mv.m_data = nullptr;
-    mv.m_W = 0;
-    mv.m_H = 0;
-    mv.m_D = 0;
-  }
+  mv.m_data = nullptr;
+  mv.m_W = 0;
+  mv.m_H = 0;
+  mv.m_D = 0;
 }
 
 void Kernel::setDataPtr(netfloat_t* data) {
@@ -830,29 +876,7 @@ void Kernel::setDataPtr(netfloat_t* data) {
 }
 
 void Kernel::convolve(const Array3& image, Array2& featureMap) const {
-  DBG_ASSERT(image.W() >= m_W);
-  DBG_ASSERT(image.H() >= m_H);
-  DBG_ASSERT(image.D() == m_D);
-
-  size_t fmW = image.W() - m_W + 1;
-  size_t fmH = image.H() - m_H + 1;
-
-  DBG_ASSERT(featureMap.W() == fmW);
-  DBG_ASSERT(featureMap.H() == fmH);
-
-  for (size_t fmY = 0; fmY < fmH; ++fmY) {
-    for (size_t fmX = 0; fmX < fmW; ++fmX) {
-      netfloat_t sum = 0.0;
-      for (size_t k = 0; k < m_D; ++k) {
-        for (size_t j = 0; j < m_H; ++j) {
-          for (size_t i = 0; i < m_W; ++i) {
-            sum += image.at(fmX + i, fmY + j, k) * at(i, j, k);
-          }
-        }
-      }
-      featureMap.set(fmX, fmY, sum);
-    }
-  }
+  ::convolve(view(), image.view(), featureMap.view());
 }
 
 bool Kernel::operator==(const Kernel& rhs) const {
@@ -910,62 +934,12 @@ void Kernel::fill(netfloat_t x) {
 }
 
 Kernel& Kernel::randomize(netfloat_t standardDeviation) {
-  static std::mt19937 gen(0);
-  std::normal_distribution<netfloat_t> dist(0.0, standardDeviation);
-
-  for (size_t i = 0; i < size(); ++i) {
-    m_data[i] = dist(gen);
-  }
-
-  return *this;
-}
-
-Kernel Kernel::operator+(const Kernel& rhs) const {
-  Kernel K(m_W, m_H, m_D);
-  for (size_t i = 0; i < size(); ++i) {
-    K.m_data[i] = m_data[i] + rhs.m_data[i];
-  }
-  return K;
+  return randomize(standardDeviation, nextRandomSeed());
 }
 
-Kernel Kernel::operator-(const Kernel& rhs) const {
-  Kernel K(m_W, m_H, m_D);
-  for (size_t i = 0; i < size(); ++i) {
-    K.m_data[i] = m_data[i] - rhs.m_data[i];
-  }
-  return K;
-}
-
-Kernel Kernel::operator+(netfloat_t x) const {
-  Kernel K(m_W, m_H, m_D);
-  for (size_t i = 0; i < size(); ++i) {
-    K.m_data[i] = m_data[i] + x;
-  }
-  return K;
-}
-
-Kernel Kernel::operator-(netfloat_t x) const {
-  Kernel K(m_W, m_H, m_D);
-  for (size_t i = 0; i < size(); ++i) {
-    K.m_data[i] = m_data[i] - x;
-  }
-  return K;
-}
-
-Kernel Kernel::operator*(netfloat_t x) const {
-  Kernel K(m_W, m_H, m_D);
-  for (size_t i = 0; i < size(); ++i) {
-    K.m_data[i] = m_data[i] * x;
-  }
-  return K;
-}
-
-Kernel Kernel::operator/(netfloat_t x) const {
-  Kernel K(m_W, m_H, m_D);
-  for (size_t i = 0; i < size(); ++i) {
-    K.m_data[i] = m_data[i] / x;
-  }
-  return K;
+Kernel& Kernel::randomize(netfloat_t standardDeviation, uint64_t seed) {
+  randomFillNormal(m_data, size(), standardDeviation, seed);
+  return *this;
 }
 
 Kernel& Kernel::operator+=(netfloat_t x) {
@@ -1057,3 +1031,112 @@ std::ostream& operator<<(std::ostream& os, const Kernel& k) {
   return os;
 }
 
+netfloat_t sum(ConstVectorView V) {
+  if (V.isContiguous()) {
+    const netfloat_t* x = V.data();
+    return parallelAccumulate(V.size(), [x](size_t i) { return x[i]; });
+  }
+
+  return parallelAccumulate(V.size(), [V](size_t i) { return V[i]; });
+}
+
+netfloat_t sum(ConstMatrixView M) {
+  if (M.isContiguous()) {
+    return sum(ConstVectorView(M.data(), M.size()));
+  }
+
+  return parallelAccumulate(M.rows(), [M](size_t r) { return sum(M.row(r)); });
+}
+
+netfloat_t dot(ConstVectorView A, ConstVectorView B) {
+  DBG_ASSERT(A.size() == B.size());
+
+  if (A.isContiguous() && B.isContiguous()) {
+    const netfloat_t* a = A.data();
+    const netfloat_t* b = B.data();
+    return parallelAccumulate(A.size(), [a, b](size_t i) { return a[i] * b[i]; });
+  }
+
+  return parallelAccumulate(A.size(), [A, B](size_t i) { return A[i] * B[i]; });
+}
+
+netfloat_t squareMagnitude(ConstVectorView V) {
+  if (V.isContiguous()) {
+    const netfloat_t* x = V.data();
+    return parallelAccumulate(V.size(), [x](size_t i) { return x[i] * x[i]; });
+  }
+
+  return parallelAccumulate(V.size(), [V](size_t i) { return V[i] * V[i]; });
+}
+
+void matVecMultiply(ConstMatrixView M, ConstVectorView V, VectorView R) {
+  DBG_ASSERT(V.size() == M.cols());
+  DBG_ASSERT(R.size() == M.rows());
+
+  // Threads own bands of rows. The dot products inside them run serially, but over the same chunks
+  // as when called alone, so the results don't depend on the number of threads.
+  size_t bandRows = std::max<size_t>(1, MatVecBandSize / std::max<size_t>(1, M.cols()));
+
+  parallelFor(M.rows(), bandRows, [&](size_t begin, size_t end) {
+    for (size_t r = begin; r < end; ++r) {
+      R[r] = dot(M.row(r), V);
+    }
+  });
+}
+
+void transposeMatVecMultiply(ConstMatrixView M, ConstVectorView V, VectorView R) {
+  DBG_ASSERT(V.size() == M.rows());
+  DBG_ASSERT(R.size() == M.cols());
+
+  if (!R.isContiguous()) {
+    Vector tmp(R.size());
+    transposeMatVecMultiply(M, V, tmp.view());
+    R.assign(tmp);
+    return;
+  }
+
+  // Accumulate V[k] * M.row(k) into R so that M is read row by row. Threads own disjoint bands of
+  // R, so the order of additions is the same as when run serially.
+  netfloat_t* r = R.data();
+  memset(r, 0, R.size() * sizeof(netfloat_t));
+
+  parallelFor(M.cols(), AxpyBandSize, [&](size_t begin, size_t end) {
+    axpyRows(M, V.data(), V.stride(), r, begin, end);
+  });
+}
+
+void transpose(ConstMatrixView M, MatrixView R) {
+  DBG_ASSERT(R.cols() == M.rows());
+  DBG_ASSERT(R.rows() == M.cols());
+
+  parallelFor(M.rows(), TransposeBandSize, [&](size_t begin, size_t end) {
+    transposeBlock(&M.at(0, begin), M.rowStride(), &R.at(begin, 0), R.rowStride(), M.cols(),
+      end - begin);
+  });
+}
+
+void convolve(ConstKernelView K, ConstKernelView image, MatrixView featureMap) {
+  DBG_ASSERT(image.W() >= K.W());
+  DBG_ASSERT(image.H() >= K.H());
+  DBG_ASSERT(image.D() == K.D());
+
+  size_t fmW = image.W() - K.W() + 1;
+  size_t fmH = image.H() - K.H() + 1;
+
+  DBG_ASSERT(featureMap.W() == fmW);
+  DBG_ASSERT(featureMap.H() == fmH);
+
+  for (size_t fmY = 0; fmY < fmH; ++fmY) {
+    for (size_t fmX = 0; fmX < fmW; ++fmX) {
+      netfloat_t sum = 0.0;
+      for (size_t k = 0; k < K.D(); ++k) {
+        for (size_t j = 0; j < K.H(); ++j) {
+          for (size_t i = 0; i < K.W(); ++i) {
+            sum += image.at(fmX + i, fmY + j, k) * K.at(i, j, k);
+          }
+        }
+      }
+      featureMap.at(fmX, fmY) = sum;
+    }
+  }
+}
@@ -2,7 +2,10 @@
 
 #include "exception.hpp"
 #include "types.hpp"
+#include "math_expr.hpp"
+#include "math_view.hpp"
 #include <memory>
+#include <cstdint>
 #include <initializer_list>
 #include <stdexcept>
 #include <functional>
@@ -10,7 +13,8 @@
 enum class MathObjectType {
   Array,
   Array2,
-  Array3
+  Array3,
+  Scalar
 };
 
 class DataArray {
@@ -60,6 +64,77 @@ const netfloat_t& DataArray::operator[](size_t i) const {
   return m_data.get()[i];
 }
 
+class Scalar;
+using ScalarPtr = std::unique_ptr<Scalar>;
+using ConstScalarPtr = std::unique_ptr<const Scalar>;
+
+// A single value, e.g. the result of a reduction command
+class Scalar {
+  public:
+    explicit Scalar(netfloat_t value = 0.0);
+    Scalar(const Scalar& cpy);
+    Scalar(netfloat_t* data, bool copyData);
+
+    inline MathObjectType type() const;
+    inline Triple shape() const;
+
+    inline bool isShallow() const;
+    inline const DataArray& storage() const;
+    inline DataArray& storage();
+
+    inline netfloat_t* data();
+    inline const netfloat_t* data() const;
+
+    inline netfloat_t value() const;
+
+    // This will free the old data and the object will now be shallow
+    void setDataPtr(netfloat_t* data);
+
+    Scalar& operator=(const Scalar& rhs);
+    Scalar& operator=(netfloat_t value);
+
+    static ScalarPtr createShallow(DataArray& data);
+    static ConstScalarPtr createShallow(const DataArray& data);
+
+    friend std::ostream& operator<<(std::ostream& os, const Scalar& s);
+
+  private:
+    DataArray m_storage;
+    netfloat_t* m_data;
+};
+
+MathObjectType Scalar::type() const {
+  return MathObjectType::Scalar;
+}
+
+Triple Scalar::shape() const {
+  return { 1, 1, 1 };
+}
+
+bool Scalar::isShallow() const {
+  return m_storage.size() == 0;
+}
+
+const DataArray& Scalar::storage() const {
+  return m_storage;
+}
+
+DataArray& Scalar::storage() {
+  return m_storage;
+}
+
+netfloat_t* Scalar::data() {
+  return m_data;
+}
+
+const netfloat_t* Scalar::data() const {
+  return m_data;
+}
+
+netfloat_t Scalar::value() const {
+  return *m_data;
+}
+
 class Vector;
 using VectorPtr = std::unique_ptr<Vector>;
 using ConstVectorPtr = std::unique_ptr<const Vector>;
@@ -67,8 +142,10 @@ using Array = Vector;
 using ArrayPtr = VectorPtr;
 using ConstArrayPtr = ConstVectorPtr;
 
-class Vector {
+class Vector : public MathExpr<Vector> {
   public:
+    using result_t = Vector;
+
     explicit Vector(std::initializer_list<netfloat_t> data);
     explicit Vector(size_t length);
     Vector(const DataArray& data);
@@ -76,6 +153,8 @@ class Vector {
     Vector(const Vector& cpy);
     Vector(Vector&& mv);
     Vector(netfloat_t* data, size_t size, bool copyData);
+    template<class E, class = EnableIfResult<E, Vector>>
+    Vector(const MathExpr<E>& expr);
 
     inline MathObjectType type() const;
     inline Triple shape() const;
@@ -87,12 +166,19 @@ class Vector {
     inline netfloat_t* data();
     inline const netfloat_t* data() const;
 
+    inline VectorView view();
+    inline ConstVectorView view() const;
+    inline VectorView view(size_t from, size_t size);
+    inline ConstVectorView view(size_t from, size_t size) const;
+
     // This will free the old data and the object will now be shallow. Tbe new data array must have
     // the same size as the old one.
     void setDataPtr(netfloat_t* data);
 
     Vector& operator=(const Vector& rhs);
     Vector& operator=(Vector&& rhs);
+    template<class E, class = EnableIfResult<E, Vector>>
+    Vector& operator=(const MathExpr<E>& rhs);
 
     inline netfloat_t& operator[](size_t i);
     inline const netfloat_t& operator[](size_t i) const;
@@ -104,7 +190,9 @@ class Vector {
 
     void zero();
     void normalize();
+    // Without a seed, the next seed from nextRandomSeed() is used
     Vector& randomize(netfloat_t standardDeviation);
+    Vector& randomize(netfloat_t standardDeviation, uint64_t seed);
     void fill(netfloat_t x);
 
     netfloat_t sum() const;
@@ -112,27 +200,31 @@ class Vector {
     netfloat_t squareMagnitude() const;
     netfloat_t dot(const Vector& rhs) const;
 
-    Vector operator+(const Vector& rhs) const;
-    Vector operator-(const Vector& rhs) const;
-    Vector hadamard(const Vector& rhs) const;
-    Vector operator/(const Vector& rhs) const;
-
-    Vector operator+(netfloat_t x) const;
-    Vector operator-(netfloat_t x) const;
-    Vector operator*(netfloat_t x) const;
-    Vector operator/(netfloat_t x) const;
+    // Arithmetic operators (+, -, / and scalar +, -, *, /) are lazy; see math_expr.hpp. Use the
+    // free function hadamard() for a lazy element-wise product.
+    inline Vector hadamard(const Vector& rhs) const;
 
     Vector& operator+=(const Vector& rhs);
     Vector& operator-=(const Vector& rhs);
+    template<class E, class = EnableIfResult<E, Vector>>
+    Vector& operator+=(const MathExpr<E>& rhs);
+    template<class E, class = EnableIfResult<E, Vector>>
+    Vector& operator-=(const MathExpr<E>& rhs);
 
     Vector& operator+=(netfloat_t x);
     Vector& operator-=(netfloat_t x);
     Vector& operator*=(netfloat_t x);
     Vector& operator/=(netfloat_t x);
 
+    // Prefer the templated overloads, which can inline f
     Vector computeTransform(const std::function<netfloat_t(netfloat_t)>& f) const;
     void transformInPlace(const std::function<netfloat_t(netfloat_t)>& f);
+    template<class F>
+    Vector computeTransform(F f) const;
+    template<class F>
+    void transformInPlace(F f);
 
+    // Prefer view(from, size), which doesn't allocate
     inline VectorPtr subvector(size_t from, size_t size, bool copyData);
     inline ConstVectorPtr subvector(size_t from, size_t size, bool copyData) const;
 
@@ -175,6 +267,24 @@ const netfloat_t* Vector::data() const {
   return m_data;
 }
 
+VectorView Vector::view() {
+  return VectorView(m_data, m_size);
+}
+
+ConstVectorView Vector::view() const {
+  return ConstVectorView(m_data, m_size);
+}
+
+VectorView Vector::view(size_t from, size_t size) {
+  DBG_ASSERT(from + size <= m_size);
+  return VectorView(m_data + from, size);
+}
+
+ConstVectorView Vector::view(size_t from, size_t size) const {
+  DBG_ASSERT(from + size <= m_size);
+  return ConstVectorView(m_data + from, size);
+}
+
 netfloat_t& Vector::operator[](size_t i) {
   return m_data[i];
 }
@@ -191,6 +301,58 @@ bool Vector::operator!=(const Vector& rhs) const {
   return !(*this == rhs);
 }
 
+template<class E, class>
+Vector::Vector(const MathExpr<E>& expr)
+  : m_storage(expr.derived().size())
+  , m_data(m_storage.data())
+  , m_size(m_storage.size()) {
+
+  evaluate(expr, m_data);
+}
+
+template<class E, class>
+Vector& Vector::operator=(const MathExpr<E>& rhs) {
+  size_t size = rhs.derived().size();
+
+  if (isShallow()) {
+    DBG_ASSERT(size == m_size);
+  }
+  else if (size != m_size) {
+    m_size = size;
+    m_storage = DataArray(m_size);
+    m_data = m_storage.data();
+  }
+
+  evaluate(rhs, m_data);
+
+  return *this;
+}
+
+Vector Vector::hadamard(const Vector& rhs) const {
+  return ::hadamard(*this, rhs);
+}
+
+// rhs is only needed for this statement, so it's held by reference rather than copied
+template<class E, class>
+Vector& Vector::operator+=(const MathExpr<E>& rhs) {
+  return *this = BinaryExpr<const Vector&, const E&, AddOp>(*this, rhs.derived());
+}
+
+template<class E, class>
+Vector& Vector::operator-=(const MathExpr<E>& rhs) {
+  return *this = BinaryExpr<const Vector&, const E&, SubtractOp>(*this, rhs.derived());
+}
+
+template<class F>
+Vector Vector::computeTransform(F f) const {
+  return transform(*this, f);
+}
+
+template<class F>
+void Vector::transformInPlace(F f) {
+  *this = transform(*this, f);
+}
+
 VectorPtr Vector::subvector(size_t from, size_t size, bool copyData) {
   return VectorPtr(new Vector(m_data + from, size, copyData));
 }
@@ -206,8 +368,10 @@ using Array2 = Matrix;
 using Array2Ptr = MatrixPtr;
 using ConstArray2Ptr = ConstMatrixPtr;
 
-class Matrix {
+class Matrix : public MathExpr<Matrix> {
   public:
+    using result_t = Matrix;
+
     explicit Matrix(std::initializer_list<std::initializer_list<netfloat_t>> data);
     explicit Matrix(size_t cols, size_t rows);
     Matrix(const DataArray& data, size_t cols, size_t rows);
@@ -215,6 +379,8 @@ class Matrix {
     Matrix(const Matrix& cpy);
     Matrix(Matrix&& mv);
     Matrix(netfloat_t* data, size_t cols, size_t rows, bool copyData);
+    template<class E, class = EnableIfResult<E, Matrix>>
+    Matrix(const MathExpr<E>& expr);
 
     inline MathObjectType type() const;
     inline Triple shape() const;
@@ -226,6 +392,9 @@ class Matrix {
     inline netfloat_t* data();
     inline const netfloat_t* data() const;
 
+    inline MatrixView view();
+    inline ConstMatrixView view() const;
+
     // This will free the old data and the object will now be shallow. Tbe new data array must have
     // the same size as the old one.
     void setDataPtr(netfloat_t* data);
@@ -235,6 +404,10 @@ class Matrix {
     inline netfloat_t at(size_t col, size_t row) const;
     inline void set(size_t col, size_t row, netfloat_t value);
 
+    // Element access by row-major index
+    inline netfloat_t& operator[](size_t i);
+    inline const netfloat_t& operator[](size_t i) const;
+
     inline size_t cols() const;
     inline size_t rows() const;
     inline size_t W() const;
@@ -242,16 +415,12 @@ class Matrix {
 
     Matrix& operator=(const Matrix& rhs);
     Matrix& operator=(Matrix&& rhs);
+    template<class E, class = EnableIfResult<E, Matrix>>
+    Matrix& operator=(const MathExpr<E>& rhs);
 
     Vector operator*(const Vector& rhs) const;
 
-    Matrix operator+(const Matrix& rhs) const;
-    Matrix operator-(const Matrix& rhs) const;
-
-    Matrix operator+(netfloat_t x) const;
-    Matrix operator-(netfloat_t x) const;
-    Matrix operator*(netfloat_t x) const;
-    Matrix operator/(netfloat_t x) const;
+    // Element-wise arithmetic operators are lazy; see math_expr.hpp
 
     Matrix& operator+=(netfloat_t x);
     Matrix& operator-=(netfloat_t x);
@@ -265,14 +434,22 @@ class Matrix {
 
     void zero();
     void fill(netfloat_t x);
+    // Without a seed, the next seed from nextRandomSeed() is used
     Matrix& randomize(netfloat_t standardDeviation);
+    Matrix& randomize(netfloat_t standardDeviation, uint64_t seed);
 
     netfloat_t sum() const;
     Matrix transpose() const;
 
+    // Prefer the templated overloads, which can inline f
     Matrix computeTransform(const std::function<netfloat_t(netfloat_t)>& f) const;
     void transformInPlace(const std::function<netfloat_t(netfloat_t)>& f);
+    template<class F>
+    Matrix computeTransform(F f) const;
+    template<class F>
+    void transformInPlace(F f);
 
+    // Prefer view().row(row), which doesn't allocate
     inline VectorPtr slice(size_t row, bool copyData);
     inline ConstVectorPtr slice(size_t row, bool copyData) const;
 
@@ -319,6 +496,14 @@ const netfloat_t* Matrix::data() const {
   return m_data;
 }
 
+MatrixView Matrix::view() {
+  return MatrixView(m_data, m_cols, m_rows);
+}
+
+ConstMatrixView Matrix::view() const {
+  return ConstMatrixView(m_data, m_cols, m_rows);
+}
+
 size_t Matrix::size() const {
   return m_cols * m_rows;
 }
@@ -331,6 +516,14 @@ void Matrix::set(size_t col, size_t row, netfloat_t value) {
   m_data[row * m_cols + col] = value;
 }
 
+netfloat_t& Matrix::operator[](size_t i) {
+  return m_data[i];
+}
+
+const netfloat_t& Matrix::operator[](size_t i) const {
+  return m_data[i];
+}
+
 size_t Matrix::cols() const {
   return m_cols;
 }
@@ -359,6 +552,46 @@ bool Matrix::operator!=(const Matrix& rhs) const {
   return !(*this == rhs);
 }
 
+template<class E, class>
+Matrix::Matrix(const MathExpr<E>& expr)
+  : m_storage(expr.derived().size())
+  , m_data(m_storage.data())
+  , m_rows(expr.derived().shape()[1])
+  , m_cols(expr.derived().shape()[0]) {
+
+  evaluate(expr, m_data);
+}
+
+template<class E, class>
+Matrix& Matrix::operator=(const MathExpr<E>& rhs) {
+  Triple shape = rhs.derived().shape();
+
+  if (isShallow()) {
+    DBG_ASSERT(shape[0] == m_cols && shape[1] == m_rows);
+  }
+  else if (shape[0] * shape[1] != size()) {
+    m_storage = DataArray(shape[0] * shape[1]);
+    m_data = m_storage.data();
+  }
+
+  m_cols = shape[0];
+  m_rows = shape[1];
+
+  evaluate(rhs, m_data);
+
+  return *this;
+}
+
+template<class F>
+Matrix Matrix::computeTransform(F f) const {
+  return transform(*this, f);
+}
+
+template<class F>
+void Matrix::transformInPlace(F f) {
+  *this = transform(*this, f);
+}
+
 class Kernel;
 using KernelPtr = std::unique_ptr<Kernel>;
 using ConstKernelPtr = std::unique_ptr<const Kernel>;
@@ -366,8 +599,10 @@ using Array3 = Kernel;
 using Array3Ptr = KernelPtr;
 using ConstArray3Ptr = ConstKernelPtr;
 
-class Kernel {
+class Kernel : public MathExpr<Kernel> {
   public:
+    using result_t = Kernel;
+
     explicit Kernel(
       std::initializer_list<std::initializer_list<std::initializer_list<netfloat_t>>> data);
     explicit Kernel(size_t W, size_t H, size_t D);
@@ -376,6 +611,8 @@ class Kernel {
     Kernel(const Kernel& cpy);
     Kernel(Kernel&& mv);
     Kernel(netfloat_t* data, size_t W, size_t H, size_t D, bool copyData);
+    template<class E, class = EnableIfResult<E, Kernel>>
+    Kernel(const MathExpr<E>& expr);
 
     inline MathObjectType type() const;
     inline Triple shape() const;
@@ -389,6 +626,9 @@ class Kernel {
     inline netfloat_t* data();
     inline const netfloat_t* data() const;
 
+    inline KernelView view();
+    inline ConstKernelView view() const;
+
     // This will free the old data and the object will now be shallow. Tbe new data array must have
     // the same size as the old one.
     void setDataPtr(netfloat_t* data);
@@ -398,24 +638,26 @@ class Kernel {
     inline netfloat_t at(size_t x, size_t y, size_t z) const;
     inline void set(size_t x, size_t y, size_t z, netfloat_t value);
 
+    // Element access by index into the underlying (z, y, x ordered) array
+    inline netfloat_t& operator[](size_t i);
+    inline const netfloat_t& operator[](size_t i) const;
+
     inline size_t W() const;
     inline size_t H() const;
     inline size_t D() const;
 
     Kernel& operator=(const Kernel& rhs);
     Kernel& operator=(Kernel&& rhs);
+    template<class E, class = EnableIfResult<E, Kernel>>
+    Kernel& operator=(const MathExpr<E>& rhs);
 
     void zero();
     void fill(netfloat_t x);
+    // Without a seed, the next seed from nextRandomSeed() is used
     Kernel& randomize(netfloat_t standardDeviation);
+    Kernel& randomize(netfloat_t standardDeviation, uint64_t seed);
 
-    Kernel operator+(const Kernel& rhs) const;
-    Kernel operator-(const Kernel& rhs) const;
-
-    Kernel operator+(netfloat_t x) const;
-    Kernel operator-(netfloat_t x) const;
-    Kernel operator*(netfloat_t x) const;
-    Kernel operator/(netfloat_t x) const;
+    // Element-wise arithmetic operators are lazy; see math_expr.hpp
 
     Kernel& operator+=(netfloat_t x);
     Kernel& operator-=(netfloat_t x);
@@ -425,9 +667,15 @@ class Kernel {
     Kernel& operator+=(const Kernel& rhs);
     Kernel& operator-=(const Kernel& rhs);
 
+    // Prefer the templated overloads, which can inline f
     Kernel computeTransform(const std::function<netfloat_t(netfloat_t)>& f) const;
     void transformInPlace(const std::function<netfloat_t(netfloat_t)>& f);
+    template<class F>
+    Kernel computeTransform(F f) const;
+    template<class F>
+    void transformInPlace(F f);
 
+    // Prefer view().plane(z), which doesn't allocate
     inline MatrixPtr slice(size_t z, bool copyData);
     inline ConstMatrixPtr slice(size_t z, bool copyData) const;
 
@@ -484,6 +732,14 @@ const netfloat_t* Kernel::data() const {
   return m_data;
 }
 
+KernelView Kernel::view() {
+  return KernelView(m_data, m_W, m_H, m_D);
+}
+
+ConstKernelView Kernel::view() const {
+  return ConstKernelView(m_data, m_W, m_H, m_D);
+}
+
 size_t Kernel::size() const {
   return m_W * m_H * m_D;
 }
@@ -496,6 +752,14 @@ void Kernel::set(size_t x, size_t y, size_t z, netfloat_t value) {
   m_data[z * m_W * m_H + y * m_W + x] = value;
 }
 
+netfloat_t& Kernel::operator[](size_t i) {
+  return m_data[i];
+}
+
+const netfloat_t& Kernel::operator[](size_t i) const {
+  return m_data[i];
+}
+
 size_t Kernel::W() const {
   return m_W;
 }
@@ -520,3 +784,61 @@ bool Kernel::operator!=(const Kernel& rhs) const {
   return !(*this == rhs);
 }
 
+template<class E, class>
+Kernel::Kernel(const MathExpr<E>& expr)
+  : m_storage(expr.derived().size())
+  , m_data(m_storage.data())
+  , m_D(expr.derived().shape()[2])
+  , m_H(expr.derived().shape()[1])
+  , m_W(expr.derived().shape()[0]) {
+
+  evaluate(expr, m_data);
+}
+
+template<class E, class>
+Kernel& Kernel::operator=(const MathExpr<E>& rhs) {
+  Triple shape = rhs.derived().shape();
+
+  if (isShallow()) {
+    DBG_ASSERT(shape == this->shape());
+  }
+  else if (shape[0] * shape[1] * shape[2] != size()) {
+    m_storage = DataArray(shape[0] * shape[1] * shape[2]);
+    m_data = m_storage.data();
+  }
+
+  m_W = shape[0];
+  m_H = shape[1];
+  m_D = shape[2];
+
+  evaluate(rhs, m_data);
+
+  return *this;
+}
+
+template<class F>
+Kernel Kernel::computeTransform(F f) const {
+  return transform(*this, f);
+}
+
+template<class F>
+void Kernel::transformInPlace(F f) {
+  *this = transform(*this, f);
+}
+
+// Math functions operating on views. The corresponding member functions of Vector, Matrix and
+// Kernel are implemented in terms of these.
+
+netfloat_t sum(ConstVectorView V);
+netfloat_t sum(ConstMatrixView M);
+netfloat_t dot(ConstVectorView A, ConstVectorView B);
+netfloat_t squareMagnitude(ConstVectorView V);
+
+// R = M * V
+void matVecMultiply(ConstMatrixView M, ConstVectorView V, VectorView R);
+// R = transpose(M) * V
+void transposeMatVecMultiply(ConstMatrixView M, ConstVectorView V, VectorView R);
+// R = transpose(M). R must not overlap M.
+void transpose(ConstMatrixView M, MatrixView R);
+
+void convolve(ConstKernelView K, ConstKernelView image, MatrixView featureMap);
@@ -0,0 +1,290 @@
+#pragma once
+
+#include "exception.hpp"
+#include "types.hpp"
+#include <type_traits>
+#include <utility>
+
+// Lazy element-wise arithmetic on Vector, Matrix and Kernel. Operators build a tree of lightweight
+// nodes that is evaluated in a single loop when assigned to (or used to construct) a destination,
+// so an expression like a + b * 2.0f - c allocates nothing and makes one pass over memory.
+//
+// A node refers to the named objects it was built from, so `auto x = a + b;` reads a and b when x
+// is evaluated, and mustn't outlive them. Temporary objects, such as the Vector returned by
+// Matrix * Vector, are moved into the node, so `auto r = M * v + b;` is safe to use later.
+
+class Vector;
+class Matrix;
+class Kernel;
+
+template<class E>
+class MathExpr {
+  public:
+    inline const E& derived() const;
+
+    // Evaluates the expression into a new object of the expression's result type.
+    inline auto eval() const;
+
+    // Reductions evaluate the expression first, as they did when the operators were eager, e.g.
+    // (a - b).squareMagnitude()
+    inline auto sum() const;
+    inline auto magnitude() const;
+    inline auto squareMagnitude() const;
+    template<class R>
+    inline auto dot(const MathExpr<R>& rhs) const;
+};
+
+template<class E>
+const E& MathExpr<E>::derived() const {
+  return static_cast<const E&>(*this);
+}
+
+template<class E>
+auto MathExpr<E>::eval() const {
+  return typename E::result_t(derived());
+}
+
+template<class E>
+auto MathExpr<E>::sum() const {
+  return eval().sum();
+}
+
+template<class E>
+auto MathExpr<E>::magnitude() const {
+  return eval().magnitude();
+}
+
+template<class E>
+auto MathExpr<E>::squareMagnitude() const {
+  return eval().squareMagnitude();
+}
+
+template<class E>
+template<class R>
+auto MathExpr<E>::dot(const MathExpr<R>& rhs) const {
+  return eval().dot(rhs.derived());
+}
+
+template<class T>
+using ExprType = std::remove_cv_t<std::remove_reference_t<T>>;
+
+template<class T>
+inline constexpr bool IsExpr = std::is_base_of_v<MathExpr<ExprType<T>>, ExprType<T>>;
+
+template<class T>
+inline constexpr bool IsMathObject = std::is_same_v<T, Vector> || std::is_same_v<T, Matrix>
+  || std::is_same_v<T, Kernel>;
+
+// The type a node holds an operand passed as T&& by. Named math objects are held by reference.
+// Everything else is held by value: intermediate nodes and views are cheap to copy, and temporary
+// math objects are moved in so the node stays valid after the statement that built it.
+template<class T>
+using ExprOperand = std::conditional_t<std::is_lvalue_reference_v<T> && IsMathObject<ExprType<T>>,
+  const ExprType<T>&, ExprType<T>>;
+
+struct AddOp {
+  static inline netfloat_t apply(netfloat_t a, netfloat_t b) { return a + b; }
+};
+
+struct SubtractOp {
+  static inline netfloat_t apply(netfloat_t a, netfloat_t b) { return a - b; }
+};
+
+struct MultiplyOp {
+  static inline netfloat_t apply(netfloat_t a, netfloat_t b) { return a * b; }
+};
+
+struct DivideOp {
+  static inline netfloat_t apply(netfloat_t a, netfloat_t b) { return a / b; }
+};
+
+// L and R are the types the operands are held by; see ExprOperand
+template<class L, class R, class Op>
+class BinaryExpr : public MathExpr<BinaryExpr<L, R, Op>> {
+  public:
+    using result_t = typename ExprType<L>::result_t;
+
+    template<class A, class B>
+    inline BinaryExpr(A&& lhs, B&& rhs);
+
+    inline netfloat_t operator[](size_t i) const;
+    inline size_t size() const;
+    inline Triple shape() const;
+
+  private:
+    L m_lhs;
+    R m_rhs;
+};
+
+template<class L, class R, class Op>
+template<class A, class B>
+BinaryExpr<L, R, Op>::BinaryExpr(A&& lhs, B&& rhs)
+  : m_lhs(std::forward<A>(lhs))
+  , m_rhs(std::forward<B>(rhs)) {
+
+  DBG_ASSERT_MSG(m_lhs.shape() == m_rhs.shape(), "Operands have different shapes");
+}
+
+template<class L, class R, class Op>
+netfloat_t BinaryExpr<L, R, Op>::operator[](size_t i) const {
+  return Op::apply(m_lhs[i], m_rhs[i]);
+}
+
+template<class L, class R, class Op>
+size_t BinaryExpr<L, R, Op>::size() const {
+  return m_lhs.size();
+}
+
+template<class L, class R, class Op>
+Triple BinaryExpr<L, R, Op>::shape() const {
+  return m_lhs.shape();
+}
+
+template<class E, class Op>
+class ScalarExpr : public MathExpr<ScalarExpr<E, Op>> {
+  public:
+    using result_t = typename ExprType<E>::result_t;
+
+    template<class A>
+    inline ScalarExpr(A&& expr, netfloat_t x);
+
+    inline netfloat_t operator[](size_t i) const;
+    inline size_t size() const;
+    inline Triple shape() const;
+
+  private:
+    E m_expr;
+    netfloat_t m_x;
+};
+
+template<class E, class Op>
+template<class A>
+ScalarExpr<E, Op>::ScalarExpr(A&& expr, netfloat_t x)
+  : m_expr(std::forward<A>(expr))
+  , m_x(x) {}
+
+template<class E, class Op>
+netfloat_t ScalarExpr<E, Op>::operator[](size_t i) const {
+  return Op::apply(m_expr[i], m_x);
+}
+
+template<class E, class Op>
+size_t ScalarExpr<E, Op>::size() const {
+  return m_expr.size();
+}
+
+template<class E, class Op>
+Triple ScalarExpr<E, Op>::shape() const {
+  return m_expr.shape();
+}
+
+template<class E, class F>
+class TransformExpr : public MathExpr<TransformExpr<E, F>> {
+  public:
+    using result_t = typename ExprType<E>::result_t;
+
+    template<class A>
+    inline TransformExpr(A&& expr, F f);
+
+    inline netfloat_t operator[](size_t i) const;
+    inline size_t size() const;
+    inline Triple shape() const;
+
+  private:
+    E m_expr;
+    F m_f;
+};
+
+template<class E, class F>
+template<class A>
+TransformExpr<E, F>::TransformExpr(A&& expr, F f)
+  : m_expr(std::forward<A>(expr))
+  , m_f(f) {}
+
+template<class E, class F>
+netfloat_t TransformExpr<E, F>::operator[](size_t i) const {
+  return m_f(m_expr[i]);
+}
+
+template<class E, class F>
+size_t TransformExpr<E, F>::size() const {
+  return m_expr.size();
+}
+
+template<class E, class F>
+Triple TransformExpr<E, F>::shape() const {
+  return m_expr.shape();
+}
+
+template<class E, class T>
+using EnableIfResult = std::enable_if_t<std::is_same_v<typename E::result_t, T>>;
+
+template<class E>
+using EnableIfExpr = std::enable_if_t<IsExpr<E>>;
+
+template<class L, class R>
+using EnableIfSameResult = std::enable_if_t<IsExpr<L> && IsExpr<R>
+  && std::is_same_v<typename ExprType<L>::result_t, typename ExprType<R>::result_t>>;
+
+// Writes the expression into dst, which must hold expr.size() elements. Each element of the
+// result depends only on the same element of the operands, so dst may alias any of them.
+template<class E>
+inline void evaluate(const MathExpr<E>& expr, netfloat_t* dst) {
+  const E& e = expr.derived();
+  size_t n = e.size();
+
+  for (size_t i = 0; i < n; ++i) {
+    dst[i] = e[i];
+  }
+}
+
+template<class L, class R, class = EnableIfSameResult<L, R>>
+inline BinaryExpr<ExprOperand<L>, ExprOperand<R>, AddOp> operator+(L&& lhs, R&& rhs) {
+  return BinaryExpr<ExprOperand<L>, ExprOperand<R>, AddOp>(std::forward<L>(lhs),
+    std::forward<R>(rhs));
+}
+
+template<class L, class R, class = EnableIfSameResult<L, R>>
+inline BinaryExpr<ExprOperand<L>, ExprOperand<R>, SubtractOp> operator-(L&& lhs, R&& rhs) {
+  return BinaryExpr<ExprOperand<L>, ExprOperand<R>, SubtractOp>(std::forward<L>(lhs),
+    std::forward<R>(rhs));
+}
+
+template<class L, class R, class = EnableIfSameResult<L, R>>
+inline BinaryExpr<ExprOperand<L>, ExprOperand<R>, DivideOp> operator/(L&& lhs, R&& rhs) {
+  return BinaryExpr<ExprOperand<L>, ExprOperand<R>, DivideOp>(std::forward<L>(lhs),
+    std::forward<R>(rhs));
+}
+
+template<class L, class R, class = EnableIfSameResult<L, R>>
+inline BinaryExpr<ExprOperand<L>, ExprOperand<R>, MultiplyOp> hadamard(L&& lhs, R&& rhs) {
+  return BinaryExpr<ExprOperand<L>, ExprOperand<R>, MultiplyOp>(std::forward<L>(lhs),
+    std::forward<R>(rhs));
+}
+
+template<class E, class = EnableIfExpr<E>>
+inline ScalarExpr<ExprOperand<E>, AddOp> operator+(E&& lhs, netfloat_t x) {
+  return ScalarExpr<ExprOperand<E>, AddOp>(std::forward<E>(lhs), x);
+}
+
+template<class E, class = EnableIfExpr<E>>
+inline ScalarExpr<ExprOperand<E>, SubtractOp> operator-(E&& lhs, netfloat_t x) {
+  return ScalarExpr<ExprOperand<E>, SubtractOp>(std::forward<E>(lhs), x);
+}
+
+template<class E, class = EnableIfExpr<E>>
+inline ScalarExpr<ExprOperand<E>, MultiplyOp> operator*(E&& lhs, netfloat_t x) {
+  return ScalarExpr<ExprOperand<E>, MultiplyOp>(std::forward<E>(lhs), x);
+}
+
+template<class E, class = EnableIfExpr<E>>
+inline ScalarExpr<ExprOperand<E>, DivideOp> operator/(E&& lhs, netfloat_t x) {
+  return ScalarExpr<ExprOperand<E>, DivideOp>(std::forward<E>(lhs), x);
+}
+
+// Applies f to each element. f is called directly (not through std::function) so it can be inlined
+// into the evaluation loop; see activation.hpp for functions suitable for vectorization.
+template<class E, class F, class = EnableIfExpr<E>>
+inline TransformExpr<ExprOperand<E>, F> transform(E&& expr, F f) {
+  return TransformExpr<ExprOperand<E>, F>(std::forward<E>(expr), f);
+}
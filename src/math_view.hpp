@@ -0,0 +1,358 @@
+#pragma once
+
+#include "math_expr.hpp"
+#include <type_traits>
+
+// Non-owning, strided views onto netfloat_t data. Views are cheap to copy and never allocate, so
+// rows, columns, sub-blocks and planes of a Matrix or Kernel can be passed to the math functions
+// without going through Matrix::slice() or Kernel::slice().
+//
+// Copying a view rebinds it; use assign() to write through a view.
+
+template<class T>
+class BasicVectorView : public MathExpr<BasicVectorView<T>> {
+  public:
+    using result_t = Vector;
+
+    inline BasicVectorView(T* data, size_t size, size_t stride = 1);
+    template<class U, class = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+    inline BasicVectorView(const BasicVectorView<U>& view);
+
+    inline T* data() const;
+    inline size_t size() const;
+    inline size_t stride() const;
+    inline Triple shape() const;
+    inline bool isContiguous() const;
+
+    inline T& operator[](size_t i) const;
+
+    inline BasicVectorView subview(size_t from, size_t size) const;
+
+    template<class E, class = EnableIfResult<E, Vector>>
+    void assign(const MathExpr<E>& expr) const;
+
+  private:
+    T* m_data;
+    size_t m_size;
+    size_t m_stride;
+};
+
+using VectorView = BasicVectorView<netfloat_t>;
+using ConstVectorView = BasicVectorView<const netfloat_t>;
+
+template<class T>
+BasicVectorView<T>::BasicVectorView(T* data, size_t size, size_t stride)
+  : m_data(data)
+  , m_size(size)
+  , m_stride(stride) {}
+
+template<class T>
+template<class U, class>
+BasicVectorView<T>::BasicVectorView(const BasicVectorView<U>& view)
+  : m_data(view.data())
+  , m_size(view.size())
+  , m_stride(view.stride()) {}
+
+template<class T>
+T* BasicVectorView<T>::data() const {
+  return m_data;
+}
+
+template<class T>
+size_t BasicVectorView<T>::size() const {
+  return m_size;
+}
+
+template<class T>
+size_t BasicVectorView<T>::stride() const {
+  return m_stride;
+}
+
+template<class T>
+Triple BasicVectorView<T>::shape() const {
+  return { m_size, 1, 1 };
+}
+
+template<class T>
+bool BasicVectorView<T>::isContiguous() const {
+  return m_stride == 1;
+}
+
+template<class T>
+T& BasicVectorView<T>::operator[](size_t i) const {
+  return m_data[i * m_stride];
+}
+
+template<class T>
+BasicVectorView<T> BasicVectorView<T>::subview(size_t from, size_t size) const {
+  DBG_ASSERT(from + size <= m_size);
+  return BasicVectorView(m_data + from * m_stride, size, m_stride);
+}
+
+template<class T>
+template<class E, class>
+void BasicVectorView<T>::assign(const MathExpr<E>& expr) const {
+  DBG_ASSERT(expr.derived().size() == m_size);
+
+  if (isContiguous()) {
+    evaluate(expr, m_data);
+  }
+  else {
+    const E& e = expr.derived();
+    for (size_t i = 0; i < m_size; ++i) {
+      m_data[i * m_stride] = e[i];
+    }
+  }
+}
+
+template<class T>
+class BasicMatrixView {
+  public:
+    inline BasicMatrixView(T* data, size_t cols, size_t rows);
+    inline BasicMatrixView(T* data, size_t cols, size_t rows, size_t rowStride);
+    template<class U, class = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+    inline BasicMatrixView(const BasicMatrixView<U>& view);
+
+    inline T* data() const;
+    inline size_t cols() const;
+    inline size_t rows() const;
+    inline size_t W() const;
+    inline size_t H() const;
+    inline size_t size() const;
+    inline size_t rowStride() const;
+    inline Triple shape() const;
+    inline bool isContiguous() const;
+
+    inline T& at(size_t col, size_t row) const;
+
+    inline BasicVectorView<T> row(size_t row) const;
+    inline BasicVectorView<T> column(size_t col) const;
+    inline BasicMatrixView block(size_t col, size_t row, size_t cols, size_t rows) const;
+
+  private:
+    T* m_data;
+    size_t m_cols;
+    size_t m_rows;
+    size_t m_rowStride;
+};
+
+using MatrixView = BasicMatrixView<netfloat_t>;
+using ConstMatrixView = BasicMatrixView<const netfloat_t>;
+
+template<class T>
+BasicMatrixView<T>::BasicMatrixView(T* data, size_t cols, size_t rows)
+  : m_data(data)
+  , m_cols(cols)
+  , m_rows(rows)
+  , m_rowStride(cols) {}
+
+template<class T>
+BasicMatrixView<T>::BasicMatrixView(T* data, size_t cols, size_t rows, size_t rowStride)
+  : m_data(data)
+  , m_cols(cols)
+  , m_rows(rows)
+  , m_rowStride(rowStride) {}
+
+template<class T>
+template<class U, class>
+BasicMatrixView<T>::BasicMatrixView(const BasicMatrixView<U>& view)
+  : m_data(view.data())
+  , m_cols(view.cols())
+  , m_rows(view.rows())
+  , m_rowStride(view.rowStride()) {}
+
+template<class T>
+T* BasicMatrixView<T>::data() const {
+  return m_data;
+}
+
+template<class T>
+size_t BasicMatrixView<T>::cols() const {
+  return m_cols;
+}
+
+template<class T>
+size_t BasicMatrixView<T>::rows() const {
+  return m_rows;
+}
+
+template<class T>
+size_t BasicMatrixView<T>::W() const {
+  return m_cols;
+}
+
+template<class T>
+size_t BasicMatrixView<T>::H() const {
+  return m_rows;
+}
+
+template<class T>
+size_t BasicMatrixView<T>::size() const {
+  return m_cols * m_rows;
+}
+
+template<class T>
+size_t BasicMatrixView<T>::rowStride() const {
+  return m_rowStride;
+}
+
+template<class T>
+Triple BasicMatrixView<T>::shape() const {
+  return { m_cols, m_rows, 1 };
+}
+
+template<class T>
+bool BasicMatrixView<T>::isContiguous() const {
+  return m_rowStride == m_cols;
+}
+
+template<class T>
+T& BasicMatrixView<T>::at(size_t col, size_t row) const {
+  return m_data[row * m_rowStride + col];
+}
+
+template<class T>
+BasicVectorView<T> BasicMatrixView<T>::row(size_t row) const {
+  DBG_ASSERT(row < m_rows);
+  return BasicVectorView<T>(m_data + row * m_rowStride, m_cols);
+}
+
+template<class T>
+BasicVectorView<T> BasicMatrixView<T>::column(size_t col) const {
+  DBG_ASSERT(col < m_cols);
+  return BasicVectorView<T>(m_data + col, m_rows, m_rowStride);
+}
+
+template<class T>
+BasicMatrixView<T> BasicMatrixView<T>::block(size_t col, size_t row, size_t cols,
+  size_t rows) const {
+
+  DBG_ASSERT(col + cols <= m_cols);
+  DBG_ASSERT(row + rows <= m_rows);
+  return BasicMatrixView(m_data + row * m_rowStride + col, cols, rows, m_rowStride);
+}
+
+template<class T>
+class BasicKernelView {
+  public:
+    inline BasicKernelView(T* data, size_t W, size_t H, size_t D);
+    inline BasicKernelView(T* data, size_t W, size_t H, size_t D, size_t rowStride,
+      size_t planeStride);
+    template<class U, class = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+    inline BasicKernelView(const BasicKernelView<U>& view);
+
+    inline T* data() const;
+    inline size_t W() const;
+    inline size_t H() const;
+    inline size_t D() const;
+    inline size_t size() const;
+    inline size_t rowStride() const;
+    inline size_t planeStride() const;
+    inline Triple shape() const;
+
+    inline T& at(size_t x, size_t y, size_t z) const;
+
+    inline BasicMatrixView<T> plane(size_t z) const;
+    inline BasicKernelView block(size_t x, size_t y, size_t z, size_t W, size_t H, size_t D) const;
+
+  private:
+    T* m_data;
+    size_t m_W;
+    size_t m_H;
+    size_t m_D;
+    size_t m_rowStride;
+    size_t m_planeStride;
+};
+
+using KernelView = BasicKernelView<netfloat_t>;
+using ConstKernelView = BasicKernelView<const netfloat_t>;
+
+template<class T>
+BasicKernelView<T>::BasicKernelView(T* data, size_t W, size_t H, size_t D)
+  : m_data(data)
+  , m_W(W)
+  , m_H(H)
+  , m_D(D)
+  , m_rowStride(W)
+  , m_planeStride(W * H) {}
+
+template<class T>
+BasicKernelView<T>::BasicKernelView(T* data, size_t W, size_t H, size_t D, size_t rowStride,
+  size_t planeStride)
+  : m_data(data)
+  , m_W(W)
+  , m_H(H)
+  , m_D(D)
+  , m_rowStride(rowStride)
+  , m_planeStride(planeStride) {}
+
+template<class T>
+template<class U, class>
+BasicKernelView<T>::BasicKernelView(const BasicKernelView<U>& view)
+  : m_data(view.data())
+  , m_W(view.W())
+  , m_H(view.H())
+  , m_D(view.D())
+  , m_rowStride(view.rowStride())
+  , m_planeStride(view.planeStride()) {}
+
+template<class T>
+T* BasicKernelView<T>::data() const {
+  return m_data;
+}
+
+template<class T>
+size_t BasicKernelView<T>::W() const {
+  return m_W;
+}
+
+template<class T>
+size_t BasicKernelView<T>::H() const {
+  return m_H;
+}
+
+template<class T>
+size_t BasicKernelView<T>::D() const {
+  return m_D;
+}
+
+template<class T>
+size_t BasicKernelView<T>::size() const {
+  return m_W * m_H * m_D;
+}
+
+template<class T>
+size_t BasicKernelView<T>::rowStride() const {
+  return m_rowStride;
+}
+
+template<class T>
+size_t BasicKernelView<T>::planeStride() const {
+  return m_planeStride;
+}
+
+template<class T>
+Triple BasicKernelView<T>::shape() const {
+  return { m_W, m_H, m_D };
+}
+
+template<class T>
+T& BasicKernelView<T>::at(size_t x, size_t y, size_t z) const {
+  return m_data[z * m_planeStride + y * m_rowStride + x];
+}
+
+template<class T>
+BasicMatrixView<T> BasicKernelView<T>::plane(size_t z) const {
+  DBG_ASSERT(z < m_D);
+  return BasicMatrixView<T>(m_data + z * m_planeStride, m_W, m_H, m_rowStride);
+}
+
+template<class T>
+BasicKernelView<T> BasicKernelView<T>::block(size_t x, size_t y, size_t z, size_t W, size_t H,
+  size_t D) const {
+
+  DBG_ASSERT(x + W <= m_W);
+  DBG_ASSERT(y + H <= m_H);
+  DBG_ASSERT(z + D <= m_D);
+  return BasicKernelView(&at(x, y, z), W, H, D, m_rowStride, m_planeStride);
+}
@@ -0,0 +1,174 @@
+#include "parallel.hpp"
+#include "exception.hpp"
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+
+namespace {
+
+thread_local bool t_insideParallelRegion = false;
+
+class ThreadPool {
+  public:
+    explicit ThreadPool(size_t numThreads);
+
+    // Calls task(i) for i in [0, numTasks). The calling thread takes part in the work.
+    void run(size_t numTasks, const std::function<void(size_t)>& task);
+    size_t numThreads() const;
+
+    ~ThreadPool();
+
+  private:
+    struct Job {
+      const std::function<void(size_t)>* task;
+      size_t numTasks;
+      std::atomic<size_t> next;
+      size_t completed;
+      size_t activeWorkers;
+    };
+
+    void workerLoop();
+    void runTasks(Job& job);
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_runMutex;
+    std::mutex m_mutex;
+    std::condition_variable m_jobAvailable;
+    std::condition_variable m_jobFinished;
+    Job* m_job;
+    uint64_t m_generation;
+    bool m_stop;
+};
+
+ThreadPool::ThreadPool(size_t numThreads)
+  : m_job(nullptr)
+  , m_generation(0)
+  , m_stop(false) {
+
+  for (size_t i = 1; i < numThreads; ++i) {
+    m_threads.emplace_back(&ThreadPool::workerLoop, this);
+  }
+}
+
+size_t ThreadPool::numThreads() const {
+  return m_threads.size() + 1;
+}
+
+void ThreadPool::runTasks(Job& job) {
+  t_insideParallelRegion = true;
+
+  size_t numCompleted = 0;
+  for (size_t i = job.next++; i < job.numTasks; i = job.next++) {
+    (*job.task)(i);
+    ++numCompleted;
+  }
+
+  t_insideParallelRegion = false;
+
+  std::lock_guard lock(m_mutex);
+  job.completed += numCompleted;
+}
+
+void ThreadPool::workerLoop() {
+  uint64_t generation = 0;
+
+  while (true) {
+    Job* job = nullptr;
+
+    {
+      std::unique_lock lock(m_mutex);
+      m_jobAvailable.wait(lock, [&]() { return m_stop || m_generation != generation; });
+
+      if (m_stop) {
+        return;
+      }
+
+      generation = m_generation;
+      job = m_job;
+
+      if (job == nullptr) {
+        continue;
+      }
+
+      ++job->activeWorkers;
+    }
+
+    runTasks(*job);
+
+    {
+      std::lock_guard lock(m_mutex);
+      --job->activeWorkers;
+    }
+    m_jobFinished.notify_one();
+  }
+}
+
+void ThreadPool::run(size_t numTasks, const std::function<void(size_t)>& task) {
+  std::lock_guard runLock(m_runMutex);
+
+  Job job;
+  job.task = &task;
+  job.numTasks = numTasks;
+  job.next = 0;
+  job.completed = 0;
+  job.activeWorkers = 0;
+
+  {
+    std::lock_guard lock(m_mutex);
+    m_job = &job;
+    ++m_generation;
+  }
+  m_jobAvailable.notify_all();
+
+  runTasks(job);
+
+  std::unique_lock lock(m_mutex);
+  m_jobFinished.wait(lock, [&]() {
+    return job.completed == job.numTasks && job.activeWorkers == 0;
+  });
+  m_job = nullptr;
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard lock(m_mutex);
+    m_stop = true;
+  }
+  m_jobAvailable.notify_all();
+
+  for (auto& thread : m_threads) {
+    thread.join();
+  }
+}
+
+ThreadPool& threadPool() {
+  static ThreadPool pool(std::max<size_t>(std::thread::hardware_concurrency(), 1));
+  return pool;
+}
+
+}
+
+void parallelFor(size_t size, size_t chunkSize, const std::function<void(size_t, size_t)>& fn) {
+  DBG_ASSERT(chunkSize > 0);
+
+  size_t numChunks = (size + chunkSize - 1) / chunkSize;
+
+  if (numChunks <= 1 || t_insideParallelRegion || threadPool().numThreads() == 1) {
+    for (size_t begin = 0; begin < size; begin += chunkSize) {
+      fn(begin, std::min(begin + chunkSize, size));
+    }
+    return;
+  }
+
+  threadPool().run(numChunks, [&](size_t chunk) {
+    size_t begin = chunk * chunkSize;
+    fn(begin, std::min(begin + chunkSize, size));
+  });
+}
+
+size_t numWorkerThreads() {
+  return threadPool().numThreads();
+}
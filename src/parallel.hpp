@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+// Splits [0, size) into consecutive chunks of chunkSize elements (the last may be shorter) and
+// calls fn(begin, end) for each chunk on a process-wide pool of worker threads, returning once all
+// chunks are done. Chunk boundaries don't depend on the number of threads, so per-chunk results
+// can be combined deterministically.
+//
+// Calls made from inside fn run serially on the calling thread.
+void parallelFor(size_t size, size_t chunkSize, const std::function<void(size_t, size_t)>& fn);
+
+size_t numWorkerThreads();
@@ -0,0 +1,166 @@
+#include "random.hpp"
+#include "parallel.hpp"
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+const size_t ChunkSize = 1 << 16;
+const size_t BatchSize = 64;
+
+using PhiloxCounter = std::array<uint32_t, 4>;
+using PhiloxKey = std::array<uint32_t, 2>;
+
+inline void mulhilo(uint32_t a, uint32_t b, uint32_t& hi, uint32_t& lo) {
+  uint64_t product = static_cast<uint64_t>(a) * b;
+  hi = static_cast<uint32_t>(product >> 32);
+  lo = static_cast<uint32_t>(product);
+}
+
+inline PhiloxCounter philox4x32(PhiloxCounter ctr, PhiloxKey key) {
+  const uint32_t M0 = 0xD2511F53;
+  const uint32_t M1 = 0xCD9E8D57;
+  const uint32_t W0 = 0x9E3779B9;
+  const uint32_t W1 = 0xBB67AE85;
+
+  for (int round = 0; round < 10; ++round) {
+    uint32_t hi0, lo0, hi1, lo1;
+    mulhilo(M0, ctr[0], hi0, lo0);
+    mulhilo(M1, ctr[2], hi1, lo1);
+
+    ctr = { hi1 ^ ctr[1] ^ key[0], lo1, hi0 ^ ctr[3] ^ key[1], lo0 };
+
+    key[0] += W0;
+    key[1] += W1;
+  }
+
+  return ctr;
+}
+
+// Maps the top 24 bits to (0, 1]
+inline float toOpenUnitInterval(uint32_t x) {
+  return static_cast<int32_t>((x >> 8) + 1) * (1.0f / 16777216.0f);
+}
+
+// Maps the top 24 bits to [-0.5, 0.5)
+inline float toCenteredUnitInterval(uint32_t x) {
+  return static_cast<int32_t>(x >> 8) * (1.0f / 16777216.0f) - 0.5f;
+}
+
+// Natural log of a positive, normal x (Cephes logf).
+//
+// Range selection here and in fastSinCos2Pi() is done with integer or constant selects; GCC won't
+// if-convert selects between floating point expressions without -fno-trapping-math, which would
+// stop the Box-Muller loop vectorizing.
+inline float fastLog(float x) {
+  int32_t bits = 0;
+  memcpy(&bits, &x, sizeof(bits));
+
+  // Write x = 2^e * m with m in [sqrt(0.5), sqrt(2)). 0x3504f3 is the mantissa of sqrt(0.5).
+  int32_t mantissa = bits & 0x7fffff;
+  int32_t small = mantissa < 0x3504f3 ? 1 : 0;
+  int32_t mBits = mantissa | (small ? 0x3f800000 : 0x3f000000);
+
+  float e = static_cast<float>(((bits >> 23) & 0xff) - 126 - small);
+  float m = 0;
+  memcpy(&m, &mBits, sizeof(m));
+  m = m - 1.0f;
+
+  float z = m * m;
+  float y = 7.0376836292e-2f;
+  y = y * m - 1.1514610310e-1f;
+  y = y * m + 1.1676998740e-1f;
+  y = y * m - 1.2420140846e-1f;
+  y = y * m + 1.4249322787e-1f;
+  y = y * m - 1.6668057665e-1f;
+  y = y * m + 2.0000714765e-1f;
+  y = y * m - 2.4999993993e-1f;
+  y = y * m + 3.3333331174e-1f;
+  y = y * m * z;
+
+  y += -2.12194440e-4f * e;
+  y += -0.5f * z;
+
+  return m + y + 0.693359375f * e;
+}
+
+// sin(x) for x in [-pi/2, pi/2]
+inline float sinPoly(float x) {
+  float z = x * x;
+  float y = -2.5052108385e-8f;
+  y = y * z + 2.7557319224e-6f;
+  y = y * z - 1.9841269841e-4f;
+  y = y * z + 8.3333333333e-3f;
+  y = y * z - 1.6666666667e-1f;
+  return x + x * z * y;
+}
+
+// Computes sin and cos of 2 * pi * t for t in [-0.5, 0.5]
+inline void fastSinCos2Pi(float t, float& s, float& c) {
+  const float pi = 3.14159265358979324f;
+  const float halfPi = 1.57079632679489662f;
+
+  float x = 2.0f * pi * t;
+
+  // Reflect into [-pi/2, pi/2]: sin(x) = sin(+-pi - x) and cos(x) = sin(pi/2 - |x|)
+  float reflect = std::fabs(x) > halfPi ? 1.0f : 0.0f;
+  float xs = x + reflect * (std::copysign(pi, x) - 2.0f * x);
+  float xc = halfPi - std::fabs(x);
+
+  s = sinPoly(xs);
+  c = sinPoly(xc);
+}
+
+// Fills data[begin, end), where begin is a multiple of BatchSize. Element i comes from block i / 4
+// of the Philox stream.
+void fillRange(netfloat_t* data, size_t begin, size_t end, netfloat_t standardDeviation,
+  PhiloxKey key) {
+
+  std::array<uint32_t, BatchSize> bits;
+  std::array<float, BatchSize> values;
+
+  for (size_t batchBegin = begin; batchBegin < end; batchBegin += BatchSize) {
+    for (size_t j = 0; j < BatchSize; j += 4) {
+      uint64_t block = (batchBegin + j) / 4;
+      PhiloxCounter ctr{ static_cast<uint32_t>(block), static_cast<uint32_t>(block >> 32), 0, 0 };
+      PhiloxCounter r = philox4x32(ctr, key);
+
+      bits[j] = r[0];
+      bits[j + 1] = r[1];
+      bits[j + 2] = r[2];
+      bits[j + 3] = r[3];
+    }
+
+    // Box-Muller
+    for (size_t j = 0; j < BatchSize; j += 2) {
+      float radius = standardDeviation * std::sqrt(-2.0f * fastLog(toOpenUnitInterval(bits[j])));
+      float s = 0;
+      float c = 0;
+      fastSinCos2Pi(toCenteredUnitInterval(bits[j + 1]), s, c);
+
+      values[j] = radius * c;
+      values[j + 1] = radius * s;
+    }
+
+    size_t n = std::min(BatchSize, end - batchBegin);
+    memcpy(data + batchBegin, values.data(), n * sizeof(netfloat_t));
+  }
+}
+
+}
+
+void randomFillNormal(netfloat_t* data, size_t size, netfloat_t standardDeviation, uint64_t seed) {
+  PhiloxKey key{ static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32) };
+
+  parallelFor(size, ChunkSize, [=](size_t begin, size_t end) {
+    fillRange(data, begin, end, standardDeviation, key);
+  });
+}
+
+uint64_t nextRandomSeed() {
+  static std::atomic<uint64_t> seed = 0;
+  return seed++;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "types.hpp"
+#include <cstdint>
+
+// Fills data with normally distributed values of mean 0. Values are generated with a counter-based
+// generator (Philox4x32-10), so each one depends only on the seed and its index. The fill runs in
+// parallel and gives the same result for a given seed regardless of the number of threads.
+void randomFillNormal(netfloat_t* data, size_t size, netfloat_t standardDeviation, uint64_t seed);
+
+// Returns the next seed from a process-wide sequence starting at 0.
+uint64_t nextRandomSeed();
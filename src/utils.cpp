@@ -1,5 +1,10 @@
 #include "utils.hpp"
 #include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <thread>
+#include <unistd.h>
 
 void trimLeft(std::string& s) {
   s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](unsigned char c) {
@@ -12,3 +17,33 @@ void trimRight(std::string& s) {
     return !std::isspace(c);
   }).base(), s.end());
 }
+
+std::vector<char> readFile(const std::filesystem::path& path) {
+  std::ifstream fin(path, std::ios::binary);
+  if (!fin) {
+    return {};
+  }
+  return std::vector<char>(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+}
+
+void writeCacheFile(const std::filesystem::path& path, const void* data, size_t size) {
+  std::error_code error;
+  std::filesystem::create_directories(path.parent_path(), error);
+
+  // Unique to this thread of this process, so concurrent writers never share a temporary file
+  std::stringstream tmpSuffix;
+  tmpSuffix << ".tmp" << getpid() << "." << std::this_thread::get_id();
+
+  std::filesystem::path tmpPath = path;
+  tmpPath += tmpSuffix.str();
+
+  {
+    std::ofstream fout(tmpPath, std::ios::binary | std::ios::trunc);
+    fout.write(static_cast<const char*>(data), size);
+    if (!fout) {
+      return;
+    }
+  }
+
+  std::filesystem::rename(tmpPath, path, error);
+}
@@ -1,8 +1,19 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <filesystem>
 
 #define STR(x) (std::stringstream("") << x).str()
 
 void trimLeft(std::string& s);
 void trimRight(std::string& s);
+
+// Compiled shaders, the pipeline cache and tuning results are kept here between runs
+const std::filesystem::path CacheDirectory = "cache";
+
+// Returns an empty vector if the file can't be read
+std::vector<char> readFile(const std::filesystem::path& path);
+// The file is written under a temporary name and then renamed, so other processes never see it
+// partially written. Failures are ignored; the cache only saves time.
+void writeCacheFile(const std::filesystem::path& path, const void* data, size_t size);
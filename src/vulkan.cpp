@@ -1,12 +1,22 @@
 #include "gpu.hpp"
 #include "exception.hpp"
+#include "parallel.hpp"
+#include "utils.hpp"
+#include "free_list.hpp"
 #include <vulkan/vulkan.h>
 #include <shaderc/shaderc.hpp>
 #include <iostream>
+#include <iomanip>
 #include <vector>
 #include <cstring>
 #include <algorithm>
 #include <map>
+#include <deque>
+#include <memory>
+#include <iterator>
+#include <filesystem>
+#include <exception>
+#include <atomic>
 
 #define VK_CHECK(fnCall, msg) \
   { \
@@ -22,18 +32,251 @@ const std::vector<const char*> ValidationLayers = {
   "VK_LAYER_KHRONOS_validation"
 };
 
-class Vulkan : public Gpu {
+// Allocations smaller than this share a block
+const VkDeviceSize MemoryBlockSize = 64 * 1024 * 1024;
+
+// Device local memory the host can map, as on integrated GPUs and discrete GPUs with resizable BAR
+const VkMemoryPropertyFlags ZeroCopyMemory = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+                                           | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                                           | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+const std::filesystem::path PipelineCacheFile = CacheDirectory / "pipelines.bin";
+const std::filesystem::path SpirvCacheDirectory = CacheDirectory / "spirv";
+
+const uint32_t SpirvMagicNumber = 0x07230203;
+
+// 64-bit FNV-1a
+uint64_t hashString(const std::string& str) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (unsigned char c : str) {
+    hash ^= c;
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+// Suballocates device memory from large blocks, which are kept once allocated, so creating a
+// buffer rarely calls vkAllocateMemory. Host visible blocks stay mapped for as long as they exist.
+class MemoryAllocator {
   public:
-    Vulkan();
+    struct Allocation {
+      VkDeviceMemory memory = VK_NULL_HANDLE;
+      VkDeviceSize offset = 0;
+      VkDeviceSize size = 0;
+      // Null unless the memory is host visible
+      char* mapped = nullptr;
+      size_t block = 0;
+    };
+
+    MemoryAllocator(VkPhysicalDevice physicalDevice, VkDevice device);
+
+    Allocation allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties);
+    void free(const Allocation& allocation);
+
+    ~MemoryAllocator();
+
+  private:
+    struct Block {
+      VkDeviceMemory memory;
+      uint32_t memoryType;
+      char* mapped;
+      FreeList freeRanges;
+    };
 
-    ShaderHandle compileShader(const std::string& shaderSource);
-    void submitBuffer(const void* buffer, size_t bufferSize) override;
-    void executeShader(size_t shaderIndex, size_t numWorkgroups) override;
-    void retrieveBuffer(void* data) override;
+    uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) const;
+
+    VkDevice m_device;
+    VkPhysicalDeviceMemoryProperties m_memoryProperties;
+    std::vector<Block> m_blocks;
+};
+
+MemoryAllocator::MemoryAllocator(VkPhysicalDevice physicalDevice, VkDevice device)
+  : m_device(device) {
+
+  vkGetPhysicalDeviceMemoryProperties(physicalDevice, &m_memoryProperties);
+}
+
+uint32_t MemoryAllocator::findMemoryType(uint32_t typeFilter,
+  VkMemoryPropertyFlags properties) const {
+
+  for (uint32_t i = 0; i < m_memoryProperties.memoryTypeCount; ++i) {
+    if (typeFilter & (1 << i) &&
+      (m_memoryProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+
+      return i;
+    }
+  }
+
+  EXCEPTION("Failed to find suitable memory type");
+}
+
+MemoryAllocator::Allocation MemoryAllocator::allocate(const VkMemoryRequirements& requirements,
+  VkMemoryPropertyFlags properties) {
+
+  uint32_t memoryType = findMemoryType(requirements.memoryTypeBits, properties);
+
+  Allocation allocation;
+  allocation.size = requirements.size;
+
+  for (size_t i = 0; i < m_blocks.size(); ++i) {
+    Block& block = m_blocks[i];
+
+    if (block.memoryType == memoryType && block.freeRanges.allocate(requirements.size,
+      requirements.alignment, allocation.offset)) {
+
+      allocation.memory = block.memory;
+      allocation.mapped = block.mapped ? block.mapped + allocation.offset : nullptr;
+      allocation.block = i;
+
+      return allocation;
+    }
+  }
+
+  VkDeviceSize blockSize = std::max(MemoryBlockSize, requirements.size);
+
+  VkMemoryAllocateInfo allocInfo{};
+  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocInfo.allocationSize = blockSize;
+  allocInfo.memoryTypeIndex = memoryType;
+
+  Block block{ VK_NULL_HANDLE, memoryType, nullptr, FreeList(blockSize) };
+
+  VK_CHECK(vkAllocateMemory(m_device, &allocInfo, nullptr, &block.memory),
+    "Failed to allocate device memory");
+
+  if (m_memoryProperties.memoryTypes[memoryType].propertyFlags
+    & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+
+    void* mapped = nullptr;
+    VK_CHECK(vkMapMemory(m_device, block.memory, 0, VK_WHOLE_SIZE, 0, &mapped),
+      "Failed to map device memory");
+    block.mapped = static_cast<char*>(mapped);
+  }
+
+  m_blocks.push_back(block);
+
+  bool allocated = m_blocks.back().freeRanges.allocate(requirements.size,
+    requirements.alignment, allocation.offset);
+  ASSERT(allocated);
+
+  allocation.memory = block.memory;
+  allocation.mapped = block.mapped ? block.mapped + allocation.offset : nullptr;
+  allocation.block = m_blocks.size() - 1;
+
+  return allocation;
+}
+
+void MemoryAllocator::free(const Allocation& allocation) {
+  if (allocation.memory == VK_NULL_HANDLE) {
+    return;
+  }
+
+  m_blocks[allocation.block].freeRanges.free(allocation.offset, allocation.size);
+}
+
+MemoryAllocator::~MemoryAllocator() {
+  for (const Block& block : m_blocks) {
+    if (block.mapped != nullptr) {
+      vkUnmapMemory(m_device, block.memory);
+    }
+    vkFreeMemory(m_device, block.memory, nullptr);
+  }
+}
+
+struct BufferCopies {
+  VkBuffer src;
+  VkBuffer dst;
+  std::vector<VkBufferCopy> regions;
+};
+
+class Vulkan : public Gpu {
+  public:
+    explicit Vulkan(bool allowZeroCopy);
+
+    const GpuProperties& properties() const override;
+    std::vector<ShaderHandle> compileShaders(const std::vector<std::string>& sources) override;
+    BufferHandle createBuffer() override;
+    void freeBuffer(BufferHandle buffer) override;
+    void submitBuffer(BufferHandle buffer, size_t binding, const void* data, size_t size,
+      bool shared) override;
+    void* mappedBinding(BufferHandle buffer, size_t binding) override;
+    CommandsHandle recordCommands(const std::vector<GpuDispatch>& dispatches) override;
+    void freeCommands(CommandsHandle commands) override;
+    FrameHandle submitFrame(BufferHandle buffer, const std::vector<const void*>& data,
+      const std::vector<GpuBufferRange>& inputs, const std::vector<GpuBufferRange>& carried,
+      CommandsHandle commands, const std::vector<GpuBufferRange>& outputs) override;
+    void waitForFrame(FrameHandle frame) override;
+    void retrieveFrame(FrameHandle frame, const std::vector<void*>& data) override;
 
     ~Vulkan();
 
   private:
+    struct DeviceBuffer {
+      VkBuffer buffer = VK_NULL_HANDLE;
+      MemoryAllocator::Allocation memory;
+      VkDeviceSize size = 0;
+      VkDeviceSize capacity = 0;
+    };
+
+    struct StagingBuffer {
+      VkBuffer buffer = VK_NULL_HANDLE;
+      MemoryAllocator::Allocation memory;
+      VkDeviceSize size = 0;
+    };
+
+    // A binding's device buffers: one per frame, or one for all of them if it's shared
+    struct Binding {
+      bool shared = false;
+      std::vector<DeviceBuffer> buffers;
+    };
+
+    // A buffer's frames are used in turn. Each has its own copy of the bindings that aren't shared
+    // and its own staging buffer, so one frame's transfers can overlap with another's dispatches.
+    struct Frame {
+      VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+      // Holds the inputs, followed by the outputs
+      StagingBuffer staging;
+      VkCommandBuffer uploadCommands = VK_NULL_HANDLE;
+      VkCommandBuffer downloadCommands = VK_NULL_HANDLE;
+    };
+
+    struct BufferSet {
+      std::vector<Binding> bindings;
+      std::vector<Frame> frames;
+      size_t nextFrame = 0;
+      // Oldest first
+      std::deque<FrameHandle> framesInFlight;
+      // The compute timeline's value once the last frame submitted has finished its dispatches,
+      // and so every frame submitted has finished with the shared bindings
+      uint64_t computeValue = 0;
+    };
+
+    // A semaphore whose value only increases, and the last value a submission was made to signal
+    struct Timeline {
+      VkSemaphore semaphore = VK_NULL_HANDLE;
+      uint64_t value = 0;
+    };
+
+    // A frame in flight. It's finished once the compute timeline reaches computeValue, or if it
+    // downloads its outputs, once the transfer timeline reaches downloadValue.
+    struct Submission {
+      BufferHandle buffer;
+      size_t frame;
+      CommandsHandle commands;
+      std::vector<GpuBufferRange> outputs;
+      VkDeviceSize outputsOffset;
+      uint64_t computeValue;
+      uint64_t downloadValue;
+      bool download;
+      bool downloadPending;
+    };
+
+    struct RecordedCommands {
+      std::vector<GpuDispatch> dispatches;
+      // Recorded for each descriptor set the commands have run with, since each binds its own
+      std::map<VkDescriptorSet, VkCommandBuffer> commandBuffers;
+    };
+
     static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT,
       VkDebugUtilsMessageTypeFlagsEXT, const VkDebugUtilsMessengerCallbackDataEXT* data, void*);
 
@@ -43,184 +286,750 @@ class Vulkan : public Gpu {
     void createVulkanInstance();
     void setupDebugMessenger();
     void pickPhysicalDevice();
+    void queryDeviceFeatures();
+    bool supportsZeroCopy() const;
+    bool supportsTimelineSemaphores() const;
     void createLogicalDevice();
     uint32_t findComputeQueueFamily() const;
-    void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
-    void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties,
-      VkBuffer& buffer, VkDeviceMemory& bufferMemory) const;
+    uint32_t findTransferQueueFamily() const;
+    void recordCopies(VkCommandBuffer commandBuffer, const std::vector<BufferCopies>& copies);
+    // Makes the copies in one submission and waits for them to finish
+    void copyBuffers(const std::vector<BufferCopies>& copies);
+    // The binding's device buffer used by the frame
+    const DeviceBuffer& frameBuffer(const BufferSet& buffer, size_t binding, size_t frame) const;
+    // Returns the copies between the frame's staging buffer, from stagingOffset on, and the ranges
+    // of its device buffers
+    std::vector<BufferCopies> frameCopies(const BufferSet& buffer, size_t frame,
+      const std::vector<GpuBufferRange>& ranges, VkDeviceSize stagingOffset, bool upload) const;
+    // Returns the copies of the ranges from the previous frame's device buffers to the frame's
+    std::vector<BufferCopies> carryCopies(const BufferSet& buffer, size_t frame,
+      const std::vector<GpuBufferRange>& ranges) const;
+    // Submits the command buffer to run once the wait timeline reaches waitValue, or straight away
+    // if waitValue is zero, and to then signal the signal timeline's next value, which is returned
+    uint64_t submitCommands(VkQueue queue, VkCommandBuffer commandBuffer, const Timeline& wait,
+      uint64_t waitValue, VkPipelineStageFlags waitStage, Timeline& signal);
+    void waitForTimeline(const Timeline& timeline, uint64_t value);
+    void submitDownload(Submission& submission);
+    bool hasBuffers(const BufferSet& buffer) const;
+    void allocateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+      VkMemoryPropertyFlags properties, VkBuffer& buffer,
+      MemoryAllocator::Allocation& bufferMemory);
     void createDescriptorSetLayout();
     void createPipelineLayout();
     void createCommandPool();
     void createDescriptorPool();
-    void createDescriptorSets();
-    void createCommandBuffer();
-    void recordCommandBuffer(VkCommandBuffer commandBuffer, size_t numWorkgroups);
+    void updateDescriptorSets(BufferSet& buffer);
+    // Frees the command buffers recorded to bind the descriptor set
+    void discardCommandBuffers(VkDescriptorSet descriptorSet);
+    // Returns the commands' command buffer for the descriptor set, recording one if there isn't one
+    VkCommandBuffer commandBuffer(RecordedCommands& recorded, VkDescriptorSet descriptorSet);
+    void recordCommandBuffer(VkCommandBuffer commandBuffer, VkDescriptorSet descriptorSet,
+      const std::vector<GpuDispatch>& dispatches);
     void createSyncObjects();
+    void destroyBufferSet(BufferSet& buffer);
     void destroyDebugMessenger();
-    void destroyBuffer();
-    void destroyStagingBuffer();
-    VkShaderModule createShaderModule(const std::string& source) const;
-    inline VkPipeline currentPipeline() const;
+    void destroyBuffer(DeviceBuffer& buffer);
+    void destroyStagingBuffer(StagingBuffer& buffer);
+    void reserveStagingBuffer(StagingBuffer& buffer, VkDeviceSize size);
+    void createPipelineCache();
+    void savePipelineCache() const;
+    std::vector<uint32_t> compileGlsl(const std::string& source) const;
+    VkShaderModule createShaderModule(const std::vector<uint32_t>& code) const;
 
     VkInstance m_instance;
+    // The Vulkan version supported by both the instance and the device
+    uint32_t m_apiVersion;
+    GpuProperties m_properties;
+    // Whether the device buffers are mapped, so the host reads and writes them directly instead of
+    // copying through staging buffers
+    bool m_zeroCopy;
     VkDebugUtilsMessengerEXT m_debugMessenger;
+    // Warnings and errors reported by the validation layer, summarised on destruction
+    mutable std::atomic<uint32_t> m_validationMessages;
     VkPhysicalDevice m_physicalDevice;
     VkDevice m_device;
+    uint32_t m_computeQueueFamily;
+    // The same as the compute queue unless the device has a queue family just for transfers
+    uint32_t m_transferQueueFamily;
     VkQueue m_computeQueue;
-    VkBuffer m_buffer;
-    VkDeviceMemory m_bufferMemory;
-    VkDeviceSize m_bufferSize;
-    VkBuffer m_stagingBuffer;
-    VkDeviceMemory m_stagingBufferMemory;
+    VkQueue m_transferQueue;
+    // vkWaitSemaphores(), or vkWaitSemaphoresKHR() before Vulkan 1.2
+    PFN_vkWaitSemaphores m_waitSemaphores;
+    std::unique_ptr<MemoryAllocator> m_allocator;
+    // The device and staging buffers are kept while submitted data fits in them
+    std::map<BufferHandle, BufferSet> m_buffers;
+    BufferHandle m_nextBuffer;
+    std::map<FrameHandle, Submission> m_submissions;
+    FrameHandle m_nextFrame;
+    // Signalled by the transfer queue's submissions, and by the compute queue's
+    Timeline m_transferTimeline;
+    Timeline m_computeTimeline;
+    // For submitBuffer()
+    StagingBuffer m_staging;
     VkDescriptorSetLayout m_descriptorSetLayout;
     VkPipelineLayout m_pipelineLayout;
+    VkPipelineCache m_pipelineCache;
     std::vector<VkPipeline> m_pipelines;
-    size_t m_currentPipelineIdx;
+    // Shaders are parameterized by push constants, so the same source is often compiled again
+    std::map<std::string, ShaderHandle> m_pipelinesBySource;
     VkCommandPool m_commandPool;
-    VkCommandBuffer m_commandBuffer;
+    VkCommandPool m_transferCommandPool;
+    std::map<CommandsHandle, RecordedCommands> m_commands;
+    CommandsHandle m_nextCommands;
     VkDescriptorPool m_descriptorPool;
-    VkDescriptorSet m_descriptorSet;
-    VkFence m_taskCompleteFence;
 };
 
-Vulkan::Vulkan()
-  : m_buffer(VK_NULL_HANDLE)
-  , m_bufferMemory(VK_NULL_HANDLE)
-  , m_bufferSize(0)
-  , m_stagingBuffer(VK_NULL_HANDLE)
-  , m_stagingBufferMemory(VK_NULL_HANDLE) {
+Vulkan::Vulkan(bool allowZeroCopy)
+  : m_apiVersion(VK_API_VERSION_1_0)
+  , m_zeroCopy(allowZeroCopy)
+  , m_validationMessages(0)
+  , m_waitSemaphores(nullptr)
+  , m_nextBuffer(0)
+  , m_nextFrame(0)
+  , m_nextCommands(0) {
 
   createVulkanInstance();
 #ifndef NDEBUG
   setupDebugMessenger();
 #endif
   pickPhysicalDevice();
+  queryDeviceFeatures();
   createLogicalDevice();
+  m_allocator = std::make_unique<MemoryAllocator>(m_physicalDevice, m_device);
   createDescriptorSetLayout();
   createPipelineLayout();
+  createPipelineCache();
   createCommandPool();
   createDescriptorPool();
-  createCommandBuffer();
   createSyncObjects();
 }
 
-void Vulkan::destroyBuffer() {
-    vkDestroyBuffer(m_device, m_buffer, nullptr);
-    vkFreeMemory(m_device, m_bufferMemory, nullptr);
-    m_buffer = VK_NULL_HANDLE;
-    m_bufferMemory = VK_NULL_HANDLE;
-    m_bufferSize = 0;
+const GpuProperties& Vulkan::properties() const {
+  return m_properties;
 }
 
-void Vulkan::destroyStagingBuffer() {
-  vkDestroyBuffer(m_device, m_stagingBuffer, nullptr);
-  vkFreeMemory(m_device, m_stagingBufferMemory, nullptr);
-  m_stagingBuffer = VK_NULL_HANDLE;
-  m_stagingBufferMemory = VK_NULL_HANDLE;
+void Vulkan::destroyBuffer(DeviceBuffer& buffer) {
+  vkDestroyBuffer(m_device, buffer.buffer, nullptr);
+  m_allocator->free(buffer.memory);
+  buffer = DeviceBuffer{};
 }
 
-void Vulkan::submitBuffer(const void* data, size_t size) {
-  VK_CHECK(vkDeviceWaitIdle(m_device), "Error waiting for device to be idle");
+void Vulkan::destroyStagingBuffer(StagingBuffer& buffer) {
+  vkDestroyBuffer(m_device, buffer.buffer, nullptr);
+  m_allocator->free(buffer.memory);
+  buffer = StagingBuffer{};
+}
 
-  if (m_buffer != VK_NULL_HANDLE) {
-    destroyBuffer();
+void Vulkan::reserveStagingBuffer(StagingBuffer& buffer, VkDeviceSize size) {
+  if (size <= buffer.size) {
+    return;
   }
 
-  if (m_stagingBuffer != VK_NULL_HANDLE) {
-    destroyStagingBuffer();
-  }
+  destroyStagingBuffer(buffer);
 
   VkMemoryPropertyFlags flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
                               | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
                               | VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
 
-  createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, flags, m_stagingBuffer,
-    m_stagingBufferMemory);
+  allocateBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, flags,
+    buffer.buffer, buffer.memory);
+
+  buffer.size = size;
+}
+
+bool Vulkan::hasBuffers(const BufferSet& buffer) const {
+  return !buffer.bindings.empty();
+}
+
+const Vulkan::DeviceBuffer& Vulkan::frameBuffer(const BufferSet& buffer, size_t binding,
+  size_t frame) const {
+
+  const Binding& b = buffer.bindings.at(binding);
+  return b.buffers.at(b.shared ? 0 : frame);
+}
+
+// The device buffers are created by submitBuffer()
+BufferHandle Vulkan::createBuffer() {
+  ASSERT_MSG(m_buffers.size() < MaxGpuBuffers, "Can't have more than " << MaxGpuBuffers
+    << " buffers");
+
+  BufferSet buffer;
+  buffer.frames.resize(FramesInFlight);
+
+  std::vector<VkDescriptorSetLayout> layouts(buffer.frames.size(), m_descriptorSetLayout);
+  std::vector<VkDescriptorSet> descriptorSets(buffer.frames.size());
+
+  VkDescriptorSetAllocateInfo setInfo{};
+  setInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  setInfo.descriptorPool = m_descriptorPool;
+  setInfo.descriptorSetCount = layouts.size();
+  setInfo.pSetLayouts = layouts.data();
+
+  VK_CHECK(vkAllocateDescriptorSets(m_device, &setInfo, descriptorSets.data()),
+    "Failed to allocate descriptor sets");
+
+  VkCommandBufferAllocateInfo commandsInfo{};
+  commandsInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  commandsInfo.commandPool = m_transferCommandPool;
+  commandsInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  commandsInfo.commandBufferCount = 1;
+
+  for (size_t i = 0; i < buffer.frames.size(); ++i) {
+    Frame& frame = buffer.frames[i];
+
+    frame.descriptorSet = descriptorSets[i];
+
+    VK_CHECK(vkAllocateCommandBuffers(m_device, &commandsInfo, &frame.uploadCommands),
+      "Failed to allocate command buffer");
+    VK_CHECK(vkAllocateCommandBuffers(m_device, &commandsInfo, &frame.downloadCommands),
+      "Failed to allocate command buffer");
+  }
+
+  m_buffers[m_nextBuffer] = std::move(buffer);
+  return m_nextBuffer++;
+}
+
+void Vulkan::freeBuffer(BufferHandle handle) {
+  auto i = m_buffers.find(handle);
+  ASSERT_MSG(i != m_buffers.end(), "No buffer with handle " << handle);
+  ASSERT_MSG(i->second.framesInFlight.empty(), "Can't free a buffer with frames in flight");
+
+  destroyBufferSet(i->second);
+  m_buffers.erase(i);
+}
+
+void Vulkan::destroyBufferSet(BufferSet& buffer) {
+  for (Frame& frame : buffer.frames) {
+    discardCommandBuffers(frame.descriptorSet);
+
+    VK_CHECK(vkFreeDescriptorSets(m_device, m_descriptorPool, 1, &frame.descriptorSet),
+      "Failed to free descriptor set");
+
+    VkCommandBuffer commandBuffers[] = { frame.uploadCommands, frame.downloadCommands };
+    vkFreeCommandBuffers(m_device, m_transferCommandPool, 2, commandBuffers);
+
+    destroyStagingBuffer(frame.staging);
+  }
+
+  for (Binding& binding : buffer.bindings) {
+    for (DeviceBuffer& deviceBuffer : binding.buffers) {
+      destroyBuffer(deviceBuffer);
+    }
+  }
+}
+
+void Vulkan::submitBuffer(BufferHandle handle, size_t binding, const void* data, size_t size,
+  bool shared) {
+
+  ASSERT(binding < m_properties.maxBufferBindings);
+
+  BufferSet& bufferSet = m_buffers.at(handle);
+  ASSERT_MSG(bufferSet.framesInFlight.empty(), "Can't submit a binding of a buffer with frames in "
+    "flight");
 
-  void* stagingBufferMapped = nullptr;
-  vkMapMemory(m_device, m_stagingBufferMemory, 0, size, 0, &stagingBufferMapped);
-  memcpy(stagingBufferMapped, data, size);
-  vkUnmapMemory(m_device, m_stagingBufferMemory);
+  if (size > m_properties.maxBufferSize) {
+    EXCEPTION("Binding " << binding << " needs " << size << " bytes, but the device's storage "
+      "buffers can't be larger than " << m_properties.maxBufferSize);
+  }
+
+  if (!m_zeroCopy) {
+    reserveStagingBuffer(m_staging, size);
+    memcpy(m_staging.memory.mapped, data, size);
+  }
 
-  VkBufferUsageFlags usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT
-                           | VK_BUFFER_USAGE_TRANSFER_SRC_BIT
-                           | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-  createBuffer(size, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, m_buffer, m_bufferMemory);
+  if (binding >= bufferSet.bindings.size()) {
+    bufferSet.bindings.resize(binding + 1);
+  }
 
-  copyBuffer(m_stagingBuffer, m_buffer, size);
+  Binding& b = bufferSet.bindings[binding];
+  size_t numBuffers = shared ? 1 : bufferSet.frames.size();
 
-  m_bufferSize = size;
+  std::vector<BufferCopies> copies;
+  bool recreated = false;
 
-  createDescriptorSets();
+  if (b.shared != shared || b.buffers.size() != numBuffers) {
+    for (DeviceBuffer& buffer : b.buffers) {
+      destroyBuffer(buffer);
+    }
+    b.shared = shared;
+    b.buffers.assign(numBuffers, DeviceBuffer{});
+  }
+
+  for (DeviceBuffer& buffer : b.buffers) {
+    if (size > buffer.capacity) {
+      destroyBuffer(buffer);
+
+      VkBufferUsageFlags usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT
+                               | VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+                               | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+      VkMemoryPropertyFlags memory = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+      if (m_zeroCopy) {
+        memory = ZeroCopyMemory;
+      }
+      allocateBuffer(size, usage, memory, buffer.buffer, buffer.memory);
+
+      buffer.capacity = size;
+      recreated = true;
+    }
+
+    buffer.size = size;
+
+    if (m_zeroCopy) {
+      memcpy(buffer.memory.mapped, data, size);
+    }
+    else {
+      copies.push_back(BufferCopies{ m_staging.buffer, buffer.buffer,
+        { VkBufferCopy{ 0, 0, size } } });
+    }
+  }
+
+  if (recreated) {
+    updateDescriptorSets(bufferSet);
+  }
+
+  if (!copies.empty()) {
+    copyBuffers(copies);
+  }
 }
 
-ShaderHandle Vulkan::compileShader(const std::string& shaderSource) {
-  VkShaderModule shaderModule = createShaderModule(shaderSource);
+void* Vulkan::mappedBinding(BufferHandle handle, size_t binding) {
+  const Binding& b = m_buffers.at(handle).bindings.at(binding);
+  return m_zeroCopy && b.shared ? b.buffers[0].memory.mapped : nullptr;
+}
 
-  VkPipelineShaderStageCreateInfo shaderStageInfo{};
-  shaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  shaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-  shaderStageInfo.module = shaderModule;
-  shaderStageInfo.pName = "main";
+// The ranges are packed one after another into the staging buffer, from stagingOffset on
+std::vector<BufferCopies> Vulkan::frameCopies(const BufferSet& bufferSet, size_t index,
+  const std::vector<GpuBufferRange>& ranges, VkDeviceSize stagingOffset, bool upload) const {
 
-  VkComputePipelineCreateInfo pipelineInfo{};
-  pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-  pipelineInfo.layout = m_pipelineLayout;
-  pipelineInfo.stage = shaderStageInfo;
+  const Frame& frame = bufferSet.frames[index];
+  std::vector<BufferCopies> copies;
 
-  VkPipeline pipeline = VK_NULL_HANDLE;
+  for (const GpuBufferRange& range : ranges) {
+    VkBuffer buffer = frameBuffer(bufferSet, range.binding, index).buffer;
+    VkBuffer src = upload ? frame.staging.buffer : buffer;
+    VkBuffer dst = upload ? buffer : frame.staging.buffer;
 
-  VK_CHECK(vkCreateComputePipelines(m_device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr,
-    &pipeline), "Failed to create compute pipeline");
+    if (copies.empty() || copies.back().src != src || copies.back().dst != dst) {
+      copies.push_back(BufferCopies{ src, dst, {} });
+    }
 
-  vkDestroyShaderModule(m_device, shaderModule, nullptr);
+    if (upload) {
+      copies.back().regions.push_back(VkBufferCopy{ stagingOffset, range.offset, range.size });
+    }
+    else {
+      copies.back().regions.push_back(VkBufferCopy{ range.offset, stagingOffset, range.size });
+    }
 
-  m_pipelines.push_back(pipeline);
+    stagingOffset += range.size;
+  }
 
-  return m_pipelines.size() - 1;
+  return copies;
 }
 
-void Vulkan::executeShader(size_t shaderIndex, size_t numWorkgroups) {
-  //VK_CHECK(vkDeviceWaitIdle(m_device), "Error waiting for device to be idle");
+std::vector<BufferCopies> Vulkan::carryCopies(const BufferSet& bufferSet, size_t index,
+  const std::vector<GpuBufferRange>& ranges) const {
 
-  m_currentPipelineIdx = shaderIndex;
+  size_t previous = (index + bufferSet.frames.size() - 1) % bufferSet.frames.size();
+  std::vector<BufferCopies> copies;
+
+  for (const GpuBufferRange& range : ranges) {
+    VkBuffer src = frameBuffer(bufferSet, range.binding, previous).buffer;
+    VkBuffer dst = frameBuffer(bufferSet, range.binding, index).buffer;
+
+    if (copies.empty() || copies.back().src != src || copies.back().dst != dst) {
+      copies.push_back(BufferCopies{ src, dst, {} });
+    }
+
+    copies.back().regions.push_back(VkBufferCopy{ range.offset, range.offset, range.size });
+  }
+
+  return copies;
+}
+
+// Identical sources share a pipeline, including those compiled by earlier calls. The new ones are
+// compiled to SPIR-V on the worker threads, then their pipelines are created in one call.
+std::vector<ShaderHandle> Vulkan::compileShaders(const std::vector<std::string>& sources) {
+  std::vector<ShaderHandle> handles;
+  std::vector<const std::string*> unique;
+  std::map<std::string, ShaderHandle> handlesBySource;
+
+  for (const std::string& source : sources) {
+    auto existing = m_pipelinesBySource.find(source);
+    if (existing != m_pipelinesBySource.end()) {
+      handles.push_back(existing->second);
+      continue;
+    }
+
+    auto i = handlesBySource.find(source);
+    if (i == handlesBySource.end()) {
+      i = handlesBySource.insert({ source, m_pipelines.size() + unique.size() }).first;
+      unique.push_back(&source);
+    }
+    handles.push_back(i->second);
+  }
+
+  if (unique.empty()) {
+    return handles;
+  }
+
+  std::vector<std::vector<uint32_t>> code(unique.size());
+  // Exceptions can't leave the worker threads, so the first is rethrown here
+  std::vector<std::exception_ptr> errors(unique.size());
+
+  parallelFor(unique.size(), 1, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      try {
+        code[i] = compileGlsl(*unique[i]);
+      }
+      catch (...) {
+        errors[i] = std::current_exception();
+      }
+    }
+  });
+
+  for (const std::exception_ptr& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  std::vector<VkShaderModule> shaderModules;
+  std::vector<VkComputePipelineCreateInfo> pipelineInfos;
+
+  for (const std::vector<uint32_t>& shaderCode : code) {
+    shaderModules.push_back(createShaderModule(shaderCode));
+
+    VkPipelineShaderStageCreateInfo shaderStageInfo{};
+    shaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    shaderStageInfo.module = shaderModules.back();
+    shaderStageInfo.pName = "main";
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.layout = m_pipelineLayout;
+    pipelineInfo.stage = shaderStageInfo;
+
+    pipelineInfos.push_back(pipelineInfo);
+  }
 
-  vkResetCommandBuffer(m_commandBuffer, 0);
-  recordCommandBuffer(m_commandBuffer, numWorkgroups);
+  std::vector<VkPipeline> pipelines(pipelineInfos.size(), VK_NULL_HANDLE);
+
+  VkResult result = vkCreateComputePipelines(m_device, m_pipelineCache, pipelineInfos.size(),
+    pipelineInfos.data(), nullptr, pipelines.data());
+
+  for (VkShaderModule shaderModule : shaderModules) {
+    vkDestroyShaderModule(m_device, shaderModule, nullptr);
+  }
+
+  if (result != VK_SUCCESS) {
+    for (VkPipeline pipeline : pipelines) {
+      vkDestroyPipeline(m_device, pipeline, nullptr);
+    }
+    EXCEPTION("Failed to create compute pipelines (result: " << result << ")");
+  }
+
+  m_pipelines.insert(m_pipelines.end(), pipelines.begin(), pipelines.end());
+  m_pipelinesBySource.merge(handlesBySource);
+
+  return handles;
+}
+
+// Recording is deferred until the commands run with a descriptor set
+CommandsHandle Vulkan::recordCommands(const std::vector<GpuDispatch>& dispatches) {
+  for (const GpuDispatch& dispatch : dispatches) {
+    ASSERT_MSG(dispatch.numWorkgroups <= m_properties.maxWorkgroupCount, "Dispatch of "
+      << dispatch.numWorkgroups << " workgroups exceeds the device's limit of "
+      << m_properties.maxWorkgroupCount);
+  }
+
+  m_commands[m_nextCommands] = RecordedCommands{ dispatches, {} };
+  return m_nextCommands++;
+}
+
+void Vulkan::freeCommands(CommandsHandle commands) {
+  auto i = m_commands.find(commands);
+  ASSERT_MSG(i != m_commands.end(), "No commands with handle " << commands);
+
+  // Frames in flight may be running the command buffers
+  uint64_t computeValue = 0;
+  for (const auto& entry : m_submissions) {
+    if (entry.second.commands == commands) {
+      computeValue = std::max(computeValue, entry.second.computeValue);
+    }
+  }
+
+  if (computeValue > 0) {
+    waitForTimeline(m_computeTimeline, computeValue);
+  }
+
+  for (const auto& entry : i->second.commandBuffers) {
+    vkFreeCommandBuffers(m_device, m_commandPool, 1, &entry.second);
+  }
+  m_commands.erase(i);
+}
+
+void Vulkan::discardCommandBuffers(VkDescriptorSet descriptorSet) {
+  for (auto& entry : m_commands) {
+    auto& commandBuffers = entry.second.commandBuffers;
+
+    auto i = commandBuffers.find(descriptorSet);
+    if (i != commandBuffers.end()) {
+      vkFreeCommandBuffers(m_device, m_commandPool, 1, &i->second);
+      commandBuffers.erase(i);
+    }
+  }
+}
+
+VkCommandBuffer Vulkan::commandBuffer(RecordedCommands& recorded, VkDescriptorSet descriptorSet) {
+  auto i = recorded.commandBuffers.find(descriptorSet);
+  if (i != recorded.commandBuffers.end()) {
+    return i->second;
+  }
+
+  VkCommandBufferAllocateInfo allocInfo{};
+  allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocInfo.commandPool = m_commandPool;
+  allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocInfo.commandBufferCount = 1;
+
+  VkCommandBuffer commandBuffer;
+  VK_CHECK(vkAllocateCommandBuffers(m_device, &allocInfo, &commandBuffer),
+    "Failed to allocate command buffer");
+
+  recordCommandBuffer(commandBuffer, descriptorSet, recorded.dispatches);
+  recorded.commandBuffers[descriptorSet] = commandBuffer;
+
+  return commandBuffer;
+}
+
+uint64_t Vulkan::submitCommands(VkQueue queue, VkCommandBuffer commandBuffer,
+  const Timeline& wait, uint64_t waitValue, VkPipelineStageFlags waitStage, Timeline& signal) {
+
+  uint64_t signalValue = signal.value + 1;
+
+  VkTimelineSemaphoreSubmitInfo timelineInfo{};
+  timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timelineInfo.waitSemaphoreValueCount = waitValue > 0 ? 1 : 0;
+  timelineInfo.pWaitSemaphoreValues = &waitValue;
+  timelineInfo.signalSemaphoreValueCount = 1;
+  timelineInfo.pSignalSemaphoreValues = &signalValue;
 
   VkSubmitInfo submitInfo{};
   submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.pNext = &timelineInfo;
+  submitInfo.waitSemaphoreCount = waitValue > 0 ? 1 : 0;
+  submitInfo.pWaitSemaphores = &wait.semaphore;
+  submitInfo.pWaitDstStageMask = &waitStage;
   submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &m_commandBuffer;
+  submitInfo.pCommandBuffers = &commandBuffer;
+  submitInfo.signalSemaphoreCount = 1;
+  submitInfo.pSignalSemaphores = &signal.semaphore;
 
-  VK_CHECK(vkQueueSubmit(m_computeQueue, 1, &submitInfo, m_taskCompleteFence),
-    "Failed to submit compute command buffer");
+  VK_CHECK(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE),
+    "Failed to submit command buffer");
 
-  VK_CHECK(vkWaitForFences(m_device, 1, &m_taskCompleteFence, VK_TRUE, UINT64_MAX),
-    "Error waiting for fence");
+  signal.value = signalValue;
+  return signalValue;
+}
 
-  VK_CHECK(vkResetFences(m_device, 1, &m_taskCompleteFence), "Error resetting fence");
+void Vulkan::waitForTimeline(const Timeline& timeline, uint64_t value) {
+  VkSemaphoreWaitInfo waitInfo{};
+  waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+  waitInfo.semaphoreCount = 1;
+  waitInfo.pSemaphores = &timeline.semaphore;
+  waitInfo.pValues = &value;
+
+  VK_CHECK(m_waitSemaphores(m_device, &waitInfo, UINT64_MAX), "Error waiting for semaphore");
 }
 
-void Vulkan::retrieveBuffer(void* data) {
-//  VK_CHECK(vkDeviceWaitIdle(m_device), "Error waiting for device to be idle");
+// The upload is submitted to the transfer queue and the dispatches to the compute queue, which
+// waits for the transfer timeline to reach the upload's value. The download has to wait for the
+// dispatches, so it's held back until the next frame of any buffer has submitted its upload, or the
+// frame is retrieved; a transfer queue runs its submissions in order, so an earlier download would
+// stop the next upload overlapping with these dispatches. Nothing here waits on the host.
+FrameHandle Vulkan::submitFrame(BufferHandle handle, const std::vector<const void*>& data,
+  const std::vector<GpuBufferRange>& inputs, const std::vector<GpuBufferRange>& carried,
+  CommandsHandle commands, const std::vector<GpuBufferRange>& outputs) {
+
+  BufferSet& bufferSet = m_buffers.at(handle);
+  ASSERT_MSG(bufferSet.framesInFlight.size() < bufferSet.frames.size(), "Can't have more than "
+    << bufferSet.frames.size() << " frames of a buffer in flight");
+
+  RecordedCommands& recorded = m_commands.at(commands);
+
+  if (!hasBuffers(bufferSet)) {
+    EXCEPTION("Error submitting frame; Buffer has not been created yet");
+  }
+
+  // The oldest frame has been retrieved, if it was ever in flight
+  size_t index = bufferSet.nextFrame;
+  bufferSet.nextFrame = (bufferSet.nextFrame + 1) % bufferSet.frames.size();
+
+  Frame& frame = bufferSet.frames[index];
+
+  auto totalSize = [&](const std::vector<GpuBufferRange>& ranges) {
+    VkDeviceSize size = 0;
+    for (const GpuBufferRange& range : ranges) {
+      if (range.binding >= bufferSet.bindings.size()
+        || bufferSet.bindings[range.binding].buffers.empty()) {
+
+        EXCEPTION("Error submitting frame; Binding " << range.binding
+          << " has not been created yet");
+      }
+      DBG_ASSERT(range.offset + range.size <= frameBuffer(bufferSet, range.binding, index).size);
+
+      size += range.size;
+    }
+    return size;
+  };
+
+  VkDeviceSize inputsSize = totalSize(inputs);
+  VkDeviceSize outputsSize = totalSize(outputs);
+  // Only checks the carried ranges, which have no space in the staging buffer
+  totalSize(carried);
+
+  bool upload = (!inputs.empty() || !carried.empty()) && !m_zeroCopy;
+  bool download = !outputs.empty() && !m_zeroCopy;
+
+  // The frames in flight may still be reading the shared bindings, so inputs to those are written
+  // once the last frame submitted has finished its dispatches. That's also when the carried ranges
+  // have been written.
+  bool sharedInputs = std::any_of(inputs.begin(), inputs.end(),
+    [&bufferSet](const GpuBufferRange& range) {
+      return bufferSet.bindings[range.binding].shared;
+    });
+  uint64_t uploadWait = sharedInputs || !carried.empty() ? bufferSet.computeValue : 0;
+
+  // The frame isn't in flight, so its mapped buffers can be written straight away
+  if (m_zeroCopy) {
+    if (uploadWait > 0) {
+      waitForTimeline(m_computeTimeline, uploadWait);
+    }
+
+    size_t previous = (index + bufferSet.frames.size() - 1) % bufferSet.frames.size();
+    for (const GpuBufferRange& range : carried) {
+      memcpy(frameBuffer(bufferSet, range.binding, index).memory.mapped + range.offset,
+        frameBuffer(bufferSet, range.binding, previous).memory.mapped + range.offset, range.size);
+    }
 
-  if (m_buffer == VK_NULL_HANDLE) {
-    EXCEPTION("Error retrieving buffer; Buffer has not been created yet");
+    for (const GpuBufferRange& range : inputs) {
+      memcpy(frameBuffer(bufferSet, range.binding, index).memory.mapped + range.offset,
+        static_cast<const char*>(data[range.binding]) + range.offset, range.size);
+    }
   }
+  else {
+    reserveStagingBuffer(frame.staging, inputsSize + outputsSize);
+  }
+
+  uint64_t uploadValue = 0;
 
-  DBG_ASSERT(m_stagingBuffer != VK_NULL_HANDLE);
+  if (upload) {
+    VkDeviceSize stagingOffset = 0;
+    for (const GpuBufferRange& range : inputs) {
+      memcpy(frame.staging.memory.mapped + stagingOffset,
+        static_cast<const char*>(data[range.binding]) + range.offset, range.size);
+
+      stagingOffset += range.size;
+    }
 
-  copyBuffer(m_buffer, m_stagingBuffer, m_bufferSize);
+    std::vector<BufferCopies> copies = carryCopies(bufferSet, index, carried);
+    std::vector<BufferCopies> inputCopies = frameCopies(bufferSet, index, inputs, 0, true);
+    copies.insert(copies.end(), inputCopies.begin(), inputCopies.end());
+
+    recordCopies(frame.uploadCommands, copies);
+
+    uploadValue = submitCommands(m_transferQueue, frame.uploadCommands, m_computeTimeline,
+      uploadWait, VK_PIPELINE_STAGE_TRANSFER_BIT, m_transferTimeline);
+  }
 
-  void* stagingBufferMapped = nullptr;
-  vkMapMemory(m_device, m_stagingBufferMemory, 0, m_bufferSize, 0, &stagingBufferMapped);
-  memcpy(data, stagingBufferMapped, m_bufferSize);
-  vkUnmapMemory(m_device, m_stagingBufferMemory);
+  for (auto& entry : m_submissions) {
+    submitDownload(entry.second);
+  }
+
+  Submission submission;
+  submission.buffer = handle;
+  submission.frame = index;
+  submission.commands = commands;
+  submission.outputs = outputs;
+  submission.outputsOffset = inputsSize;
+  submission.computeValue = submitCommands(m_computeQueue,
+    commandBuffer(recorded, frame.descriptorSet), m_transferTimeline, uploadValue,
+    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, m_computeTimeline);
+  submission.downloadValue = 0;
+  submission.download = download;
+  submission.downloadPending = download;
+
+  bufferSet.computeValue = submission.computeValue;
+
+  FrameHandle frameHandle = m_nextFrame++;
+
+  m_submissions[frameHandle] = submission;
+  bufferSet.framesInFlight.push_back(frameHandle);
+
+  return frameHandle;
+}
+
+void Vulkan::submitDownload(Submission& submission) {
+  if (!submission.downloadPending) {
+    return;
+  }
+
+  const BufferSet& bufferSet = m_buffers.at(submission.buffer);
+  const Frame& frame = bufferSet.frames[submission.frame];
+
+  recordCopies(frame.downloadCommands, frameCopies(bufferSet, submission.frame, submission.outputs,
+    submission.outputsOffset, false));
+
+  submission.downloadValue = submitCommands(m_transferQueue, frame.downloadCommands,
+    m_computeTimeline, submission.computeValue, VK_PIPELINE_STAGE_TRANSFER_BIT,
+    m_transferTimeline);
+
+  submission.downloadPending = false;
 }
 
-VkPipeline Vulkan::currentPipeline() const {
-  return m_pipelines.at(m_currentPipelineIdx);
+// Any download is left pending, so the time taken here is just the time left on the dispatches
+void Vulkan::waitForFrame(FrameHandle frame) {
+  auto i = m_submissions.find(frame);
+  ASSERT_MSG(i != m_submissions.end(), "Frame " << frame << " isn't in flight");
+
+  waitForTimeline(m_computeTimeline, i->second.computeValue);
+}
+
+void Vulkan::retrieveFrame(FrameHandle frameHandle, const std::vector<void*>& data) {
+  auto i = m_submissions.find(frameHandle);
+  ASSERT_MSG(i != m_submissions.end(), "Frame " << frameHandle << " isn't in flight");
+
+  Submission& submission = i->second;
+  BufferSet& bufferSet = m_buffers.at(submission.buffer);
+
+  ASSERT_MSG(bufferSet.framesInFlight.front() == frameHandle,
+    "A buffer's frames must be retrieved in the order they were submitted");
+
+  submitDownload(submission);
+
+  if (submission.download) {
+    waitForTimeline(m_transferTimeline, submission.downloadValue);
+  }
+  else {
+    waitForTimeline(m_computeTimeline, submission.computeValue);
+  }
+
+  const Frame& frame = bufferSet.frames[submission.frame];
+
+  VkDeviceSize stagingOffset = submission.outputsOffset;
+  for (const GpuBufferRange& range : submission.outputs) {
+    const char* src = m_zeroCopy
+      ? frameBuffer(bufferSet, range.binding, submission.frame).memory.mapped + range.offset
+      : frame.staging.memory.mapped + stagingOffset;
+
+    memcpy(static_cast<char*>(data[range.binding]) + range.offset, src, range.size);
+
+    stagingOffset += range.size;
+  }
+
+  bufferSet.framesInFlight.pop_front();
+  m_submissions.erase(i);
 }
 
 void Vulkan::checkValidationLayerSupport() const {
@@ -244,8 +1053,9 @@ void Vulkan::checkValidationLayerSupport() const {
 
 VKAPI_ATTR VkBool32 VKAPI_CALL Vulkan::debugCallback(
   VkDebugUtilsMessageSeverityFlagBitsEXT, VkDebugUtilsMessageTypeFlagsEXT,
-  const VkDebugUtilsMessengerCallbackDataEXT* data, void*) {
+  const VkDebugUtilsMessengerCallbackDataEXT* data, void* userData) {
 
+  ++*static_cast<std::atomic<uint32_t>*>(userData);
   std::cerr << "Validation layer: " << data->pMessage << std::endl;
 
   return VK_FALSE;
@@ -254,14 +1064,15 @@ VKAPI_ATTR VkBool32 VKAPI_CALL Vulkan::debugCallback(
 VkDebugUtilsMessengerCreateInfoEXT Vulkan::getDebugMessengerCreateInfo() const {
   VkDebugUtilsMessengerCreateInfoEXT createInfo{};
   createInfo.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
-  createInfo.messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT
-                             | VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT
+  // Verbose and info messages are diagnostics from the loader and layers, not problems, so a clean
+  // run prints nothing
+  createInfo.messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT
                              | VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
   createInfo.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT
                          | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT
                          | VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
   createInfo.pfnUserCallback = debugCallback;
-  createInfo.pUserData = nullptr;
+  createInfo.pUserData = &m_validationMessages;
   return createInfo;
 }
 
@@ -303,6 +1114,136 @@ void Vulkan::pickPhysicalDevice() {
   m_physicalDevice = devices[0];
 }
 
+// The device is identified by its UUID where Vulkan 1.1 is available, and otherwise by its pipeline
+// cache UUID, which also changes with the driver
+void Vulkan::queryDeviceFeatures() {
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(m_physicalDevice, &properties);
+
+  m_apiVersion = std::min(m_apiVersion, properties.apiVersion);
+
+  if (!supportsTimelineSemaphores()) {
+    EXCEPTION("Device doesn't support timeline semaphores");
+  }
+
+  const VkPhysicalDeviceLimits& limits = properties.limits;
+
+  m_properties.maxWorkgroupSize = std::min(limits.maxComputeWorkGroupSize[0],
+    limits.maxComputeWorkGroupInvocations);
+  m_properties.maxSharedMemory = limits.maxComputeSharedMemorySize;
+  m_properties.maxBufferSize = limits.maxStorageBufferRange;
+  m_properties.maxWorkgroupCount = limits.maxComputeWorkGroupCount[0];
+
+  VkPhysicalDeviceFeatures features;
+  vkGetPhysicalDeviceFeatures(m_physicalDevice, &features);
+
+  // Shaders index the array of bindings with a computed index unless there's only one binding
+  m_properties.maxBufferBindings = features.shaderStorageBufferArrayDynamicIndexing
+    ? std::min<size_t>(MaxBufferBindings, limits.maxPerStageDescriptorStorageBuffers) : 1;
+  m_properties.subgroupSize = 0;
+  m_properties.subgroupArithmetic = false;
+
+  const uint8_t* uuid = properties.pipelineCacheUUID;
+
+  VkPhysicalDeviceIDProperties idProperties{};
+  idProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+
+  if (m_apiVersion >= VK_API_VERSION_1_1) {
+    VkPhysicalDeviceSubgroupProperties subgroupProperties{};
+    subgroupProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+    subgroupProperties.pNext = &idProperties;
+
+    VkPhysicalDeviceProperties2 properties2{};
+    properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties2.pNext = &subgroupProperties;
+
+    vkGetPhysicalDeviceProperties2(m_physicalDevice, &properties2);
+
+    m_properties.subgroupSize = subgroupProperties.subgroupSize;
+    m_properties.subgroupArithmetic =
+      (subgroupProperties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT)
+      && (subgroupProperties.supportedOperations & VK_SUBGROUP_FEATURE_ARITHMETIC_BIT);
+
+    uuid = idProperties.deviceUUID;
+  }
+
+  m_zeroCopy = m_zeroCopy && supportsZeroCopy();
+  m_properties.zeroCopy = m_zeroCopy;
+
+  std::stringstream deviceId;
+  deviceId << std::hex << std::setfill('0');
+  for (size_t i = 0; i < VK_UUID_SIZE; ++i) {
+    deviceId << std::setw(2) << static_cast<unsigned int>(uuid[i]);
+  }
+  m_properties.deviceId = deviceId.str();
+}
+
+// Where the device has a small window of host visible device memory rather than all of it, as
+// discrete GPUs without resizable BAR do, the window is in a heap of its own. It's too small to be
+// worth using, so only host visible memory in the largest device local heap counts.
+bool Vulkan::supportsZeroCopy() const {
+  VkPhysicalDeviceMemoryProperties memoryProperties;
+  vkGetPhysicalDeviceMemoryProperties(m_physicalDevice, &memoryProperties);
+
+  uint32_t largestHeap = 0;
+  VkDeviceSize largestHeapSize = 0;
+
+  for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; ++i) {
+    const VkMemoryHeap& heap = memoryProperties.memoryHeaps[i];
+
+    if ((heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) && heap.size > largestHeapSize) {
+      largestHeap = i;
+      largestHeapSize = heap.size;
+    }
+  }
+
+  for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; ++i) {
+    const VkMemoryType& type = memoryProperties.memoryTypes[i];
+
+    // The allocator uses the first suitable type too
+    if ((type.propertyFlags & ZeroCopyMemory) == ZeroCopyMemory) {
+      return type.heapIndex == largestHeap;
+    }
+  }
+
+  return false;
+}
+
+// Timeline semaphores are core in Vulkan 1.2 and an extension of Vulkan 1.1
+bool Vulkan::supportsTimelineSemaphores() const {
+  if (m_apiVersion < VK_API_VERSION_1_1) {
+    return false;
+  }
+
+  if (m_apiVersion < VK_API_VERSION_1_2) {
+    uint32_t extensionCount = 0;
+    VK_CHECK(vkEnumerateDeviceExtensionProperties(m_physicalDevice, nullptr, &extensionCount,
+      nullptr), "Failed to enumerate device extensions");
+
+    std::vector<VkExtensionProperties> extensions(extensionCount);
+    VK_CHECK(vkEnumerateDeviceExtensionProperties(m_physicalDevice, nullptr, &extensionCount,
+      extensions.data()), "Failed to enumerate device extensions");
+
+    auto fnMatches = [](const VkExtensionProperties& p) {
+      return strcmp(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME, p.extensionName) == 0;
+    };
+    if (std::find_if(extensions.begin(), extensions.end(), fnMatches) == extensions.end()) {
+      return false;
+    }
+  }
+
+  VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures{};
+  timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+
+  VkPhysicalDeviceFeatures2 features{};
+  features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  features.pNext = &timelineFeatures;
+
+  vkGetPhysicalDeviceFeatures2(m_physicalDevice, &features);
+
+  return timelineFeatures.timelineSemaphore;
+}
+
 uint32_t Vulkan::findComputeQueueFamily() const {
   uint32_t queueFamilyCount = 0;
   vkGetPhysicalDeviceQueueFamilyProperties(m_physicalDevice, &queueFamilyCount, nullptr);
@@ -320,23 +1261,70 @@ uint32_t Vulkan::findComputeQueueFamily() const {
   EXCEPTION("Could not find compute queue family");
 }
 
+// A queue family that can only transfer is usually the device's copy engines, which run alongside
+// its compute units. Without one, transfers share the compute queue.
+uint32_t Vulkan::findTransferQueueFamily() const {
+  uint32_t queueFamilyCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(m_physicalDevice, &queueFamilyCount, nullptr);
+
+  std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+  vkGetPhysicalDeviceQueueFamilyProperties(m_physicalDevice, &queueFamilyCount,
+    queueFamilies.data());
+
+  for (uint32_t i = 0; i < queueFamilies.size(); ++i) {
+    VkQueueFlags flags = queueFamilies[i].queueFlags;
+
+    if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & VK_QUEUE_COMPUTE_BIT)
+      && !(flags & VK_QUEUE_GRAPHICS_BIT)) {
+
+      return i;
+    }
+  }
+
+  return findComputeQueueFamily();
+}
+
 void Vulkan::createLogicalDevice() {
-  VkDeviceQueueCreateInfo queueCreateInfo{};
+  m_computeQueueFamily = findComputeQueueFamily();
+  m_transferQueueFamily = findTransferQueueFamily();
 
-  queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-  queueCreateInfo.queueFamilyIndex = findComputeQueueFamily();
-  queueCreateInfo.queueCount = 1;
   float queuePriority = 1;
-  queueCreateInfo.pQueuePriorities = &queuePriority;
+  std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
+
+  for (uint32_t family : { m_computeQueueFamily, m_transferQueueFamily }) {
+    if (!queueCreateInfos.empty() && family == queueCreateInfos.back().queueFamilyIndex) {
+      continue;
+    }
+
+    VkDeviceQueueCreateInfo queueCreateInfo{};
+    queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queueCreateInfo.queueFamilyIndex = family;
+    queueCreateInfo.queueCount = 1;
+    queueCreateInfo.pQueuePriorities = &queuePriority;
+
+    queueCreateInfos.push_back(queueCreateInfo);
+  }
 
   VkPhysicalDeviceFeatures deviceFeatures{};
+  deviceFeatures.shaderStorageBufferArrayDynamicIndexing = m_properties.maxBufferBindings > 1;
+
+  VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures{};
+  timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+  timelineFeatures.timelineSemaphore = VK_TRUE;
+
+  std::vector<const char*> extensions;
+  if (m_apiVersion < VK_API_VERSION_1_2) {
+    extensions.push_back(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+  }
 
   VkDeviceCreateInfo createInfo{};
   createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-  createInfo.queueCreateInfoCount = 1;
-  createInfo.pQueueCreateInfos = &queueCreateInfo;
+  createInfo.pNext = &timelineFeatures;
+  createInfo.queueCreateInfoCount = queueCreateInfos.size();
+  createInfo.pQueueCreateInfos = queueCreateInfos.data();
   createInfo.pEnabledFeatures = &deviceFeatures;
-  createInfo.enabledExtensionCount = 0;
+  createInfo.enabledExtensionCount = extensions.size();
+  createInfo.ppEnabledExtensionNames = extensions.data();
 
 #ifdef NDEBUG
   createInfo.enabledLayerCount = 0;
@@ -348,83 +1336,84 @@ void Vulkan::createLogicalDevice() {
   VK_CHECK(vkCreateDevice(m_physicalDevice, &createInfo, nullptr, &m_device),
     "Failed to create logical device");
 
-  vkGetDeviceQueue(m_device, queueCreateInfo.queueFamilyIndex, 0, &m_computeQueue);
+  vkGetDeviceQueue(m_device, m_computeQueueFamily, 0, &m_computeQueue);
+  vkGetDeviceQueue(m_device, m_transferQueueFamily, 0, &m_transferQueue);
+
+  const char* waitSemaphores = m_apiVersion >= VK_API_VERSION_1_2 ? "vkWaitSemaphores"
+                                                                  : "vkWaitSemaphoresKHR";
+
+  m_waitSemaphores = reinterpret_cast<PFN_vkWaitSemaphores>(
+    vkGetDeviceProcAddr(m_device, waitSemaphores));
+  if (m_waitSemaphores == nullptr) {
+    EXCEPTION("Error getting pointer to " << waitSemaphores << "()");
+  }
 }
 
-void Vulkan::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
+void Vulkan::recordCopies(VkCommandBuffer commandBuffer, const std::vector<BufferCopies>& copies) {
+  VkCommandBufferBeginInfo beginInfo{};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+  VK_CHECK(vkBeginCommandBuffer(commandBuffer, &beginInfo),
+    "Failed to begin recording command buffer");
+
+  for (const BufferCopies& copy : copies) {
+    vkCmdCopyBuffer(commandBuffer, copy.src, copy.dst, copy.regions.size(), copy.regions.data());
+  }
+
+  VK_CHECK(vkEndCommandBuffer(commandBuffer), "Failed to record command buffer");
+}
+
+void Vulkan::copyBuffers(const std::vector<BufferCopies>& copies) {
   VkCommandBufferAllocateInfo allocInfo{};
   allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
   allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  allocInfo.commandPool = m_commandPool; // TODO: Separate pool for temp buffers?
+  allocInfo.commandPool = m_transferCommandPool;
   allocInfo.commandBufferCount = 1;
-  
+
   VkCommandBuffer commandBuffer;
-  vkAllocateCommandBuffers(m_device, &allocInfo, &commandBuffer);
-  
-  VkCommandBufferBeginInfo beginInfo{};
-  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VK_CHECK(vkAllocateCommandBuffers(m_device, &allocInfo, &commandBuffer),
+    "Failed to allocate command buffer");
 
-  vkBeginCommandBuffer(commandBuffer, &beginInfo);
-  
-  VkBufferCopy copyRegion{};
-  copyRegion.srcOffset = 0;
-  copyRegion.dstOffset = 0;
-  copyRegion.size = size;
-  vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
-  
-  vkEndCommandBuffer(commandBuffer);
+  recordCopies(commandBuffer, copies);
 
-  VkSubmitInfo submitInfo{};
-  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &commandBuffer;
-  
-  vkQueueSubmit(m_computeQueue, 1, &submitInfo, VK_NULL_HANDLE);
-  vkQueueWaitIdle(m_computeQueue); // Use fence if doing multiple transfers simultaneously
-  
-  vkFreeCommandBuffers(m_device, m_commandPool, 1, &commandBuffer);
+  uint64_t value = submitCommands(m_transferQueue, commandBuffer, m_computeTimeline, 0,
+    VK_PIPELINE_STAGE_TRANSFER_BIT, m_transferTimeline);
+
+  waitForTimeline(m_transferTimeline, value);
+
+  vkFreeCommandBuffers(m_device, m_transferCommandPool, 1, &commandBuffer);
 }
 
-void Vulkan::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
-  VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory) const {
+void Vulkan::allocateBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
+  VkMemoryPropertyFlags properties, VkBuffer& buffer, MemoryAllocator::Allocation& bufferMemory) {
 
   VkBufferCreateInfo bufferInfo{};
   bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
   bufferInfo.size = size;
   bufferInfo.usage = usage;
-  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
   bufferInfo.flags = 0;
 
-  VK_CHECK(vkCreateBuffer(m_device, &bufferInfo, nullptr, &buffer), "Failed to create buffer");
-
-  auto findMemoryType = [this, properties](uint32_t typeFilter) {
-    VkPhysicalDeviceMemoryProperties memProperties;
-    vkGetPhysicalDeviceMemoryProperties(m_physicalDevice, &memProperties);
-
-    for (uint32_t i = 0; i < memProperties.memoryTypeCount; ++i) {
-      if (typeFilter & (1 << i) &&
-        (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
-
-        return i;
-      }
-    }
+  // Buffers are used by both queues, if they're from different families
+  uint32_t queueFamilies[] = { m_computeQueueFamily, m_transferQueueFamily };
+  if (m_computeQueueFamily != m_transferQueueFamily) {
+    bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+    bufferInfo.queueFamilyIndexCount = 2;
+    bufferInfo.pQueueFamilyIndices = queueFamilies;
+  }
+  else {
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  }
 
-    EXCEPTION("Failed to find suitable memory type");
-  };
+  VK_CHECK(vkCreateBuffer(m_device, &bufferInfo, nullptr, &buffer), "Failed to create buffer");
 
   VkMemoryRequirements memRequirements;
   vkGetBufferMemoryRequirements(m_device, buffer, &memRequirements);
 
-  VkMemoryAllocateInfo allocInfo{};
-  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocInfo.allocationSize = memRequirements.size;
-  allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits);
-
-  VK_CHECK(vkAllocateMemory(m_device, &allocInfo, nullptr, &bufferMemory),
-    "Failed to allocate memory for buffer");
+  bufferMemory = m_allocator->allocate(memRequirements, properties);
 
-  vkBindBufferMemory(m_device, buffer, bufferMemory, 0);
+  VK_CHECK(vkBindBufferMemory(m_device, buffer, bufferMemory.memory, bufferMemory.offset),
+    "Failed to bind buffer memory");
 }
 
 void Vulkan::createVulkanInstance() {
@@ -438,7 +1427,19 @@ void Vulkan::createVulkanInstance() {
   appInfo.applicationVersion = VK_MAKE_API_VERSION(1, 0, 0, 0);
   appInfo.pEngineName = "No Engine";
   appInfo.engineVersion = VK_MAKE_API_VERSION(1, 0, 0, 0);
-  appInfo.apiVersion = VK_API_VERSION_1_0;
+  // Vulkan 1.2 is used where available for timeline semaphores, and 1.1 at least for subgroup
+  // operations and the timeline semaphore extension. A 1.0 loader doesn't have
+  // vkEnumerateInstanceVersion() and fails to create an instance that asks for more.
+  auto enumerateInstanceVersion = reinterpret_cast<PFN_vkEnumerateInstanceVersion>(
+    vkGetInstanceProcAddr(VK_NULL_HANDLE, "vkEnumerateInstanceVersion"));
+
+  uint32_t instanceVersion = VK_API_VERSION_1_0;
+  if (enumerateInstanceVersion != nullptr) {
+    VK_CHECK(enumerateInstanceVersion(&instanceVersion), "Failed to get instance version");
+  }
+  m_apiVersion = std::min<uint32_t>(instanceVersion, VK_API_VERSION_1_2);
+
+  appInfo.apiVersion = m_apiVersion;
 
   VkInstanceCreateInfo createInfo{};
   createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -465,27 +1466,100 @@ void Vulkan::createVulkanInstance() {
 void Vulkan::createCommandPool() {
   VkCommandPoolCreateInfo poolInfo{};
   poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-  poolInfo.queueFamilyIndex = findComputeQueueFamily();
+  poolInfo.queueFamilyIndex = m_computeQueueFamily;
   poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
 
   VK_CHECK(vkCreateCommandPool(m_device, &poolInfo, nullptr, &m_commandPool),
     "Failed to create command pool");
+
+  poolInfo.queueFamilyIndex = m_transferQueueFamily;
+
+  VK_CHECK(vkCreateCommandPool(m_device, &poolInfo, nullptr, &m_transferCommandPool),
+    "Failed to create transfer command pool");
 }
 
-void Vulkan::createCommandBuffer() {
-  VkCommandBufferAllocateInfo allocInfo{};
-  allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-  allocInfo.commandPool = m_commandPool;
-  allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  allocInfo.commandBufferCount = 1;
+// Loads the device's pipeline cache from disk if one was saved by a previous run. Data saved for a
+// different device or driver is discarded.
+void Vulkan::createPipelineCache() {
+  std::vector<char> data = readFile(PipelineCacheFile);
 
-  VK_CHECK(vkAllocateCommandBuffers(m_device, &allocInfo, &m_commandBuffer),
-    "Failed to allocate command buffer");
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(m_physicalDevice, &properties);
+
+  // The header is the header size, the header version, the vendor and device IDs and the cache UUID
+  const size_t headerSize = 4 * sizeof(uint32_t) + VK_UUID_SIZE;
+  uint32_t header[4];
+
+  if (data.size() >= headerSize) {
+    memcpy(header, data.data(), sizeof(header));
+  }
+
+  if (data.size() < headerSize
+    || header[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+    || header[2] != properties.vendorID
+    || header[3] != properties.deviceID
+    || memcmp(data.data() + sizeof(header), properties.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+
+    data.clear();
+  }
+
+  VkPipelineCacheCreateInfo cacheInfo{};
+  cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  cacheInfo.initialDataSize = data.size();
+  cacheInfo.pInitialData = data.empty() ? nullptr : data.data();
+
+  VK_CHECK(vkCreatePipelineCache(m_device, &cacheInfo, nullptr, &m_pipelineCache),
+    "Failed to create pipeline cache");
+}
+
+void Vulkan::savePipelineCache() const {
+  size_t size = 0;
+  if (vkGetPipelineCacheData(m_device, m_pipelineCache, &size, nullptr) != VK_SUCCESS) {
+    return;
+  }
+
+  std::vector<char> data(size);
+  if (vkGetPipelineCacheData(m_device, m_pipelineCache, &size, data.data()) != VK_SUCCESS) {
+    return;
+  }
+
+  writeCacheFile(PipelineCacheFile, data.data(), size);
 }
 
-VkShaderModule Vulkan::createShaderModule(const std::string& source) const {
-  shaderc::Compiler compiler;
+// Compiled code is cached on disk, keyed by a hash of the source, the compiler's SPIR-V version and
+// the target Vulkan version, so shaderc only runs for shaders that haven't been compiled before.
+// Safe to call from several threads at once.
+std::vector<uint32_t> Vulkan::compileGlsl(const std::string& source) const {
+  unsigned int spirvVersion = 0;
+  unsigned int spirvRevision = 0;
+  shaderc_get_spv_version(&spirvVersion, &spirvRevision);
+
+  bool vulkan11 = m_apiVersion >= VK_API_VERSION_1_1;
+
+  std::stringstream key;
+  key << "spirv " << spirvVersion << "." << spirvRevision << " vulkan "
+    << (vulkan11 ? "1.1" : "1.0") << std::endl << source;
+
+  std::stringstream fileName;
+  fileName << std::hex << hashString(key.str()) << ".spv";
+  std::filesystem::path path = SpirvCacheDirectory / fileName.str();
+
+  std::vector<char> cached = readFile(path);
+  if (cached.size() >= sizeof(uint32_t) && cached.size() % sizeof(uint32_t) == 0) {
+    std::vector<uint32_t> code(cached.size() / sizeof(uint32_t));
+    memcpy(code.data(), cached.data(), cached.size());
+
+    if (code[0] == SpirvMagicNumber) {
+      return code;
+    }
+  }
+
+  // A compiler can't be shared between threads
+  thread_local shaderc::Compiler compiler;
   shaderc::CompileOptions options;
+  // Subgroup operations need SPIR-V 1.3, which comes with Vulkan 1.1
+  options.SetTargetEnvironment(shaderc_target_env_vulkan,
+    vulkan11 ? shaderc_env_version_vulkan_1_1 : shaderc_env_version_vulkan_1_0);
   auto result = compiler.CompileGlslToSpv(source, shaderc_shader_kind::shaderc_glsl_compute_shader,
     "shader", options);
 
@@ -496,6 +1570,12 @@ VkShaderModule Vulkan::createShaderModule(const std::string& source) const {
   std::vector<uint32_t> code;
   code.assign(result.cbegin(), result.cend());
 
+  writeCacheFile(path, code.data(), code.size() * sizeof(uint32_t));
+
+  return code;
+}
+
+VkShaderModule Vulkan::createShaderModule(const std::vector<uint32_t>& code) const {
   VkShaderModuleCreateInfo createInfo{};
   createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
   createInfo.codeSize = code.size() * sizeof(uint32_t);
@@ -512,7 +1592,7 @@ void Vulkan::createDescriptorSetLayout() {
   VkDescriptorSetLayoutBinding layoutBinding{};
   layoutBinding.binding = 0;
   layoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-  layoutBinding.descriptorCount = 1;
+  layoutBinding.descriptorCount = m_properties.maxBufferBindings;
   layoutBinding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
   layoutBinding.pImmutableSamplers = nullptr;
 
@@ -525,48 +1605,58 @@ void Vulkan::createDescriptorSetLayout() {
     "Failed to create descriptor set layout");
 }
 
+// Has a descriptor set for each frame of as many buffers as there can be
 void Vulkan::createDescriptorPool() {
+  const size_t maxSets = MaxGpuBuffers * FramesInFlight;
+
   VkDescriptorPoolSize poolSize{};
   poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-  poolSize.descriptorCount = 1;
+  poolSize.descriptorCount = m_properties.maxBufferBindings * maxSets;
 
   VkDescriptorPoolCreateInfo poolInfo{};
   poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
   poolInfo.poolSizeCount = 1;
   poolInfo.pPoolSizes = &poolSize;
-  poolInfo.maxSets = 1;
+  poolInfo.maxSets = maxSets;
 
   VK_CHECK(vkCreateDescriptorPool(m_device, &poolInfo, nullptr, &m_descriptorPool),
     "Failed to create descriptor pool");
 }
 
-void Vulkan::createDescriptorSets() {
-  VkDescriptorSetAllocateInfo allocInfo{};
-  allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-  allocInfo.descriptorPool = m_descriptorPool;
-  allocInfo.descriptorSetCount = 1;
-  allocInfo.pSetLayouts = &m_descriptorSetLayout;
-
-  VK_CHECK(vkAllocateDescriptorSets(m_device, &allocInfo, &m_descriptorSet),
-    "Failed to allocate descriptor set");
-
-  VkDescriptorBufferInfo bufferInfo{};
-  bufferInfo.buffer = m_buffer;
-  bufferInfo.offset = 0;
-  bufferInfo.range = m_bufferSize;
-
-  VkWriteDescriptorSet descriptorWrite{};
-  descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-  descriptorWrite.dstSet = m_descriptorSet;
-  descriptorWrite.dstBinding = 0;
-  descriptorWrite.dstArrayElement = 0;
-  descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-  descriptorWrite.descriptorCount = 1;
-  descriptorWrite.pBufferInfo = &bufferInfo;
-  descriptorWrite.pImageInfo = nullptr;
-  descriptorWrite.pTexelBufferView = nullptr;
+// Binds the whole of each of a frame's device buffers, so its set only changes when one is
+// recreated. Every element of the array has to be valid, so any that haven't been submitted get
+// binding 0's.
+void Vulkan::updateDescriptorSets(BufferSet& buffer) {
+  for (size_t f = 0; f < buffer.frames.size(); ++f) {
+    Frame& frame = buffer.frames[f];
+    std::vector<VkDescriptorBufferInfo> bufferInfos(m_properties.maxBufferBindings);
+
+    for (size_t i = 0; i < bufferInfos.size(); ++i) {
+      bool submitted = i < buffer.bindings.size() && !buffer.bindings[i].buffers.empty()
+        && frameBuffer(buffer, i, f).buffer != VK_NULL_HANDLE;
+
+      bufferInfos[i].buffer = frameBuffer(buffer, submitted ? i : 0, f).buffer;
+      bufferInfos[i].offset = 0;
+      bufferInfos[i].range = VK_WHOLE_SIZE;
+    }
 
-  vkUpdateDescriptorSets(m_device, 1, &descriptorWrite, 0, nullptr);
+    VkWriteDescriptorSet descriptorWrite{};
+    descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrite.dstSet = frame.descriptorSet;
+    descriptorWrite.dstBinding = 0;
+    descriptorWrite.dstArrayElement = 0;
+    descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    descriptorWrite.descriptorCount = bufferInfos.size();
+    descriptorWrite.pBufferInfo = bufferInfos.data();
+    descriptorWrite.pImageInfo = nullptr;
+    descriptorWrite.pTexelBufferView = nullptr;
+
+    vkUpdateDescriptorSets(m_device, 1, &descriptorWrite, 0, nullptr);
+
+    // Updating the set invalidates the command buffers that bind it
+    discardCommandBuffers(frame.descriptorSet);
+  }
 }
 
 void Vulkan::createPipelineLayout() { 
@@ -574,13 +1664,32 @@ void Vulkan::createPipelineLayout() {
   pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
   pipelineLayoutInfo.setLayoutCount = 1;
   pipelineLayoutInfo.pSetLayouts = &m_descriptorSetLayout;
-  pipelineLayoutInfo.pushConstantRangeCount = 0;
-  pipelineLayoutInfo.pPushConstantRanges = nullptr;
+  VkPushConstantRange pushConstantRange{};
+  pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  pushConstantRange.offset = 0;
+  pushConstantRange.size = MaxDispatchParameters * sizeof(uint32_t);
+
+  pipelineLayoutInfo.pushConstantRangeCount = 1;
+  pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
   VK_CHECK(vkCreatePipelineLayout(m_device, &pipelineLayoutInfo, nullptr, &m_pipelineLayout),
     "Failed to create pipeline layout");
 }
 
-void Vulkan::recordCommandBuffer(VkCommandBuffer commandBuffer, size_t numWorkgroups) {
+// Makes the writes of the stages in srcStage visible to the accesses of those in dstStage
+void memoryBarrier(VkCommandBuffer commandBuffer, VkPipelineStageFlags srcStage,
+  VkAccessFlags srcAccess, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+
+  VkMemoryBarrier barrier{};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = srcAccess;
+  barrier.dstAccessMask = dstAccess;
+
+  vkCmdPipelineBarrier(commandBuffer, srcStage, dstStage, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void Vulkan::recordCommandBuffer(VkCommandBuffer commandBuffer, VkDescriptorSet descriptorSet,
+  const std::vector<GpuDispatch>& dispatches) {
+
   VkCommandBufferBeginInfo beginInfo{};
   beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
   beginInfo.flags = 0;
@@ -589,21 +1698,62 @@ void Vulkan::recordCommandBuffer(VkCommandBuffer commandBuffer, size_t numWorkgr
   VK_CHECK(vkBeginCommandBuffer(commandBuffer, &beginInfo),
     "Failed to begin recording command buffer");
 
-  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, currentPipeline());
+  // Uploads are made by earlier submissions, as are the writes of earlier frames' dispatches to
+  // shared bindings
+  memoryBarrier(commandBuffer,
+    VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+    VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+    VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+
   vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipelineLayout, 0, 1,
-    &m_descriptorSet, 0, 0);
-  vkCmdDispatch(commandBuffer, numWorkgroups, 1, 1);
+    &descriptorSet, 0, 0);
+
+  for (size_t i = 0; i < dispatches.size(); ++i) {
+    const GpuDispatch& dispatch = dispatches[i];
+
+    if (i > 0) {
+      memoryBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+    }
+
+    if (i == 0 || dispatch.shader != dispatches[i - 1].shader) {
+      vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+        m_pipelines.at(dispatch.shader));
+    }
+
+    if (!dispatch.parameters.empty()) {
+      DBG_ASSERT(dispatch.parameters.size() <= MaxDispatchParameters);
+
+      vkCmdPushConstants(commandBuffer, m_pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0,
+        dispatch.parameters.size() * sizeof(uint32_t), dispatch.parameters.data());
+    }
+
+    vkCmdDispatch(commandBuffer, dispatch.numWorkgroups, 1, 1);
+  }
+
+  // For retrievals, which read mapped device buffers directly in zero-copy mode
+  memoryBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+    VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_HOST_BIT,
+    VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_HOST_READ_BIT);
 
   VK_CHECK(vkEndCommandBuffer(commandBuffer), "Failed to record command buffer");
 }
 
 void Vulkan::createSyncObjects() {
-  VkFenceCreateInfo fenceInfo{};
-  fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-  fenceInfo.flags = 0;
-
-  VK_CHECK(vkCreateFence(m_device, &fenceInfo, nullptr, &m_taskCompleteFence),
-    "Failed to create fence");
+  VkSemaphoreTypeCreateInfo typeInfo{};
+  typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+  typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+  typeInfo.initialValue = 0;
+
+  VkSemaphoreCreateInfo semaphoreInfo{};
+  semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  semaphoreInfo.pNext = &typeInfo;
+
+  for (Timeline* timeline : { &m_transferTimeline, &m_computeTimeline }) {
+    VK_CHECK(vkCreateSemaphore(m_device, &semaphoreInfo, nullptr, &timeline->semaphore),
+      "Failed to create semaphore");
+  }
 }
 
 void Vulkan::destroyDebugMessenger() {
@@ -613,25 +1763,39 @@ void Vulkan::destroyDebugMessenger() {
 }
 
 Vulkan::~Vulkan() {
-  vkDestroyFence(m_device, m_taskCompleteFence, nullptr);
+  // Frames may still be in flight
+  vkDeviceWaitIdle(m_device);
+
+  vkDestroySemaphore(m_device, m_transferTimeline.semaphore, nullptr);
+  vkDestroySemaphore(m_device, m_computeTimeline.semaphore, nullptr);
+  for (auto& entry : m_buffers) {
+    destroyBufferSet(entry.second);
+  }
+  destroyStagingBuffer(m_staging);
   vkDestroyCommandPool(m_device, m_commandPool, nullptr);
+  vkDestroyCommandPool(m_device, m_transferCommandPool, nullptr);
   for (VkPipeline pipeline : m_pipelines) {
     vkDestroyPipeline(m_device, pipeline, nullptr);
   }
+  savePipelineCache();
+  vkDestroyPipelineCache(m_device, m_pipelineCache, nullptr);
   vkDestroyPipelineLayout(m_device, m_pipelineLayout, nullptr);
-  destroyBuffer();
-  destroyStagingBuffer();
+  m_allocator.reset();
   vkDestroyDescriptorPool(m_device, m_descriptorPool, nullptr);
   vkDestroyDescriptorSetLayout(m_device, m_descriptorSetLayout, nullptr);
+  // Destroy the device first so objects it still owns are reported as leaks
+  vkDestroyDevice(m_device, nullptr);
 #ifndef NDEBUG
   destroyDebugMessenger();
+  if (m_validationMessages > 0) {
+    std::cerr << "Validation layer reported " << m_validationMessages << " messages" << std::endl;
+  }
 #endif
-  vkDestroyDevice(m_device, nullptr);
   vkDestroyInstance(m_instance, nullptr);
 }
 
 }
 
-GpuPtr createGpu() {
-  return std::make_unique<Vulkan>();
+GpuPtr createGpu(bool allowZeroCopy) {
+  return std::make_unique<Vulkan>(allowZeroCopy);
 }
@@ -0,0 +1,129 @@
+#include "free_list.hpp"
+#include <gtest/gtest.h>
+
+namespace {
+
+using Ranges = std::map<uint64_t, uint64_t>;
+
+}
+
+TEST(FreeListTest, allocatesFromTheStart) {
+  FreeList list(1024);
+
+  uint64_t offset = 1;
+  ASSERT_TRUE(list.allocate(100, 1, offset));
+
+  EXPECT_EQ(offset, 0);
+  EXPECT_EQ(list.ranges(), Ranges({ { 100, 924 } }));
+}
+
+TEST(FreeListTest, keepsSpaceSkippedForAlignmentFree) {
+  FreeList list(1024);
+
+  uint64_t a = 0;
+  uint64_t b = 0;
+  ASSERT_TRUE(list.allocate(10, 1, a));
+  ASSERT_TRUE(list.allocate(100, 64, b));
+
+  EXPECT_EQ(b, 64);
+  EXPECT_EQ(list.ranges(), Ranges({ { 10, 54 }, { 164, 860 } }));
+}
+
+TEST(FreeListTest, firstFitUsesTheLowestRangeThatFits) {
+  FreeList list(1024);
+
+  uint64_t a = 0;
+  uint64_t b = 0;
+  uint64_t c = 0;
+  ASSERT_TRUE(list.allocate(100, 1, a));
+  ASSERT_TRUE(list.allocate(100, 1, b));
+  ASSERT_TRUE(list.allocate(100, 1, c));
+  list.free(a, 100);
+
+  uint64_t small = 0;
+  uint64_t large = 0;
+  ASSERT_TRUE(list.allocate(50, 1, small));
+  ASSERT_TRUE(list.allocate(200, 1, large));
+
+  EXPECT_EQ(small, 0);
+  EXPECT_EQ(large, 300);
+  EXPECT_EQ(list.ranges(), Ranges({ { 50, 50 }, { 500, 524 } }));
+}
+
+TEST(FreeListTest, failsWhenNoRangeIsLargeEnough) {
+  FreeList list(256);
+
+  uint64_t a = 0;
+  uint64_t b = 0;
+  ASSERT_TRUE(list.allocate(100, 1, a));
+  ASSERT_TRUE(list.allocate(100, 1, b));
+  list.free(a, 100);
+
+  uint64_t offset = 7;
+  EXPECT_FALSE(list.allocate(150, 1, offset));
+  EXPECT_EQ(offset, 7);
+
+  ASSERT_TRUE(list.allocate(100, 1, a));
+  // Fits in what's left, but not once aligned
+  EXPECT_FALSE(list.allocate(50, 128, offset));
+}
+
+TEST(FreeListTest, mergesWithNextRange) {
+  FreeList list(300);
+
+  uint64_t a = 0;
+  uint64_t b = 0;
+  ASSERT_TRUE(list.allocate(100, 1, a));
+  ASSERT_TRUE(list.allocate(100, 1, b));
+  list.free(b, 100);
+
+  EXPECT_EQ(list.ranges(), Ranges({ { 100, 200 } }));
+}
+
+TEST(FreeListTest, mergesWithPreviousRange) {
+  FreeList list(300);
+
+  uint64_t a = 0;
+  uint64_t b = 0;
+  uint64_t c = 0;
+  ASSERT_TRUE(list.allocate(100, 1, a));
+  ASSERT_TRUE(list.allocate(100, 1, b));
+  ASSERT_TRUE(list.allocate(100, 1, c));
+  list.free(a, 100);
+  list.free(b, 100);
+
+  EXPECT_EQ(list.ranges(), Ranges({ { 0, 200 } }));
+}
+
+TEST(FreeListTest, mergesWithBothNeighbours) {
+  FreeList list(300);
+
+  uint64_t a = 0;
+  uint64_t b = 0;
+  uint64_t c = 0;
+  ASSERT_TRUE(list.allocate(100, 1, a));
+  ASSERT_TRUE(list.allocate(100, 1, b));
+  ASSERT_TRUE(list.allocate(100, 1, c));
+  list.free(a, 100);
+  list.free(c, 100);
+  EXPECT_EQ(list.ranges(), Ranges({ { 0, 100 }, { 200, 100 } }));
+
+  list.free(b, 100);
+  EXPECT_EQ(list.ranges(), Ranges({ { 0, 300 } }));
+}
+
+TEST(FreeListTest, freeingEverythingInAnyOrderRestoresTheWholeBlock) {
+  FreeList list(1000);
+
+  uint64_t offsets[10];
+  for (uint64_t& offset : offsets) {
+    ASSERT_TRUE(list.allocate(100, 1, offset));
+  }
+  EXPECT_TRUE(list.ranges().empty());
+
+  for (size_t i : { 3, 7, 0, 9, 5, 1, 8, 2, 6, 4 }) {
+    list.free(offsets[i], 100);
+  }
+
+  EXPECT_EQ(list.ranges(), Ranges({ { 0, 1000 } }));
+}
@@ -0,0 +1,123 @@
+#include "gpu_steps.hpp"
+#include <gtest/gtest.h>
+
+namespace {
+
+GpuComputationStep dispatchStep(size_t shader) {
+  GpuComputationStep step;
+  step.shader = shader;
+  step.numWorkgroups = shader + 1;
+  step.parameters = { uint32_t(shader) };
+  return step;
+}
+
+GpuComputationStep loopBegin(size_t iterations, size_t match) {
+  GpuComputationStep step;
+  step.kind = GpuComputationStep::Kind::LoopBegin;
+  step.iterations = iterations;
+  step.match = match;
+  return step;
+}
+
+GpuComputationStep loopEnd(size_t match) {
+  GpuComputationStep step;
+  step.kind = GpuComputationStep::Kind::LoopEnd;
+  step.match = match;
+  return step;
+}
+
+std::vector<size_t> shaders(const std::vector<GpuDispatch>& dispatches) {
+  std::vector<size_t> result;
+  for (const GpuDispatch& dispatch : dispatches) {
+    result.push_back(dispatch.shader);
+  }
+  return result;
+}
+
+}
+
+TEST(GpuStepsTest, keepsDispatchesInOrder) {
+  auto dispatches = unrollSteps({ dispatchStep(0), dispatchStep(1), dispatchStep(2) });
+
+  ASSERT_EQ(shaders(dispatches), std::vector<size_t>({ 0, 1, 2 }));
+  EXPECT_EQ(dispatches[2].numWorkgroups, 3);
+  EXPECT_EQ(dispatches[2].parameters, std::vector<uint32_t>({ 2 }));
+}
+
+TEST(GpuStepsTest, repeatsLoopBody) {
+  auto dispatches = unrollSteps({
+    dispatchStep(0),
+    loopBegin(3, 4),
+    dispatchStep(1),
+    dispatchStep(2),
+    loopEnd(1),
+    dispatchStep(3)
+  });
+
+  EXPECT_EQ(shaders(dispatches), std::vector<size_t>({ 0, 1, 2, 1, 2, 1, 2, 3 }));
+}
+
+TEST(GpuStepsTest, skipsLoopsOfZeroIterations) {
+  auto dispatches = unrollSteps({
+    dispatchStep(0),
+    loopBegin(0, 3),
+    dispatchStep(1),
+    loopEnd(1),
+    dispatchStep(2)
+  });
+
+  EXPECT_EQ(shaders(dispatches), std::vector<size_t>({ 0, 2 }));
+}
+
+TEST(GpuStepsTest, repeatsNestedLoops) {
+  auto dispatches = unrollSteps({
+    loopBegin(2, 6),
+    dispatchStep(0),
+    loopBegin(3, 4),
+    dispatchStep(1),
+    loopEnd(2),
+    dispatchStep(2),
+    loopEnd(0)
+  });
+
+  EXPECT_EQ(shaders(dispatches), std::vector<size_t>({ 0, 1, 1, 1, 2, 0, 1, 1, 1, 2 }));
+}
+
+TEST(GpuStepsTest, handlesEmptyLoopBody) {
+  auto dispatches = unrollSteps({ loopBegin(5, 1), loopEnd(0), dispatchStep(0) });
+
+  EXPECT_EQ(shaders(dispatches), std::vector<size_t>({ 0 }));
+}
+
+TEST(GpuStepsTest, unrollsLoopsUpToTheLimit) {
+  auto dispatches = unrollSteps({
+    dispatchStep(0),
+    loopBegin(MaxUnrolledDispatches - 1, 3),
+    dispatchStep(1),
+    loopEnd(1)
+  });
+
+  EXPECT_EQ(dispatches.size(), MaxUnrolledDispatches);
+}
+
+TEST(GpuStepsTest, throwsIfLoopsExpandTooFar) {
+  EXPECT_THROW(unrollSteps({
+    dispatchStep(0),
+    loopBegin(MaxUnrolledDispatches, 3),
+    dispatchStep(1),
+    loopEnd(1)
+  }), std::runtime_error);
+}
+
+TEST(GpuStepsTest, throwsIfNestedLoopsExpandTooFar) {
+  size_t huge = size_t(1) << 40;
+
+  EXPECT_THROW(unrollSteps({
+    loopBegin(huge, 5),
+    loopBegin(huge, 4),
+    dispatchStep(0),
+    dispatchStep(1),
+    loopEnd(1),
+    loopEnd(0)
+  }), std::runtime_error);
+}
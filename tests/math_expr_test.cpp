@@ -0,0 +1,122 @@
+#include "math.hpp"
+#include <gtest/gtest.h>
+#include <utility>
+#include <cmath>
+
+namespace {
+
+Vector makeVector(std::initializer_list<netfloat_t> values) {
+  return Vector(values);
+}
+
+}
+
+TEST(MathExprTest, evaluatesExpressionIntoVector) {
+  Vector a{ 1, 2, 3 };
+  Vector b{ 4, 5, 6 };
+
+  Vector c = a + b * 2.0 - 1.0;
+
+  EXPECT_EQ(c, Vector({ 8, 11, 14 }));
+}
+
+TEST(MathExprTest, autoExpressionKeepsTemporaryOperandsAlive) {
+  Matrix M{
+    { 1, 2 },
+    { 3, 4 }
+  };
+  Vector v{ 1, 1 };
+  Vector b{ 10, 20 };
+
+  // M * v returns a temporary Vector, which the expression has to own
+  auto r = M * v + b;
+  auto s = makeVector({ 1, 2 }) * 3.0;
+
+  // Overwrite the stack the temporaries were on
+  Vector other = M * Vector{ 5, 6 };
+
+  EXPECT_EQ(Vector(r), Vector({ 13, 27 }));
+  EXPECT_EQ(Vector(s), Vector({ 3, 6 }));
+  EXPECT_EQ(other, Vector({ 17, 39 }));
+}
+
+TEST(MathExprTest, autoExpressionReadsNamedOperandsWhenEvaluated) {
+  Vector a{ 1, 2 };
+  Vector b{ 3, 4 };
+
+  auto x = a + b;
+  a[0] = 10;
+
+  EXPECT_EQ(x.eval(), Vector({ 13, 6 }));
+}
+
+TEST(MathExprTest, movedOperandIsOwnedByExpression) {
+  Vector a{ 1, 2 };
+  Vector b{ 3, 4 };
+
+  auto x = std::move(a) + b;
+
+  EXPECT_EQ(a.data(), nullptr);
+  EXPECT_EQ(x.eval(), Vector({ 4, 6 }));
+}
+
+TEST(MathExprTest, reductionsOnExpressions) {
+  Vector a{ 1, 2, 3 };
+  Vector b{ 2, 2, 2 };
+
+  EXPECT_FLOAT_EQ((a - b).squareMagnitude(), 2);
+  EXPECT_FLOAT_EQ((a - b).magnitude(), std::sqrt(2.0f));
+  EXPECT_FLOAT_EQ((a + b).sum(), 12);
+  EXPECT_FLOAT_EQ((a + b).dot(a - b), 2);
+  EXPECT_FLOAT_EQ((a + b).dot(b), 24);
+}
+
+TEST(MathExprTest, hadamardMemberIsEager) {
+  Vector a{ 1, 2, 3 };
+  Vector b{ 4, 5, 6 };
+
+  Vector c = a.hadamard(b);
+
+  EXPECT_FLOAT_EQ(a.hadamard(b).sum(), 32);
+  EXPECT_EQ(c, Vector({ 4, 10, 18 }));
+}
+
+TEST(MathExprTest, compoundAssignmentWithExpression) {
+  Vector a{ 1, 2 };
+  Vector b{ 3, 4 };
+
+  a += b * 2.0;
+  EXPECT_EQ(a, Vector({ 7, 10 }));
+
+  a -= hadamard(b, b);
+  EXPECT_EQ(a, Vector({ -2, -6 }));
+}
+
+TEST(MathExprTest, matrixExpressions) {
+  Matrix A{
+    { 1, 2 },
+    { 3, 4 }
+  };
+  Matrix B{
+    { 1, 1 },
+    { 1, 1 }
+  };
+
+  Matrix C = (A - B) * 2.0;
+  auto D = A.transpose() + B;
+
+  EXPECT_EQ(C, Matrix({ { 0, 2 }, { 4, 6 } }));
+  EXPECT_EQ(Matrix(D), Matrix({ { 2, 4 }, { 3, 5 } }));
+  EXPECT_FLOAT_EQ((A + B).sum(), 14);
+}
+
+TEST(MathExprTest, transformKeepsTemporaryOperandAlive) {
+  Matrix M{
+    { 1, 0 },
+    { 0, 1 }
+  };
+
+  auto t = transform(M * Vector{ -1, 2 }, [](netfloat_t x) { return x < 0 ? 0 : x; });
+
+  EXPECT_EQ(Vector(t), Vector({ 0, 2 }));
+}
@@ -0,0 +1,80 @@
+#include "math.hpp"
+#include <gtest/gtest.h>
+
+namespace {
+
+// The product, with each element computed by dot() outside any parallel region
+Vector rowDots(const Matrix& M, const Vector& V) {
+  Vector R(M.rows());
+  for (size_t r = 0; r < M.rows(); ++r) {
+    R[r] = dot(M.view().row(r), V.view());
+  }
+  return R;
+}
+
+}
+
+TEST(MathTest, matVecMultiplyOfManyRowsMatchesRowDots) {
+  Matrix M(100, 5000);
+  Vector V(100);
+  M.randomize(1.0, 1);
+  V.randomize(1.0, 2);
+
+  Vector R(M.rows());
+  matVecMultiply(M.view(), V.view(), R.view());
+
+  EXPECT_EQ(R, rowDots(M, V));
+}
+
+TEST(MathTest, matVecMultiplyOfLongRowsMatchesRowDots) {
+  Matrix M(20000, 40);
+  Vector V(20000);
+  M.randomize(1.0, 3);
+  V.randomize(1.0, 4);
+
+  Vector R(M.rows());
+  matVecMultiply(M.view(), V.view(), R.view());
+
+  EXPECT_EQ(R, rowDots(M, V));
+}
+
+TEST(MathTest, matVecMultiplyWritesThroughStridedView) {
+  Matrix M(300, 600);
+  Vector V(300);
+  M.randomize(1.0, 5);
+  V.randomize(1.0, 6);
+
+  Matrix out(2, M.rows());
+  out.zero();
+  matVecMultiply(M.view(), V.view(), out.view().column(1));
+
+  Vector expected = rowDots(M, V);
+  for (size_t r = 0; r < M.rows(); ++r) {
+    EXPECT_EQ(out.at(1, r), expected[r]);
+    EXPECT_EQ(out.at(0, r), 0);
+  }
+}
+
+TEST(MathTest, movingShallowVectorKeepsItShallow) {
+  DataArray data(10);
+  VectorPtr shallow = Vector::createShallow(data);
+
+  Vector moved(std::move(*shallow));
+  moved.fill(3);
+
+  EXPECT_TRUE(moved.isShallow());
+  EXPECT_EQ(moved.data(), data.data());
+  EXPECT_EQ(data[9], 3);
+  EXPECT_EQ(shallow->size(), 0);
+}
+
+TEST(MathTest, movingOwningVectorTransfersStorage) {
+  Vector V(10);
+  const netfloat_t* data = V.data();
+
+  Vector moved(std::move(V));
+
+  EXPECT_FALSE(moved.isShallow());
+  EXPECT_EQ(moved.data(), data);
+  EXPECT_EQ(V.size(), 0);
+}